@@ -13,6 +13,125 @@
 #include <stdlib.h>
 #include <string.h>
 
+/* Use SSE2 and AVX2 kernels for the hottest loops on x86 CPUs, selected at
+   run time.  Define SONIC_NO_SIMD to use only the portable C versions. */
+#if !defined(SONIC_NO_SIMD) && defined(__GNUC__) && \
+    (defined(__x86_64__) || defined(__i386__))
+#define SONIC_X86_SIMD
+#include <immintrin.h>
+#endif
+
+/* The stream pool is shared between threads, so it is guarded by a mutex,
+   and the parallel batch functions and the scheduler start threads of their
+   own.  Define SONIC_NO_THREADS to build without any of these, when sonic is
+   only ever used from a single thread.  The parallel batch functions then work
+   serially, and there is no scheduler. */
+#if defined(SONIC_NO_THREADS)
+typedef int sonicMutex;
+#define SONIC_MUTEX_INITIALIZER 0
+#define sonicLockMutex(mutex) ((void)(mutex))
+#define sonicUnlockMutex(mutex) ((void)(mutex))
+#elif defined(_WIN32)
+#include <windows.h>
+typedef SRWLOCK sonicMutex;
+#define SONIC_MUTEX_INITIALIZER SRWLOCK_INIT
+#define sonicLockMutex(mutex) AcquireSRWLockExclusive(mutex)
+#define sonicUnlockMutex(mutex) ReleaseSRWLockExclusive(mutex)
+typedef HANDLE sonicThread;
+#define SONIC_THREAD_FUNCTION(name, arg) static DWORD WINAPI name(LPVOID arg)
+#define SONIC_THREAD_RETURN 0
+#define sonicStartThread(thread, function, arg) \
+  ((*(thread) = CreateThread(NULL, 0, function, arg, 0, NULL)) != NULL)
+#define sonicJoinThread(thread) \
+  (WaitForSingleObject(thread, INFINITE), CloseHandle(thread))
+#define sonicInitMutex(mutex) InitializeSRWLock(mutex)
+#define sonicDestroyMutex(mutex) ((void)(mutex))
+typedef CONDITION_VARIABLE sonicCondition;
+#define sonicInitCondition(condition) InitializeConditionVariable(condition)
+#define sonicDestroyCondition(condition) ((void)(condition))
+#define sonicWaitCondition(condition, mutex) \
+  SleepConditionVariableSRW(condition, mutex, INFINITE, 0)
+#define sonicSignalCondition(condition) WakeConditionVariable(condition)
+#define sonicBroadcastCondition(condition) WakeAllConditionVariable(condition)
+#else
+#include <pthread.h>
+typedef pthread_mutex_t sonicMutex;
+#define SONIC_MUTEX_INITIALIZER PTHREAD_MUTEX_INITIALIZER
+#define sonicLockMutex(mutex) pthread_mutex_lock(mutex)
+#define sonicUnlockMutex(mutex) pthread_mutex_unlock(mutex)
+typedef pthread_t sonicThread;
+#define SONIC_THREAD_FUNCTION(name, arg) static void* name(void* arg)
+#define SONIC_THREAD_RETURN NULL
+#define sonicStartThread(thread, function, arg) \
+  (pthread_create(thread, NULL, function, arg) == 0)
+#define sonicJoinThread(thread) pthread_join(thread, NULL)
+#define sonicInitMutex(mutex) pthread_mutex_init(mutex, NULL)
+#define sonicDestroyMutex(mutex) pthread_mutex_destroy(mutex)
+typedef pthread_cond_t sonicCondition;
+#define sonicInitCondition(condition) pthread_cond_init(condition, NULL)
+#define sonicDestroyCondition(condition) pthread_cond_destroy(condition)
+#define sonicWaitCondition(condition, mutex) pthread_cond_wait(condition, mutex)
+#define sonicSignalCondition(condition) pthread_cond_signal(condition)
+#define sonicBroadcastCondition(condition) pthread_cond_broadcast(condition)
+#include <time.h>
+#endif
+
+/* At most this many idle streams are kept in the stream pool. */
+#ifndef SONIC_MAX_POOLED_STREAMS
+#define SONIC_MAX_POOLED_STREAMS 16
+#endif
+
+/* The parallel batch functions split the buffer into this many segments per
+   thread, so threads that finish early can take on more, and no segment is
+   shorter than SONIC_MIN_SEGMENT_SECONDS. */
+#define SONIC_SEGMENTS_PER_THREAD 4
+#define SONIC_MIN_SEGMENT_SECONDS 10
+
+/* Segments are written to their streams this many samples at a time. */
+#define SONIC_SEGMENT_WRITE_CHUNK 4096
+
+/* The pruned pitch search checks whether a period can still win after summing
+   each block of this many samples. */
+#define SONIC_PRUNE_BLOCK_SIZE 128
+
+/* The FFT pitch detector picks the first normalized dip below this. */
+#define SONIC_FFT_PITCH_THRESHOLD 0.15
+
+/* Each level of the pitch search pyramid is down-sampled this many times less
+   than the one before. */
+#define SONIC_PITCH_PYRAMID_RATIO 4
+
+/* Silence is detected a block of this many samples at a time. */
+#define SONIC_SILENCE_BLOCK_SIZE 128
+
+/* When looking for the loudest channel, only look at every Nth frame. */
+#define SONIC_LOUDEST_CHANNEL_STEP 8
+
+/* Samples converted through a small array, from one format to another or in
+   place, are converted this many at a time. */
+#define SONIC_CONVERSION_CHUNK 64
+
+/* 32-bit and 24-bit samples hold a short in their high bits, so their full
+   scale, which a float of 1.0 converts to, is 32767 shifted up. */
+#define SONIC_INT_FULL_SCALE 2147418112.0
+#define SONIC_INT24_FULL_SCALE 8388352.0
+
+/* M_PI is not defined by strict ANSI C. */
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+/* Overlap-adds this long or longer divide rather than using a fixed-point
+   reciprocal, since the ramp weights would not fit in 16 bits. */
+#define SONIC_MAX_RECIPROCAL_OVERLAP 32768
+
+/* An unsigned type of at least 64 bits, for fixed-point products. */
+#if ULONG_MAX > 0xffffffffUL
+typedef unsigned long sonicUint64;
+#else
+typedef unsigned long long sonicUint64;
+#endif
+
 /*
     The following code was used to generate the following sinc lookup table.
 
@@ -49,6 +168,10 @@
     }
 */
 
+/* When tracking pitch, search for the new period within prevPeriod/8 of the
+   previous one. */
+#define SONIC_PITCH_TRACKING_BAND_SHIFT 3
+
 #define CLAMP(val, min, max) \
   ((val) < (min) ? (min) : (val) > (max) ? (max) : (val))
 
@@ -56,6 +179,9 @@
 #define SINC_FILTER_POINTS \
   12 /* I am not able to hear improvement with higher N. */
 #define SINC_TABLE_SIZE 601
+/* The number of points in the SONIC_RESAMPLER_HIGH_QUALITY filter, which is
+   also the most used by any resampler. */
+#define SONIC_HQ_FILTER_POINTS 32
 
 /* Lookup table for windowed sinc function of SINC_FILTER_POINTS points. */
 static short sincTable[SINC_TABLE_SIZE] = {
@@ -185,10 +311,44 @@ struct sonicStreamStruct {
 #ifdef SONIC_SPECTROGRAM
   sonicSpectrogram spectrogram;
 #endif /* SONIC_SPECTROGRAM */
+  /* The input, output and pitch buffers hold their samples starting at
+     inputBuffer, outputBuffer and pitchBuffer.  Samples are removed from the
+     front by advancing these past them, and they are only moved back to the
+     start of the allocated buffers when more room is needed at the end.  When
+     floatSamples is set, they hold floats instead, each taking the space of
+     two shorts. */
   short* inputBuffer;
   short* outputBuffer;
   short* pitchBuffer;
+  short* inputBufferBase;
+  short* outputBufferBase;
+  short* pitchBufferBase;
   short* downSampleBuffer;
+  /* A 16-bit copy of the pitch search window, used when the buffers hold
+     floats, since the pitch search always works on 16-bit samples. */
+  short* analysisBuffer;
+  /* Used by the incremental pitch search to remember the AMDF sum for each
+     period, and the window of samples they were computed over. */
+  unsigned long* pitchDiffs;
+  short* pitchWindow;
+  /* Used by the pruned pitch search to remember the partial AMDF sum for each
+     period, and how many samples it covers. */
+  unsigned long* prunedDiffs;
+  int* prunedCounts;
+  /* Used by the FFT pitch detector: the real and imaginary FFT buffers, one
+     after the other, the FFT twiddle factors, and prefix sums of the squared
+     samples. */
+  float* fftBuffer;
+  float* fftTwiddles;
+  double* fftEnergies;
+  /* The resampling filter bank: the sinc filter weights for each phase of the
+     current rate ratio, filled in as phases are first used. */
+  short* rateWeights;
+#ifdef SONIC_USE_SIN
+  /* The sine ramp used by the last overlap-add, and its length. */
+  float* sineRamp;
+  int sineRampSize;
+#endif /* SONIC_USE_SIN */
   void* userData;
   float speed;
   float volume;
@@ -217,6 +377,20 @@ struct sonicStreamStruct {
   float timeError;
   int oldRatePosition;
   int newRatePosition;
+  /* The reduced sample rates and resampler the filter bank was built for, the
+     spacing between its phases, and how many weights there is room for. */
+  int rateWeightsOldRate;
+  int rateWeightsNewRate;
+  int rateWeightsResampler;
+  int rateWeightsStep;
+  int rateWeightsSize;
+  /* The fixed-point volume the kernels writing to the output buffer scale
+     samples by as they store them, or 0 to store them unscaled.  It is only
+     set while processing input, since the speed change does not apply the
+     volume when it writes to the pitch buffer for the rate change.  The float
+     kernels scale by the volume itself when this is not 0. */
+  int outputVolume;
+  int resampler;
   int quality;
   int numChannels;
   int inputBufferSize;
@@ -232,8 +406,130 @@ struct sonicStreamStruct {
   int sampleRate;
   int prevPeriod;
   int prevMinDiff;
+  int prevMaxDiff;
+  /* The position in the input stream of the first sample in the input buffer.
+   */
+  long inputStreamPosition;
+  /* The position, skip, range and channel of the last incremental pitch
+     search.  The saved AMDF sums are only reused if pitchWindowValid is
+     set. */
+  long pitchWindowPosition;
+  int pitchWindowSkip;
+  int pitchWindowMinPeriod;
+  int pitchWindowMaxPeriod;
+  int pitchWindowChannel;
+  int pitchWindowValid;
+  int incrementalPitchSearch;
+  int pitchTracking;
+  int pitchDetector;
+  int fftSize;
+  /* The channel to search for the pitch period, as set by the user, and the
+     one chosen for the current search. */
+  int pitchChannel;
+  int activePitchChannel;
+  int pitchPyramid;
+  int silenceThreshold;
+  /* The number of input samples that took the silence fast path. */
+  long silentSamples;
+  int pitchPruning;
+  /* The number of samples the pruned pitch search did not have to sum. */
+  long pitchSamplesPruned;
+  /* Streams made by sonicCreateStreamInBuffer allocate everything, including
+     this struct, from the caller's block at arena rather than the heap.
+     arenaLast is the most recent allocation, which can grow in place. */
+  unsigned char* arena;
+  size_t arenaSize;
+  size_t arenaUsed;
+  unsigned char* arenaLast;
+  int maxChunk;
+  /* Set if the input, output and pitch buffers hold floats rather than
+     shorts.  frameWidth is the number of shorts each frame of them takes,
+     which is numChannels, or twice that for floats. */
+  int floatSamples;
+  int frameWidth;
+  /* The most bytes the input, output and pitch buffers may grow to, or 0 for
+     no limit. */
+  size_t maxMemory;
+  /* The next idle stream in the stream pool. */
+  sonicStream nextPooledStream;
+  /* The stream's state in the scheduler it was added to, if any. */
+  struct sonicTaskStruct* task;
 };
 
+static void removeFromScheduler(sonicStream stream);
+
+/* Allocations from caller-provided memory start on cache line boundaries. */
+#define SONIC_CACHE_LINE_SIZE 64
+
+/* Round len up to a whole number of cache lines. */
+static size_t roundUpToCacheLine(size_t len) {
+  return (len + SONIC_CACHE_LINE_SIZE - 1) / SONIC_CACHE_LINE_SIZE *
+         SONIC_CACHE_LINE_SIZE;
+}
+
+/* Allocate zeroed elements from the stream's block of memory. */
+static void* arenaCalloc(sonicStream stream, size_t num, size_t size) {
+  size_t len = roundUpToCacheLine(num * size);
+  unsigned char* p;
+
+  if (len > stream->arenaSize - stream->arenaUsed) {
+    return NULL;
+  }
+  p = stream->arena + stream->arenaUsed;
+  stream->arenaUsed += len;
+  stream->arenaLast = p;
+  memset(p, 0, len);
+  return p;
+}
+
+/* Allocate zeroed elements for the stream, from its block of memory if it has
+   one. */
+static void* streamCalloc(sonicStream stream, int num, int size) {
+  if (stream->arena != NULL) {
+    return arenaCalloc(stream, num, size);
+  }
+  return sonicCalloc(num, size);
+}
+
+/* Resize an allocation made by streamCalloc.  In a block of memory, only the
+   most recent allocation can grow in place, and the space used by others is
+   not reclaimed when they move. */
+static void* streamRealloc(sonicStream stream, void* p, int oldNum, int newNum,
+                           int size) {
+  unsigned char* newBuffer;
+  size_t oldLen, newLen;
+
+  if (stream->arena == NULL) {
+    return sonicRealloc(p, oldNum, newNum, size);
+  }
+  if (newNum <= oldNum) {
+    return p;
+  }
+  if (p != NULL && p == stream->arenaLast) {
+    oldLen = roundUpToCacheLine((size_t)oldNum * size);
+    newLen = roundUpToCacheLine((size_t)newNum * size);
+    if (newLen - oldLen > stream->arenaSize - stream->arenaUsed) {
+      return NULL;
+    }
+    memset(stream->arenaLast + oldLen, 0, newLen - oldLen);
+    stream->arenaUsed += newLen - oldLen;
+    return p;
+  }
+  newBuffer = (unsigned char*)arenaCalloc(stream, newNum, size);
+  if (newBuffer != NULL && p != NULL) {
+    memcpy(newBuffer, p, (size_t)oldNum * size);
+  }
+  return newBuffer;
+}
+
+/* Free an allocation made by streamCalloc.  Memory in a stream's block is
+   only released when the caller is done with the whole block. */
+static void streamFree(sonicStream stream, void* p) {
+  if (stream->arena == NULL) {
+    sonicFree(p);
+  }
+}
+
 /* Attach user data to the stream. */
 void sonicSetUserData(sonicStream stream, void* userData) {
   stream->userData = userData;
@@ -258,21 +554,315 @@ sonicSpectrogram sonicGetSpectrogram(sonicStream stream) {
 
 #endif
 
-/* Scale the samples by the factor. */
-static void scaleSamples(short* samples, int numSamples, float volume) {
-  /* This is 24-bit integer and 8-bit fraction fixed-point representation. */
-  int fixedPointVolume = volume * 256.0f;
+/* Return the fixed-point volume the output kernels scale by, with an 8-bit
+   fraction, or 0 if the volume is 1 and samples are left as they are. */
+static int findFixedPointVolume(float volume) {
+  if (volume == 1.0f) {
+    return 0;
+  }
+  return volume * 256.0f;
+}
+
+/* Convert a float sample to a short.  It is rounded, so shorts converted to
+   floats convert back exactly, and clipped, since float samples can be louder
+   than 1.0. */
+static short floatToShort(float sample) {
+  float value = sample * 32767.0f;
+
+  if (value >= 32767.0f) {
+    return 32767;
+  }
+  if (value <= -32768.0f) {
+    return -32768;
+  }
+  return (short)(value < 0.0f ? value - 0.5f : value + 0.5f);
+}
+
+/* Scale one sample by a fixed-point volume from findFixedPointVolume. */
+static short scaleSample(short sample, int volume) {
   int value;
 
+  if (volume == 0) {
+    return sample;
+  }
+  value = (sample * volume) >> 8;
+  if (value > 32767) {
+    value = 32767;
+  } else if (value < -32767) {
+    value = -32767;
+  }
+  return value;
+}
+
+/* Convert a short sample to a float.  This multiplies by the reciprocal
+   rather than dividing, the same as the SIMD conversion kernels. */
+static float shortToFloat(short sample) { return sample * (1.0f / 32767.0f); }
+
+/* Convert a 32-bit sample to a short, rounding and clipping it. */
+static short intToShort(int sample) {
+  int value = (sample >> 16) + ((sample >> 15) & 1);
+
+  return value > 32767 ? 32767 : value;
+}
+
+/* Convert a float sample to an integer sample with the given scale, rounding
+   and clipping it to maxValue. */
+static long floatToInteger(float sample, double scale, long maxValue) {
+  double value = sample * scale;
+
+  if (value >= maxValue) {
+    return maxValue;
+  }
+  if (value <= -maxValue - 1.0) {
+    return -maxValue - 1;
+  }
+  return (long)(value < 0.0 ? value - 0.5 : value + 0.5);
+}
+
+/* Read a packed 24-bit little-endian sample. */
+static long readInt24(const unsigned char* sample) {
+  long value = sample[0] | ((long)sample[1] << 8);
+
+  return value + (long)(signed char)sample[2] * 65536;
+}
+
+/* Write a packed 24-bit little-endian sample. */
+static void writeInt24(unsigned char* sample, long value) {
+  sample[0] = value & 0xff;
+  sample[1] = (value >> 8) & 0xff;
+  sample[2] = (value >> 16) & 0xff;
+}
+
+/* Convert a packed 24-bit sample to a short, rounding and clipping it. */
+static short int24ToShort(const unsigned char* sample) {
+  long value = readInt24(sample);
+
+  value = (value >> 8) + ((value >> 7) & 1);
+  return value > 32767 ? 32767 : value;
+}
+
+/* Convert numSamples samples from one format to another.  These are the
+   reference versions of the conversion kernels, which the SIMD versions must
+   match exactly. */
+static void convertFloatsToShortsScalar(short* out, const float* in,
+                                        int numSamples) {
   while (numSamples--) {
-    value = (*samples * fixedPointVolume) >> 8;
-    if (value > 32767) {
-      value = 32767;
-    } else if (value < -32767) {
-      value = -32767;
-    }
-    *samples++ = value;
+    *out++ = floatToShort(*in++);
+  }
+}
+
+static void convertShortsToFloatsScalar(float* out, const short* in,
+                                        int numSamples) {
+  while (numSamples--) {
+    *out++ = shortToFloat(*in++);
+  }
+}
+
+static void convertUnsignedCharsToShortsScalar(short* out,
+                                               const unsigned char* in,
+                                               int numSamples) {
+  while (numSamples--) {
+    *out++ = (*in++ - 128) * 256;
+  }
+}
+
+static void convertShortsToUnsignedCharsScalar(unsigned char* out,
+                                               const short* in,
+                                               int numSamples) {
+  while (numSamples--) {
+    *out++ = (unsigned char)((*in++ >> 8) + 128);
+  }
+}
+
+static void convertIntsToShortsScalar(short* out, const int* in,
+                                      int numSamples) {
+  while (numSamples--) {
+    *out++ = intToShort(*in++);
+  }
+}
+
+static void convertShortsToIntsScalar(int* out, const short* in,
+                                      int numSamples) {
+  while (numSamples--) {
+    *out++ = *in++ * 65536;
+  }
+}
+
+#ifdef SONIC_X86_SIMD
+
+/* Scale 4 floats to the range of a short, and round and clip them the same
+   way as floatToShort, leaving them as 32-bit integers. */
+__attribute__((target("sse2"))) static __m128i floatLanesToShortsSSE2(
+    __m128 values) {
+  values = _mm_mul_ps(values, _mm_set1_ps(32767.0f));
+  values = _mm_add_ps(values,
+                      _mm_or_ps(_mm_and_ps(values, _mm_set1_ps(-0.0f)),
+                                _mm_set1_ps(0.5f)));
+  values = _mm_min_ps(_mm_max_ps(values, _mm_set1_ps(-32768.0f)),
+                      _mm_set1_ps(32767.0f));
+  return _mm_cvttps_epi32(values);
+}
+
+/* SSE2 version of convertFloatsToShortsScalar. */
+__attribute__((target("sse2"))) static void convertFloatsToShortsSSE2(
+    short* out, const float* in, int numSamples) {
+  __m128i low, high;
+  int i;
+
+  for (i = 0; i + 8 <= numSamples; i += 8) {
+    low = floatLanesToShortsSSE2(_mm_loadu_ps(in + i));
+    high = floatLanesToShortsSSE2(_mm_loadu_ps(in + i + 4));
+    _mm_storeu_si128((__m128i*)(out + i), _mm_packs_epi32(low, high));
+  }
+  convertFloatsToShortsScalar(out + i, in + i, numSamples - i);
+}
+
+/* SSE2 version of convertShortsToFloatsScalar.  Each short is sign extended
+   by unpacking it into the high half of a 32-bit lane and shifting it down. */
+__attribute__((target("sse2"))) static void convertShortsToFloatsSSE2(
+    float* out, const short* in, int numSamples) {
+  __m128 scale = _mm_set1_ps(1.0f / 32767.0f);
+  __m128i samples, low, high;
+  int i;
+
+  for (i = 0; i + 8 <= numSamples; i += 8) {
+    samples = _mm_loadu_si128((const __m128i*)(in + i));
+    low = _mm_srai_epi32(_mm_unpacklo_epi16(samples, samples), 16);
+    high = _mm_srai_epi32(_mm_unpackhi_epi16(samples, samples), 16);
+    _mm_storeu_ps(out + i, _mm_mul_ps(_mm_cvtepi32_ps(low), scale));
+    _mm_storeu_ps(out + i + 4, _mm_mul_ps(_mm_cvtepi32_ps(high), scale));
+  }
+  convertShortsToFloatsScalar(out + i, in + i, numSamples - i);
+}
+
+/* SSE2 version of convertUnsignedCharsToShortsScalar.  Flipping the top bit
+   of each byte subtracts 128, and unpacking it into the high byte of a short
+   multiplies it by 256. */
+__attribute__((target("sse2"))) static void convertUnsignedCharsToShortsSSE2(
+    short* out, const unsigned char* in, int numSamples) {
+  __m128i zero = _mm_setzero_si128();
+  __m128i samples;
+  int i;
+
+  for (i = 0; i + 16 <= numSamples; i += 16) {
+    samples = _mm_xor_si128(_mm_loadu_si128((const __m128i*)(in + i)),
+                            _mm_set1_epi8((char)0x80));
+    _mm_storeu_si128((__m128i*)(out + i), _mm_unpacklo_epi8(zero, samples));
+    _mm_storeu_si128((__m128i*)(out + i + 8),
+                     _mm_unpackhi_epi8(zero, samples));
+  }
+  convertUnsignedCharsToShortsScalar(out + i, in + i, numSamples - i);
+}
+
+/* SSE2 version of convertShortsToUnsignedCharsScalar.  After shifting, every
+   value fits in a signed byte, so packing them never saturates. */
+__attribute__((target("sse2"))) static void convertShortsToUnsignedCharsSSE2(
+    unsigned char* out, const short* in, int numSamples) {
+  __m128i low, high;
+  int i;
+
+  for (i = 0; i + 16 <= numSamples; i += 16) {
+    low = _mm_srai_epi16(_mm_loadu_si128((const __m128i*)(in + i)), 8);
+    high = _mm_srai_epi16(_mm_loadu_si128((const __m128i*)(in + i + 8)), 8);
+    _mm_storeu_si128((__m128i*)(out + i),
+                     _mm_xor_si128(_mm_packs_epi16(low, high),
+                                   _mm_set1_epi8((char)0x80)));
+  }
+  convertShortsToUnsignedCharsScalar(out + i, in + i, numSamples - i);
+}
+
+/* Round 4 32-bit samples to 16 bits the same way as intToShort, leaving them
+   as 32-bit integers.  Packing them clips the one value that can overflow. */
+__attribute__((target("sse2"))) static __m128i intLanesToShortsSSE2(
+    __m128i values) {
+  return _mm_add_epi32(_mm_srai_epi32(values, 16),
+                       _mm_and_si128(_mm_srai_epi32(values, 15),
+                                     _mm_set1_epi32(1)));
+}
+
+/* SSE2 version of convertIntsToShortsScalar. */
+__attribute__((target("sse2"))) static void convertIntsToShortsSSE2(
+    short* out, const int* in, int numSamples) {
+  __m128i low, high;
+  int i;
+
+  for (i = 0; i + 8 <= numSamples; i += 8) {
+    low = intLanesToShortsSSE2(_mm_loadu_si128((const __m128i*)(in + i)));
+    high = intLanesToShortsSSE2(_mm_loadu_si128((const __m128i*)(in + i + 4)));
+    _mm_storeu_si128((__m128i*)(out + i), _mm_packs_epi32(low, high));
+  }
+  convertIntsToShortsScalar(out + i, in + i, numSamples - i);
+}
+
+/* SSE2 version of convertShortsToIntsScalar, which unpacks each short into
+   the high half of a 32-bit lane. */
+__attribute__((target("sse2"))) static void convertShortsToIntsSSE2(
+    int* out, const short* in, int numSamples) {
+  __m128i zero = _mm_setzero_si128();
+  __m128i samples;
+  int i;
+
+  for (i = 0; i + 8 <= numSamples; i += 8) {
+    samples = _mm_loadu_si128((const __m128i*)(in + i));
+    _mm_storeu_si128((__m128i*)(out + i), _mm_unpacklo_epi16(zero, samples));
+    _mm_storeu_si128((__m128i*)(out + i + 4),
+                     _mm_unpackhi_epi16(zero, samples));
+  }
+  convertShortsToIntsScalar(out + i, in + i, numSamples - i);
+}
+
+#endif /* SONIC_X86_SIMD */
+
+static void selectKernels(void);
+static void convertFloatsToShortsResolve(short* out, const float* in,
+                                         int numSamples);
+static void convertShortsToFloatsResolve(float* out, const short* in,
+                                         int numSamples);
+static void convertUnsignedCharsToShortsResolve(short* out,
+                                                const unsigned char* in,
+                                                int numSamples);
+static void convertShortsToUnsignedCharsResolve(unsigned char* out,
+                                                const short* in,
+                                                int numSamples);
+static void convertIntsToShortsResolve(short* out, const int* in,
+                                       int numSamples);
+static void convertShortsToIntsResolve(int* out, const short* in,
+                                       int numSamples);
+
+/* The conversion kernels to use, which are resolved along with the other
+   SIMD kernels below. */
+static void (*convertFloatsToShorts)(short* out, const float* in,
+                                     int numSamples) =
+    convertFloatsToShortsResolve;
+static void (*convertShortsToFloats)(float* out, const short* in,
+                                     int numSamples) =
+    convertShortsToFloatsResolve;
+static void (*convertUnsignedCharsToShorts)(short* out,
+                                            const unsigned char* in,
+                                            int numSamples) =
+    convertUnsignedCharsToShortsResolve;
+static void (*convertShortsToUnsignedChars)(unsigned char* out,
+                                            const short* in,
+                                            int numSamples) =
+    convertShortsToUnsignedCharsResolve;
+static void (*convertIntsToShorts)(short* out, const int* in,
+                                   int numSamples) = convertIntsToShortsResolve;
+static void (*convertShortsToInts)(int* out, const short* in,
+                                   int numSamples) = convertShortsToIntsResolve;
+
+/* Guards the one-time selection of the kernels, which every stream makes sure
+   of when it is created, before it can call any of them. */
+static sonicMutex kernelMutex = SONIC_MUTEX_INITIALIZER;
+static int kernelsSelected;
+
+/* Select the kernels for this CPU, if that has not been done yet. */
+static void initKernels(void) {
+  sonicLockMutex(&kernelMutex);
+  if (!kernelsSelected) {
+    selectKernels();
+    kernelsSelected = 1;
   }
+  sonicUnlockMutex(&kernelMutex);
 }
 
 /* Get the speed of the stream. */
@@ -327,31 +917,179 @@ void sonicSetVolume(sonicStream stream, float volume) {
   stream->volume = CLAMP(volume, SONIC_MIN_VOLUME, SONIC_MAX_VOLUME);
 }
 
+/* Free the buffers used by the incremental pitch search. */
+static void freePitchSearchBuffers(sonicStream stream) {
+  if (stream->pitchDiffs != NULL) {
+    streamFree(stream, stream->pitchDiffs);
+    stream->pitchDiffs = NULL;
+  }
+  if (stream->pitchWindow != NULL) {
+    streamFree(stream, stream->pitchWindow);
+    stream->pitchWindow = NULL;
+  }
+  stream->pitchWindowValid = 0;
+}
+
+/* Allocate the buffers used by the incremental pitch search.  Return 0 if we
+   are out of memory. */
+static int allocatePitchSearchBuffers(sonicStream stream) {
+  stream->pitchDiffs = (unsigned long*)streamCalloc(
+      stream, stream->maxPeriod + 1, sizeof(unsigned long));
+  if (stream->pitchDiffs == NULL) {
+    return 0;
+  }
+  stream->pitchWindow =
+      (short*)streamCalloc(stream, stream->maxRequired, sizeof(short));
+  if (stream->pitchWindow == NULL) {
+    return 0;
+  }
+  stream->pitchWindowValid = 0;
+  return 1;
+}
+
+/* Free the buffers used by the pruned pitch search. */
+static void freePrunedSearchBuffers(sonicStream stream) {
+  if (stream->prunedDiffs != NULL) {
+    streamFree(stream, stream->prunedDiffs);
+    stream->prunedDiffs = NULL;
+  }
+  if (stream->prunedCounts != NULL) {
+    streamFree(stream, stream->prunedCounts);
+    stream->prunedCounts = NULL;
+  }
+}
+
+/* Allocate the buffers used by the pruned pitch search.  Return 0 if we are
+   out of memory. */
+static int allocatePrunedSearchBuffers(sonicStream stream) {
+  stream->prunedDiffs = (unsigned long*)streamCalloc(
+      stream, stream->maxPeriod + 1, sizeof(unsigned long));
+  if (stream->prunedDiffs == NULL) {
+    return 0;
+  }
+  stream->prunedCounts =
+      (int*)streamCalloc(stream, stream->maxPeriod + 1, sizeof(int));
+  if (stream->prunedCounts == NULL) {
+    return 0;
+  }
+  return 1;
+}
+
+/* Free the buffers used by the FFT pitch detector. */
+static void freeFFTBuffers(sonicStream stream) {
+  if (stream->fftBuffer != NULL) {
+    streamFree(stream, stream->fftBuffer);
+    stream->fftBuffer = NULL;
+  }
+  if (stream->fftTwiddles != NULL) {
+    streamFree(stream, stream->fftTwiddles);
+    stream->fftTwiddles = NULL;
+  }
+  if (stream->fftEnergies != NULL) {
+    streamFree(stream, stream->fftEnergies);
+    stream->fftEnergies = NULL;
+  }
+}
+
+/* Allocate the buffers used by the FFT pitch detector, and compute the
+   twiddle factors.  The FFT must be at least maxRequired points, so that the
+   correlation of the first maxPeriod samples with the whole window does not
+   wrap around.  Return 0 if we are out of memory. */
+static int allocateFFTBuffers(sonicStream stream) {
+  int fftSize = 1;
+  int half, i;
+
+  while (fftSize < stream->maxRequired) {
+    fftSize <<= 1;
+  }
+  stream->fftSize = fftSize;
+  stream->fftBuffer = (float*)streamCalloc(stream, 2 * fftSize, sizeof(float));
+  if (stream->fftBuffer == NULL) {
+    return 0;
+  }
+  stream->fftTwiddles =
+      (float*)streamCalloc(stream, 2 * fftSize, sizeof(float));
+  if (stream->fftTwiddles == NULL) {
+    return 0;
+  }
+  stream->fftEnergies =
+      (double*)streamCalloc(stream, stream->maxRequired + 1, sizeof(double));
+  if (stream->fftEnergies == NULL) {
+    return 0;
+  }
+  /* Stage h of the FFT needs exp(-i*pi*k/h) for k < h, stored at h + k. */
+  for (half = 1; half < fftSize; half <<= 1) {
+    for (i = 0; i < half; i++) {
+      stream->fftTwiddles[half + i] = cos(M_PI * i / half);
+      stream->fftTwiddles[fftSize + half + i] = -sin(M_PI * i / half);
+    }
+  }
+  return 1;
+}
+
+/* Allocate the 16-bit copy of the pitch search window used when the buffers
+   hold floats.  Return 0 if we are out of memory. */
+static int allocateAnalysisBuffer(sonicStream stream) {
+  stream->analysisBuffer = (short*)streamCalloc(
+      stream, stream->maxRequired, sizeof(short) * stream->numChannels);
+  return stream->analysisBuffer != NULL;
+}
+
 /* Free stream buffers. */
 static void freeStreamBuffers(sonicStream stream) {
-  if (stream->inputBuffer != NULL) {
-    sonicFree(stream->inputBuffer);
+  if (stream->inputBufferBase != NULL) {
+    streamFree(stream, stream->inputBufferBase);
   }
-  if (stream->outputBuffer != NULL) {
-    sonicFree(stream->outputBuffer);
+  if (stream->outputBufferBase != NULL) {
+    streamFree(stream, stream->outputBufferBase);
   }
-  if (stream->pitchBuffer != NULL) {
-    sonicFree(stream->pitchBuffer);
+  if (stream->pitchBufferBase != NULL) {
+    streamFree(stream, stream->pitchBufferBase);
   }
   if (stream->downSampleBuffer != NULL) {
-    sonicFree(stream->downSampleBuffer);
+    streamFree(stream, stream->downSampleBuffer);
+  }
+  if (stream->analysisBuffer != NULL) {
+    streamFree(stream, stream->analysisBuffer);
+    stream->analysisBuffer = NULL;
+  }
+  freePitchSearchBuffers(stream);
+  freePrunedSearchBuffers(stream);
+  freeFFTBuffers(stream);
+  if (stream->rateWeights != NULL) {
+    streamFree(stream, stream->rateWeights);
+    stream->rateWeights = NULL;
+  }
+  stream->rateWeightsSize = 0;
+  stream->rateWeightsOldRate = 0;
+  stream->rateWeightsNewRate = 0;
+#ifdef SONIC_USE_SIN
+  if (stream->sineRamp != NULL) {
+    streamFree(stream, stream->sineRamp);
+    stream->sineRamp = NULL;
+  }
+#endif /* SONIC_USE_SIN */
+  if (stream->arena != NULL) {
+    /* Every buffer is allocated after the stream, so this frees them all. */
+    stream->arenaUsed = roundUpToCacheLine(sizeof(struct sonicStreamStruct));
+    stream->arenaLast = NULL;
   }
 }
 
 /* Destroy the sonic stream. */
 void sonicDestroyStream(sonicStream stream) {
+  if (stream->task != NULL) {
+    removeFromScheduler(stream);
+  }
 #ifdef SONIC_SPECTROGRAM
   if (stream->spectrogram != NULL) {
     sonicDestroySpectrogram(stream->spectrogram);
   }
 #endif /* SONIC_SPECTROGRAM */
   freeStreamBuffers(stream);
-  sonicFree(stream);
+  if (stream->arena == NULL) {
+    sonicFree(stream);
+  }
 }
 
 /* Compute the number of samples to skip to down-sample the input. */
@@ -363,45 +1101,66 @@ static int computeSkip(sonicStream stream, int sampleRate) {
   return skip;
 }
 
+/* Return the number of samples the input, output and pitch buffers start
+   with.  Allocate 25% more than needed so we hopefully won't grow.  Streams in
+   caller-provided memory also get room up front for writes of maxChunk samples
+   slowed down by up to 2X, because growing a buffer there wastes the old
+   one. */
+static int initialBufferSize(int maxRequired, int maxChunk) {
+  return maxRequired + (maxRequired >> 2) + 2 * maxChunk;
+}
+
 /* Allocate stream buffers. */
 static int allocateStreamBuffers(sonicStream stream, int sampleRate,
                                  int numChannels) {
   int minPeriod = sampleRate / SONIC_MAX_PITCH;
   int maxPeriod = sampleRate / SONIC_MIN_PITCH;
   int maxRequired = 2 * maxPeriod;
+  int bufferSize = initialBufferSize(maxRequired, stream->maxChunk);
+  int frameWidth = numChannels << stream->floatSamples;
 
-  /* Allocate 25% more than needed so we hopefully won't grow. */
-  stream->inputBufferSize = maxRequired + (maxRequired >> 2);
-
-  stream->inputBuffer =
-      (short*)sonicCalloc(stream->inputBufferSize, sizeof(short) * numChannels);
-  if (stream->inputBuffer == NULL) {
+  stream->frameWidth = frameWidth;
+  stream->inputBufferSize = bufferSize;
+  stream->inputBufferBase =
+      (short*)streamCalloc(stream, bufferSize, sizeof(short) * frameWidth);
+  if (stream->inputBufferBase == NULL) {
     sonicDestroyStream(stream);
     return 0;
   }
-  /* Allocate 25% more than needed so we hopefully won't grow. */
-  stream->outputBufferSize = maxRequired + (maxRequired >> 2);
-  stream->outputBuffer = (short*)sonicCalloc(stream->outputBufferSize,
-                                             sizeof(short) * numChannels);
-  if (stream->outputBuffer == NULL) {
+  stream->inputBuffer = stream->inputBufferBase;
+  stream->outputBufferSize = bufferSize;
+  stream->outputBufferBase =
+      (short*)streamCalloc(stream, bufferSize, sizeof(short) * frameWidth);
+  if (stream->outputBufferBase == NULL) {
     sonicDestroyStream(stream);
     return 0;
   }
-  /* Allocate 25% more than needed so we hopefully won't grow. */
-  stream->pitchBufferSize = maxRequired + (maxRequired >> 2);
-  stream->pitchBuffer =
-      (short*)sonicCalloc(stream->pitchBufferSize, sizeof(short) * numChannels);
-  if (stream->pitchBuffer == NULL) {
+  stream->outputBuffer = stream->outputBufferBase;
+  stream->pitchBufferSize = bufferSize;
+  stream->pitchBufferBase =
+      (short*)streamCalloc(stream, bufferSize, sizeof(short) * frameWidth);
+  if (stream->pitchBufferBase == NULL) {
     sonicDestroyStream(stream);
     return 0;
   }
+  stream->pitchBuffer = stream->pitchBufferBase;
   int downSampleBufferSize = maxRequired;
   stream->downSampleBuffer =
-      (short*)sonicCalloc(downSampleBufferSize, sizeof(short));
+      (short*)streamCalloc(stream, downSampleBufferSize, sizeof(short));
   if (stream->downSampleBuffer == NULL) {
     sonicDestroyStream(stream);
     return 0;
   }
+#ifdef SONIC_USE_SIN
+  /* Overlap-adds never span more than a pitch period. */
+  stream->sineRamp =
+      (float*)streamCalloc(stream, maxPeriod + 1, sizeof(float));
+  if (stream->sineRamp == NULL) {
+    sonicDestroyStream(stream);
+    return 0;
+  }
+  stream->sineRampSize = 0;
+#endif /* SONIC_USE_SIN */
   stream->sampleRate = sampleRate;
   stream->samplePeriod = 1.0 / sampleRate;
   stream->numChannels = numChannels;
@@ -411,23 +1170,37 @@ static int allocateStreamBuffers(sonicStream stream, int sampleRate,
   stream->maxPeriod = maxPeriod;
   stream->maxRequired = maxRequired;
   stream->prevPeriod = 0;
+  /* Any samples buffered before are dropped with the old buffers. */
+  stream->numInputSamples = 0;
+  stream->numOutputSamples = 0;
+  stream->numPitchSamples = 0;
+  stream->remainingInputToCopy = 0;
+  stream->inputPlayTime = 0.0f;
+  stream->timeError = 0.0f;
+  stream->pitchWindowValid = 0;
+  if (stream->incrementalPitchSearch &&
+      !allocatePitchSearchBuffers(stream)) {
+    sonicDestroyStream(stream);
+    return 0;
+  }
+  if (stream->pitchPruning && !allocatePrunedSearchBuffers(stream)) {
+    sonicDestroyStream(stream);
+    return 0;
+  }
+  if (stream->pitchDetector == SONIC_PITCH_DETECTOR_FFT &&
+      !allocateFFTBuffers(stream)) {
+    sonicDestroyStream(stream);
+    return 0;
+  }
+  if (stream->floatSamples && !allocateAnalysisBuffer(stream)) {
+    sonicDestroyStream(stream);
+    return 0;
+  }
   return 1;
 }
 
-/* Create a sonic stream.  Return NULL only if we are out of memory and cannot
-   allocate the stream. */
-sonicStream sonicCreateStream(int sampleRate, int numChannels) {
-  sonicStream stream =
-      (sonicStream)sonicCalloc(1, sizeof(struct sonicStreamStruct));
-
-  sampleRate = CLAMP(sampleRate, SONIC_MIN_SAMPLE_RATE, SONIC_MAX_SAMPLE_RATE);
-  numChannels = CLAMP(numChannels, SONIC_MIN_CHANNELS, SONIC_MAX_CHANNELS);
-  if (stream == NULL) {
-    return NULL;
-  }
-  if (!allocateStreamBuffers(stream, sampleRate, numChannels)) {
-    return NULL;
-  }
+/* Set the parameters of a new stream that are not zero by default. */
+static void setStreamDefaults(sonicStream stream) {
   stream->speed = 1.0f;
   stream->pitch = 1.0f;
   stream->volume = 1.0f;
@@ -435,63 +1208,493 @@ sonicStream sonicCreateStream(int sampleRate, int numChannels) {
   stream->oldRatePosition = 0;
   stream->newRatePosition = 0;
   stream->quality = 0;
-  return stream;
+  stream->pitchChannel = SONIC_PITCH_CHANNEL_MIX;
+  stream->resampler = SONIC_RESAMPLER_SINC;
 }
 
-/* Get the sample rate of the stream. */
-int sonicGetSampleRate(sonicStream stream) { return stream->sampleRate; }
-
-/* Set the sample rate of the stream.  This will cause samples buffered in the
-   stream to be lost. */
-void sonicSetSampleRate(sonicStream stream, int sampleRate) {
+/* Allocate the buffers of a zeroed stream and set its defaults.  Return NULL
+   if we are out of memory. */
+static sonicStream initStream(sonicStream stream, int sampleRate,
+                              int numChannels) {
   sampleRate = CLAMP(sampleRate, SONIC_MIN_SAMPLE_RATE, SONIC_MAX_SAMPLE_RATE);
-  freeStreamBuffers(stream);
-  allocateStreamBuffers(stream, sampleRate, stream->numChannels);
-}
-
-/* Get the number of channels. */
-int sonicGetNumChannels(sonicStream stream) { return stream->numChannels; }
-
-/* Set the num channels of the stream.  This will cause samples buffered in the
-   stream to be lost. */
-void sonicSetNumChannels(sonicStream stream, int numChannels) {
   numChannels = CLAMP(numChannels, SONIC_MIN_CHANNELS, SONIC_MAX_CHANNELS);
-  freeStreamBuffers(stream);
-  allocateStreamBuffers(stream, stream->sampleRate, numChannels);
+  initKernels();
+  if (!allocateStreamBuffers(stream, sampleRate, numChannels)) {
+    return NULL;
+  }
+  setStreamDefaults(stream);
+  return stream;
 }
 
-/* Enlarge the output buffer if needed. */
-static int enlargeOutputBufferIfNeeded(sonicStream stream, int numSamples) {
-  int outputBufferSize = stream->outputBufferSize;
-
-  if (stream->numOutputSamples + numSamples > outputBufferSize) {
-    stream->outputBufferSize += (outputBufferSize >> 1) + numSamples;
-    stream->outputBuffer = (short*)sonicRealloc(
-        stream->outputBuffer, outputBufferSize, stream->outputBufferSize,
-        sizeof(short) * stream->numChannels);
-    if (stream->outputBuffer == NULL) {
+/* Create a sonic stream.  Return NULL only if we are out of memory and cannot
+   allocate the stream. */
+sonicStream sonicCreateStream(int sampleRate, int numChannels) {
+  sonicStream stream =
+      (sonicStream)sonicCalloc(1, sizeof(struct sonicStreamStruct));
+
+  if (stream == NULL) {
+    return NULL;
+  }
+  return initStream(stream, sampleRate, numChannels);
+}
+
+/* Return the number of bytes sonicCreateStreamInBuffer needs for a stream
+   that is written at most maxChunk samples at a time. */
+size_t sonicStreamMemoryRequired(int sampleRate, int numChannels,
+                                 int maxChunk) {
+  int maxRequired, bufferSize;
+  size_t size;
+
+  sampleRate = CLAMP(sampleRate, SONIC_MIN_SAMPLE_RATE, SONIC_MAX_SAMPLE_RATE);
+  numChannels = CLAMP(numChannels, SONIC_MIN_CHANNELS, SONIC_MAX_CHANNELS);
+  maxRequired = 2 * (sampleRate / SONIC_MIN_PITCH);
+  bufferSize = initialBufferSize(maxRequired, maxChunk > 0 ? maxChunk : 0);
+  /* Leave room to align the start of the block. */
+  size = SONIC_CACHE_LINE_SIZE - 1;
+  size += roundUpToCacheLine(sizeof(struct sonicStreamStruct));
+  size += 3 * roundUpToCacheLine((size_t)bufferSize * numChannels *
+                                 sizeof(short));
+  size += roundUpToCacheLine((size_t)maxRequired * sizeof(short));
+#ifdef SONIC_USE_SIN
+  size += roundUpToCacheLine((size_t)(maxRequired / 2 + 1) * sizeof(float));
+#endif /* SONIC_USE_SIN */
+  return size;
+}
+
+/* Create a sonic stream entirely inside the size bytes at memory, without
+   allocating from the heap.  Return NULL if they are too few. */
+sonicStream sonicCreateStreamInBuffer(void* memory, size_t size,
+                                      int sampleRate, int numChannels,
+                                      int maxChunk) {
+  unsigned char* start = (unsigned char*)memory;
+  size_t misalignment = (size_t)start % SONIC_CACHE_LINE_SIZE;
+  size_t skip = misalignment == 0 ? 0 : SONIC_CACHE_LINE_SIZE - misalignment;
+  size_t len = roundUpToCacheLine(sizeof(struct sonicStreamStruct));
+  sonicStream stream;
+
+  if (memory == NULL || size < skip + len) {
+    return NULL;
+  }
+  start += skip;
+  size -= skip;
+  memset(start, 0, len);
+  stream = (sonicStream)start;
+  stream->arena = start;
+  stream->arenaSize = size;
+  stream->arenaUsed = len;
+  stream->maxChunk = maxChunk > 0 ? maxChunk : 0;
+  return initStream(stream, sampleRate, numChannels);
+}
+
+/* Return the stream to the state sonicCreateStream left it in, dropping any
+   buffered samples and restoring the default parameters, but keeping its
+   sample rate, number of channels, user data and memory. */
+void sonicResetStream(sonicStream stream) {
+  struct sonicStreamStruct saved;
+
+  /* A stream in a scheduler may still be being processed. */
+  if (stream->task != NULL) {
+    removeFromScheduler(stream);
+  }
+  saved = *stream;
+#ifdef SONIC_SPECTROGRAM
+  if (stream->spectrogram != NULL) {
+    sonicDestroySpectrogram(stream->spectrogram);
+  }
+#endif /* SONIC_SPECTROGRAM */
+  memset(stream, 0, sizeof(struct sonicStreamStruct));
+  stream->inputBufferBase = saved.inputBufferBase;
+  stream->outputBufferBase = saved.outputBufferBase;
+  stream->pitchBufferBase = saved.pitchBufferBase;
+  stream->inputBuffer = saved.inputBufferBase;
+  stream->outputBuffer = saved.outputBufferBase;
+  stream->pitchBuffer = saved.pitchBufferBase;
+  /* Streams go back to holding shorts, which fit twice as many samples in
+     buffers that held floats. */
+  stream->inputBufferSize = saved.inputBufferSize << saved.floatSamples;
+  stream->outputBufferSize = saved.outputBufferSize << saved.floatSamples;
+  stream->pitchBufferSize = saved.pitchBufferSize << saved.floatSamples;
+  stream->downSampleBuffer = saved.downSampleBuffer;
+  stream->analysisBuffer = saved.analysisBuffer;
+  stream->pitchDiffs = saved.pitchDiffs;
+  stream->pitchWindow = saved.pitchWindow;
+  stream->prunedDiffs = saved.prunedDiffs;
+  stream->prunedCounts = saved.prunedCounts;
+  stream->fftBuffer = saved.fftBuffer;
+  stream->fftTwiddles = saved.fftTwiddles;
+  stream->fftEnergies = saved.fftEnergies;
+  stream->fftSize = saved.fftSize;
+  stream->rateWeights = saved.rateWeights;
+  stream->rateWeightsSize = saved.rateWeightsSize;
+#ifdef SONIC_USE_SIN
+  stream->sineRamp = saved.sineRamp;
+#endif /* SONIC_USE_SIN */
+  stream->userData = saved.userData;
+  stream->sampleRate = saved.sampleRate;
+  stream->samplePeriod = saved.samplePeriod;
+  stream->numChannels = saved.numChannels;
+  stream->frameWidth = saved.numChannels;
+  stream->minPeriod = saved.minPeriod;
+  stream->maxPeriod = saved.maxPeriod;
+  stream->maxRequired = saved.maxRequired;
+  stream->arena = saved.arena;
+  stream->arenaSize = saved.arenaSize;
+  stream->arenaUsed = saved.arenaUsed;
+  stream->arenaLast = saved.arenaLast;
+  stream->maxChunk = saved.maxChunk;
+  setStreamDefaults(stream);
+}
+
+/* Get the incremental pitch search setting. */
+int sonicGetIncrementalPitchSearch(sonicStream stream) {
+  return stream->incrementalPitchSearch;
+}
+
+/* Enable or disable the incremental pitch search.  Return 0 if we run out of
+   memory, otherwise 1. */
+int sonicSetIncrementalPitchSearch(sonicStream stream, int enable) {
+  stream->incrementalPitchSearch = 0;
+  stream->pitchWindowValid = 0;
+  if (enable && stream->pitchDiffs == NULL) {
+    if (!allocatePitchSearchBuffers(stream)) {
+      freePitchSearchBuffers(stream);
       return 0;
     }
   }
+  stream->incrementalPitchSearch = enable != 0 ? 1 : 0;
   return 1;
 }
 
-/* Enlarge the input buffer if needed. */
-static int enlargeInputBufferIfNeeded(sonicStream stream, int numSamples) {
-  int inputBufferSize = stream->inputBufferSize;
-
-  if (stream->numInputSamples + numSamples > inputBufferSize) {
-    stream->inputBufferSize += (inputBufferSize >> 1) + numSamples;
-    stream->inputBuffer = (short*)sonicRealloc(
-        stream->inputBuffer, inputBufferSize, stream->inputBufferSize,
-        sizeof(short) * stream->numChannels);
-    if (stream->inputBuffer == NULL) {
+/* Get the pitch tracking setting. */
+int sonicGetPitchTracking(sonicStream stream) { return stream->pitchTracking; }
+
+/* Enable or disable pitch tracking. */
+void sonicSetPitchTracking(sonicStream stream, int enable) {
+  stream->pitchTracking = enable != 0 ? 1 : 0;
+}
+
+/* Get the channel used to find the pitch period. */
+int sonicGetPitchChannel(sonicStream stream) { return stream->pitchChannel; }
+
+/* Set the channel used to find the pitch period. */
+void sonicSetPitchChannel(sonicStream stream, int channel) {
+  stream->pitchChannel = channel;
+  /* The saved sums of the incremental search are for the old channel. */
+  stream->pitchWindowValid = 0;
+}
+
+/* Get the silence threshold. */
+int sonicGetSilenceThreshold(sonicStream stream) {
+  return stream->silenceThreshold;
+}
+
+/* Set the silence threshold. */
+void sonicSetSilenceThreshold(sonicStream stream, int threshold) {
+  stream->silenceThreshold = threshold;
+}
+
+/* Get the number of input samples that took the silence fast path. */
+long sonicGetSilentSamples(sonicStream stream) {
+  return stream->silentSamples;
+}
+
+/* Get the pitch pyramid setting. */
+int sonicGetPitchPyramid(sonicStream stream) { return stream->pitchPyramid; }
+
+/* Enable or disable the pitch search pyramid. */
+void sonicSetPitchPyramid(sonicStream stream, int enable) {
+  stream->pitchPyramid = enable != 0 ? 1 : 0;
+}
+
+/* Get the pitch pruning setting. */
+int sonicGetPitchPruning(sonicStream stream) { return stream->pitchPruning; }
+
+/* Enable or disable pitch pruning.  Return 0 if we run out of memory,
+   otherwise 1. */
+int sonicSetPitchPruning(sonicStream stream, int enable) {
+  stream->pitchPruning = 0;
+  if (enable && stream->prunedDiffs == NULL) {
+    if (!allocatePrunedSearchBuffers(stream)) {
+      freePrunedSearchBuffers(stream);
+      return 0;
+    }
+  }
+  stream->pitchPruning = enable != 0 ? 1 : 0;
+  return 1;
+}
+
+/* Get the number of samples the pruned pitch search has skipped. */
+long sonicGetPitchSamplesPruned(sonicStream stream) {
+  return stream->pitchSamplesPruned;
+}
+
+/* Get the pitch detector used by the stream. */
+int sonicGetPitchDetector(sonicStream stream) { return stream->pitchDetector; }
+
+/* Set the pitch detector used by the stream.  Return 0 if we run out of
+   memory, otherwise 1. */
+int sonicSetPitchDetector(sonicStream stream, int pitchDetector) {
+  stream->pitchDetector = SONIC_PITCH_DETECTOR_AMDF;
+  if (pitchDetector == SONIC_PITCH_DETECTOR_FFT) {
+    if (stream->fftBuffer == NULL && !allocateFFTBuffers(stream)) {
+      freeFFTBuffers(stream);
+      return 0;
+    }
+    stream->pitchDetector = SONIC_PITCH_DETECTOR_FFT;
+  }
+  return 1;
+}
+
+/* Get the resampler used for rate and pitch changes. */
+int sonicGetResampler(sonicStream stream) { return stream->resampler; }
+
+/* Set the resampler used for rate and pitch changes.  Unknown values select
+   the default, SONIC_RESAMPLER_SINC. */
+void sonicSetResampler(sonicStream stream, int resampler) {
+  if (resampler < SONIC_RESAMPLER_LINEAR ||
+      resampler > SONIC_RESAMPLER_HIGH_QUALITY) {
+    resampler = SONIC_RESAMPLER_SINC;
+  }
+  stream->resampler = resampler;
+}
+
+/* Get the memory limit of the stream's sample buffers, or 0 if there is
+   none. */
+size_t sonicGetMaxMemory(sonicStream stream) { return stream->maxMemory; }
+
+/* Limit the input, output and pitch buffers to maxMemory bytes in total, or
+   remove the limit if maxMemory is 0.  Buffers that are already bigger are
+   not shrunk. */
+void sonicSetMaxMemory(sonicStream stream, size_t maxMemory) {
+  stream->maxMemory = maxMemory;
+}
+
+/* Get whether the stream processes floats. */
+int sonicGetFloatProcessing(sonicStream stream) {
+  return stream->floatSamples;
+}
+
+/* Move the numBufferSamples samples at *buffer to the start of the buffer at
+   base. */
+static void compactBuffer(sonicStream stream, short** buffer, short* base,
+                          int numBufferSamples) {
+  memmove(base, *buffer, numBufferSamples * sizeof(short) * stream->frameWidth);
+  *buffer = base;
+}
+
+/* Grow a buffer of bufferSize frames of shorts at *base to hold as many frames
+   of floats.  Its samples must be at the start.  Return 0 if we are out of
+   memory. */
+static int growBufferForFloats(sonicStream stream, short** buffer, short** base,
+                               int bufferSize) {
+  short* newBase = (short*)streamRealloc(stream, *base, bufferSize,
+                                         2 * bufferSize,
+                                         sizeof(short) * stream->numChannels);
+
+  if (newBase == NULL) {
+    return 0;
+  }
+  *base = newBase;
+  *buffer = newBase;
+  return 1;
+}
+
+/* Convert the first numSamples samples of buffer from shorts to floats, or
+   back, in place.  Floats take more room than shorts, so they are converted
+   from the end backwards, and shorts from the start forwards, a chunk at a
+   time through a small array, so no sample is overwritten before it is
+   read. */
+static void convertSamplesInPlace(short* buffer, int numSamples, int toFloat) {
+  float* floats = (float*)buffer;
+  short shorts[SONIC_CONVERSION_CHUNK];
+  float values[SONIC_CONVERSION_CHUNK];
+  int start, count;
+
+  if (toFloat) {
+    for (start = numSamples; start > 0; start -= count) {
+      count = start < SONIC_CONVERSION_CHUNK ? start : SONIC_CONVERSION_CHUNK;
+      memcpy(shorts, buffer + start - count, count * sizeof(short));
+      convertShortsToFloats(values, shorts, count);
+      memcpy(floats + start - count, values, count * sizeof(float));
+    }
+    return;
+  }
+  for (start = 0; start < numSamples; start += count) {
+    count = numSamples - start < SONIC_CONVERSION_CHUNK
+                ? numSamples - start
+                : SONIC_CONVERSION_CHUNK;
+    memcpy(values, floats + start, count * sizeof(float));
+    convertFloatsToShorts(shorts, values, count);
+    memcpy(buffer + start, shorts, count * sizeof(short));
+  }
+}
+
+/* Switch the stream between processing shorts and floats, converting any
+   samples it holds.  Return 0 if we run out of memory, or if the buffers
+   would need more than stream->maxMemory bytes, otherwise 1. */
+int sonicSetFloatProcessing(sonicStream stream, int enable) {
+  int floatSamples = enable != 0 ? 1 : 0;
+  int numChannels = stream->numChannels;
+  size_t bytes;
+
+  if (floatSamples == stream->floatSamples) {
+    return 1;
+  }
+  compactBuffer(stream, &stream->inputBuffer, stream->inputBufferBase,
+                stream->numInputSamples);
+  compactBuffer(stream, &stream->outputBuffer, stream->outputBufferBase,
+                stream->numOutputSamples);
+  compactBuffer(stream, &stream->pitchBuffer, stream->pitchBufferBase,
+                stream->numPitchSamples);
+  if (floatSamples) {
+    bytes = ((size_t)stream->inputBufferSize + stream->outputBufferSize +
+             stream->pitchBufferSize) * sizeof(float) * numChannels;
+    if (stream->maxMemory != 0 && bytes > stream->maxMemory) {
+      return 0;
+    }
+    if (stream->analysisBuffer == NULL && !allocateAnalysisBuffer(stream)) {
+      return 0;
+    }
+    if (!growBufferForFloats(stream, &stream->inputBuffer,
+                             &stream->inputBufferBase,
+                             stream->inputBufferSize) ||
+        !growBufferForFloats(stream, &stream->outputBuffer,
+                             &stream->outputBufferBase,
+                             stream->outputBufferSize) ||
+        !growBufferForFloats(stream, &stream->pitchBuffer,
+                             &stream->pitchBufferBase,
+                             stream->pitchBufferSize)) {
+      return 0;
+    }
+  } else {
+    /* Buffers that held floats fit twice as many shorts. */
+    stream->inputBufferSize <<= 1;
+    stream->outputBufferSize <<= 1;
+    stream->pitchBufferSize <<= 1;
+  }
+  convertSamplesInPlace(stream->inputBuffer,
+                        stream->numInputSamples * numChannels, floatSamples);
+  convertSamplesInPlace(stream->outputBuffer,
+                        stream->numOutputSamples * numChannels, floatSamples);
+  convertSamplesInPlace(stream->pitchBuffer,
+                        stream->numPitchSamples * numChannels, floatSamples);
+  stream->floatSamples = floatSamples;
+  stream->frameWidth = numChannels << floatSamples;
+  stream->pitchWindowValid = 0;
+  return 1;
+}
+
+/* Get the sample rate of the stream. */
+int sonicGetSampleRate(sonicStream stream) { return stream->sampleRate; }
+
+/* Replace the stream's buffers with ones for the new sample rate and number
+   of channels.  If a stream in caller-provided memory has too little for
+   them, it gets buffers for its old settings again, which still fit. */
+static void reallocateStreamBuffers(sonicStream stream, int sampleRate,
+                                    int numChannels) {
+  int oldSampleRate = stream->sampleRate;
+  int oldNumChannels = stream->numChannels;
+
+  freeStreamBuffers(stream);
+  if (!allocateStreamBuffers(stream, sampleRate, numChannels) &&
+      stream->arena != NULL) {
+    allocateStreamBuffers(stream, oldSampleRate, oldNumChannels);
+  }
+}
+
+/* Set the sample rate of the stream.  This will cause samples buffered in the
+   stream to be lost. */
+void sonicSetSampleRate(sonicStream stream, int sampleRate) {
+  sampleRate = CLAMP(sampleRate, SONIC_MIN_SAMPLE_RATE, SONIC_MAX_SAMPLE_RATE);
+  reallocateStreamBuffers(stream, sampleRate, stream->numChannels);
+}
+
+/* Get the number of channels. */
+int sonicGetNumChannels(sonicStream stream) { return stream->numChannels; }
+
+/* Set the num channels of the stream.  This will cause samples buffered in the
+   stream to be lost. */
+void sonicSetNumChannels(sonicStream stream, int numChannels) {
+  numChannels = CLAMP(numChannels, SONIC_MIN_CHANNELS, SONIC_MAX_CHANNELS);
+  reallocateStreamBuffers(stream, stream->sampleRate, numChannels);
+}
+
+/* Make room for numSamples more samples after the numBufferSamples samples
+   at *buffer, in a buffer of *bufferSize samples allocated at *base.  If the
+   end of the buffer is reached, the samples are moved back to the start, but
+   only if at least as many have been removed from the front as remain, so
+   each sample is moved at most once on average.  Otherwise the buffer
+   grows.  Streams in caller-provided memory or with a memory limit always
+   move the samples first, since growing there is costly.  Return 0 if the
+   buffer cannot grow, either because we are out of memory, or because the
+   input, output and pitch buffers would take more than stream->maxMemory
+   bytes. */
+static int enlargeBufferIfNeeded(sonicStream stream, short** buffer,
+                                 short** base, int* bufferSize,
+                                 int numBufferSamples, int numSamples) {
+  int frameWidth = stream->frameWidth;
+  int oldSize = *bufferSize;
+  int offset, newSize;
+  size_t frameBytes = sizeof(short) * frameWidth;
+  size_t otherBytes, maxSize;
+  short* newBase;
+
+  /* Avoid dividing in the common case. */
+  if (*buffer + (numBufferSamples + numSamples) * frameWidth <=
+      *base + oldSize * frameWidth) {
+    return 1;
+  }
+  offset = (*buffer - *base) / frameWidth;
+  if (offset >= numBufferSamples || stream->arena != NULL ||
+      stream->maxMemory != 0) {
+    memmove(*base, *buffer, numBufferSamples * frameBytes);
+    *buffer = *base;
+    offset = 0;
+    if (numBufferSamples + numSamples <= oldSize) {
+      return 1;
+    }
+  }
+  newSize = oldSize + (oldSize >> 1) + numSamples;
+  if (stream->maxMemory != 0) {
+    otherBytes = ((size_t)stream->inputBufferSize + stream->outputBufferSize +
+                  stream->pitchBufferSize - oldSize) * frameBytes;
+    if (otherBytes >= stream->maxMemory) {
       return 0;
     }
+    maxSize = (stream->maxMemory - otherBytes) / frameBytes;
+    if (maxSize < (size_t)(numBufferSamples + numSamples)) {
+      return 0;
+    }
+    if ((size_t)newSize > maxSize) {
+      newSize = maxSize;
+    }
+  }
+  newBase = (short*)streamRealloc(stream, *base, oldSize, newSize, frameBytes);
+  if (newBase == NULL) {
+    return 0;
   }
+  *base = newBase;
+  *buffer = newBase + offset * frameWidth;
+  *bufferSize = newSize;
   return 1;
 }
 
+/* Enlarge the output buffer if needed. */
+static int enlargeOutputBufferIfNeeded(sonicStream stream, int numSamples) {
+  return enlargeBufferIfNeeded(stream, &stream->outputBuffer,
+                               &stream->outputBufferBase,
+                               &stream->outputBufferSize,
+                               stream->numOutputSamples, numSamples);
+}
+
+/* Enlarge the input buffer if needed. */
+static int enlargeInputBufferIfNeeded(sonicStream stream, int numSamples) {
+  return enlargeBufferIfNeeded(stream, &stream->inputBuffer,
+                               &stream->inputBufferBase,
+                               &stream->inputBufferSize,
+                               stream->numInputSamples, numSamples);
+}
+
 /* Update stream->numInputSamples, and update stream->inputPlayTime.  Call this
    whenever adding samples to the input buffer, to keep track of total expected
    input play time accounting. */
@@ -514,9 +1717,11 @@ static int addFloatSamplesToInputBuffer(sonicStream stream,
   if (!enlargeInputBufferIfNeeded(stream, numSamples)) {
     return 0;
   }
-  buffer = stream->inputBuffer + stream->numInputSamples * stream->numChannels;
-  while (count--) {
-    *buffer++ = (*samples++) * 32767.0f;
+  buffer = stream->inputBuffer + stream->numInputSamples * stream->frameWidth;
+  if (stream->floatSamples) {
+    memcpy(buffer, samples, count * sizeof(float));
+  } else {
+    convertFloatsToShorts(buffer, samples, count);
   }
   updateNumInputSamples(stream, numSamples);
   return 1;
@@ -525,14 +1730,23 @@ static int addFloatSamplesToInputBuffer(sonicStream stream,
 /* Add the input samples to the input buffer. */
 static int addShortSamplesToInputBuffer(sonicStream stream,
                                         const short* samples, int numSamples) {
+  float* buffer;
+  int count = numSamples * stream->numChannels;
+
   if (numSamples == 0) {
     return 1;
   }
   if (!enlargeInputBufferIfNeeded(stream, numSamples)) {
     return 0;
   }
-  memcpy(stream->inputBuffer + stream->numInputSamples * stream->numChannels,
-         samples, numSamples * sizeof(short) * stream->numChannels);
+  if (stream->floatSamples) {
+    buffer = (float*)(stream->inputBuffer +
+                      stream->numInputSamples * stream->frameWidth);
+    convertShortsToFloats(buffer, samples, count);
+  } else {
+    memcpy(stream->inputBuffer + stream->numInputSamples * stream->numChannels,
+           samples, count * sizeof(short));
+  }
   updateNumInputSamples(stream, numSamples);
   return 1;
 }
@@ -542,6 +1756,63 @@ static int addUnsignedCharSamplesToInputBuffer(sonicStream stream,
                                                const unsigned char* samples,
                                                int numSamples) {
   short* buffer;
+  short shorts[SONIC_CONVERSION_CHUNK];
+  int count = numSamples * stream->numChannels;
+  int start, chunk;
+
+  if (numSamples == 0) {
+    return 1;
+  }
+  if (!enlargeInputBufferIfNeeded(stream, numSamples)) {
+    return 0;
+  }
+  buffer = stream->inputBuffer + stream->numInputSamples * stream->frameWidth;
+  if (stream->floatSamples) {
+    for (start = 0; start < count; start += chunk) {
+      chunk = count - start < SONIC_CONVERSION_CHUNK ? count - start
+                                                     : SONIC_CONVERSION_CHUNK;
+      convertUnsignedCharsToShorts(shorts, samples + start, chunk);
+      convertShortsToFloats((float*)buffer + start, shorts, chunk);
+    }
+  } else {
+    convertUnsignedCharsToShorts(buffer, samples, count);
+  }
+  updateNumInputSamples(stream, numSamples);
+  return 1;
+}
+
+/* Add the input samples to the input buffer. */
+static int addIntSamplesToInputBuffer(sonicStream stream, const int* samples,
+                                      int numSamples) {
+  short* buffer;
+  float* floatBuffer;
+  int count = numSamples * stream->numChannels;
+
+  if (numSamples == 0) {
+    return 1;
+  }
+  if (!enlargeInputBufferIfNeeded(stream, numSamples)) {
+    return 0;
+  }
+  buffer = stream->inputBuffer + stream->numInputSamples * stream->frameWidth;
+  if (stream->floatSamples) {
+    floatBuffer = (float*)buffer;
+    while (count--) {
+      *floatBuffer++ = (float)(*samples++ * (1.0 / SONIC_INT_FULL_SCALE));
+    }
+  } else {
+    convertIntsToShorts(buffer, samples, count);
+  }
+  updateNumInputSamples(stream, numSamples);
+  return 1;
+}
+
+/* Add the packed 24-bit input samples to the input buffer. */
+static int addInt24SamplesToInputBuffer(sonicStream stream,
+                                        const unsigned char* samples,
+                                        int numSamples) {
+  short* buffer;
+  float* floatBuffer;
   int count = numSamples * stream->numChannels;
 
   if (numSamples == 0) {
@@ -550,9 +1821,85 @@ static int addUnsignedCharSamplesToInputBuffer(sonicStream stream,
   if (!enlargeInputBufferIfNeeded(stream, numSamples)) {
     return 0;
   }
-  buffer = stream->inputBuffer + stream->numInputSamples * stream->numChannels;
-  while (count--) {
-    *buffer++ = (*samples++ - 128) << 8;
+  buffer = stream->inputBuffer + stream->numInputSamples * stream->frameWidth;
+  if (stream->floatSamples) {
+    floatBuffer = (float*)buffer;
+    for (; count--; samples += 3) {
+      *floatBuffer++ =
+          (float)(readInt24(samples) * (1.0 / SONIC_INT24_FULL_SCALE));
+    }
+  } else {
+    for (; count--; samples += 3) {
+      *buffer++ = int24ToShort(samples);
+    }
+  }
+  updateNumInputSamples(stream, numSamples);
+  return 1;
+}
+
+/* Interleave planar input samples into the input buffer. */
+static int addFloatPlanarSamplesToInputBuffer(sonicStream stream,
+                                              const float* const* samples,
+                                              int numSamples) {
+  int numChannels = stream->numChannels;
+  short* buffer;
+  float* floatBuffer;
+  const float* in;
+  int i, j;
+
+  if (numSamples == 0) {
+    return 1;
+  }
+  if (!enlargeInputBufferIfNeeded(stream, numSamples)) {
+    return 0;
+  }
+  buffer = stream->inputBuffer + stream->numInputSamples * stream->frameWidth;
+  floatBuffer = (float*)buffer;
+  for (j = 0; j < numChannels; j++) {
+    in = samples[j];
+    if (stream->floatSamples) {
+      for (i = 0; i < numSamples; i++) {
+        floatBuffer[i * numChannels + j] = in[i];
+      }
+    } else {
+      for (i = 0; i < numSamples; i++) {
+        buffer[i * numChannels + j] = floatToShort(in[i]);
+      }
+    }
+  }
+  updateNumInputSamples(stream, numSamples);
+  return 1;
+}
+
+/* Interleave planar input samples into the input buffer. */
+static int addShortPlanarSamplesToInputBuffer(sonicStream stream,
+                                              const short* const* samples,
+                                              int numSamples) {
+  int numChannels = stream->numChannels;
+  short* buffer;
+  float* floatBuffer;
+  const short* in;
+  int i, j;
+
+  if (numSamples == 0) {
+    return 1;
+  }
+  if (!enlargeInputBufferIfNeeded(stream, numSamples)) {
+    return 0;
+  }
+  buffer = stream->inputBuffer + stream->numInputSamples * stream->frameWidth;
+  floatBuffer = (float*)buffer;
+  for (j = 0; j < numChannels; j++) {
+    in = samples[j];
+    if (stream->floatSamples) {
+      for (i = 0; i < numSamples; i++) {
+        floatBuffer[i * numChannels + j] = shortToFloat(in[i]);
+      }
+    } else {
+      for (i = 0; i < numSamples; i++) {
+        buffer[i * numChannels + j] = in[i];
+      }
+    }
   }
   updateNumInputSamples(stream, numSamples);
   return 1;
@@ -563,39 +1910,26 @@ static void removeInputSamples(sonicStream stream, int position) {
   int remainingSamples = stream->numInputSamples - position;
 
   if (remainingSamples > 0) {
-    memmove(stream->inputBuffer,
-            stream->inputBuffer + position * stream->numChannels,
-            remainingSamples * sizeof(short) * stream->numChannels);
+    stream->inputBuffer += position * stream->frameWidth;
+  } else {
+    stream->inputBuffer = stream->inputBufferBase;
   }
   /* If we play 3/4ths of the samples, then the expected play time of the
      remaining samples is 1/4th of the original expected play time. */
   stream->inputPlayTime =
       (stream->inputPlayTime * remainingSamples) / stream->numInputSamples;
   stream->numInputSamples = remainingSamples;
+  stream->inputStreamPosition += position;
 }
 
-/* Copy from the input buffer to the output buffer, and remove the samples from
-   the input buffer. */
-static int copyInputToOutput(sonicStream stream, int numSamples) {
-  if (!enlargeOutputBufferIfNeeded(stream, numSamples)) {
-    return 0;
-  }
-  memcpy(stream->outputBuffer + stream->numOutputSamples * stream->numChannels,
-         stream->inputBuffer, numSamples * sizeof(short) * stream->numChannels);
-  stream->numOutputSamples += numSamples;
-  removeInputSamples(stream, numSamples);
-  return 1;
-}
-
-/* Copy from samples to the output buffer */
-static int copyToOutput(sonicStream stream, short* samples, int numSamples) {
-  if (!enlargeOutputBufferIfNeeded(stream, numSamples)) {
-    return 0;
+/* Remove samples that have been read from the output buffer. */
+static void removeOutputSamples(sonicStream stream, int numSamples) {
+  stream->numOutputSamples -= numSamples;
+  if (stream->numOutputSamples > 0) {
+    stream->outputBuffer += numSamples * stream->frameWidth;
+  } else {
+    stream->outputBuffer = stream->outputBufferBase;
   }
-  memcpy(stream->outputBuffer + stream->numOutputSamples * stream->numChannels,
-         samples, numSamples * sizeof(short) * stream->numChannels);
-  stream->numOutputSamples += numSamples;
-  return 1;
 }
 
 /* Read data out of the stream.  Sometimes no data will be available, and zero
@@ -603,7 +1937,6 @@ static int copyToOutput(sonicStream stream, short* samples, int numSamples) {
 int sonicReadFloatFromStream(sonicStream stream, float* samples,
                              int maxSamples) {
   int numSamples = stream->numOutputSamples;
-  int remainingSamples = 0;
   short* buffer;
   int count;
 
@@ -611,20 +1944,16 @@ int sonicReadFloatFromStream(sonicStream stream, float* samples,
     return 0;
   }
   if (numSamples > maxSamples) {
-    remainingSamples = numSamples - maxSamples;
     numSamples = maxSamples;
   }
   buffer = stream->outputBuffer;
   count = numSamples * stream->numChannels;
-  while (count--) {
-    *samples++ = (*buffer++) / 32767.0f;
-  }
-  if (remainingSamples > 0) {
-    memmove(stream->outputBuffer,
-            stream->outputBuffer + numSamples * stream->numChannels,
-            remainingSamples * sizeof(short) * stream->numChannels);
+  if (stream->floatSamples) {
+    memcpy(samples, buffer, count * sizeof(float));
+  } else {
+    convertShortsToFloats(samples, buffer, count);
   }
-  stream->numOutputSamples = remainingSamples;
+  removeOutputSamples(stream, numSamples);
   return numSamples;
 }
 
@@ -633,23 +1962,23 @@ int sonicReadFloatFromStream(sonicStream stream, float* samples,
 int sonicReadShortFromStream(sonicStream stream, short* samples,
                              int maxSamples) {
   int numSamples = stream->numOutputSamples;
-  int remainingSamples = 0;
+  const float* buffer;
+  int count;
 
   if (numSamples == 0) {
     return 0;
   }
   if (numSamples > maxSamples) {
-    remainingSamples = numSamples - maxSamples;
     numSamples = maxSamples;
   }
-  memcpy(samples, stream->outputBuffer,
-         numSamples * sizeof(short) * stream->numChannels);
-  if (remainingSamples > 0) {
-    memmove(stream->outputBuffer,
-            stream->outputBuffer + numSamples * stream->numChannels,
-            remainingSamples * sizeof(short) * stream->numChannels);
+  count = numSamples * stream->numChannels;
+  if (stream->floatSamples) {
+    buffer = (const float*)stream->outputBuffer;
+    convertFloatsToShorts(samples, buffer, count);
+  } else {
+    memcpy(samples, stream->outputBuffer, count * sizeof(short));
   }
-  stream->numOutputSamples = remainingSamples;
+  removeOutputSamples(stream, numSamples);
   return numSamples;
 }
 
@@ -658,31 +1987,194 @@ int sonicReadShortFromStream(sonicStream stream, short* samples,
 int sonicReadUnsignedCharFromStream(sonicStream stream, unsigned char* samples,
                                     int maxSamples) {
   int numSamples = stream->numOutputSamples;
-  int remainingSamples = 0;
   short* buffer;
-  int count;
+  short shorts[SONIC_CONVERSION_CHUNK];
+  int count, start, chunk;
 
   if (numSamples == 0) {
     return 0;
   }
   if (numSamples > maxSamples) {
-    remainingSamples = numSamples - maxSamples;
     numSamples = maxSamples;
   }
   buffer = stream->outputBuffer;
   count = numSamples * stream->numChannels;
-  while (count--) {
-    *samples++ = (char)((*buffer++) >> 8) + 128;
-  }
-  if (remainingSamples > 0) {
-    memmove(stream->outputBuffer,
-            stream->outputBuffer + numSamples * stream->numChannels,
-            remainingSamples * sizeof(short) * stream->numChannels);
+  if (stream->floatSamples) {
+    for (start = 0; start < count; start += chunk) {
+      chunk = count - start < SONIC_CONVERSION_CHUNK ? count - start
+                                                     : SONIC_CONVERSION_CHUNK;
+      convertFloatsToShorts(shorts, (const float*)buffer + start, chunk);
+      convertShortsToUnsignedChars(samples + start, shorts, chunk);
+    }
+  } else {
+    convertShortsToUnsignedChars(samples, buffer, count);
+  }
+  removeOutputSamples(stream, numSamples);
+  return numSamples;
+}
+
+/* Read 32-bit data out of the stream.  Sometimes no data will be available,
+   and zero is returned, which is not an error condition. */
+int sonicReadIntFromStream(sonicStream stream, int* samples, int maxSamples) {
+  int numSamples = stream->numOutputSamples;
+  short* buffer;
+  const float* floatBuffer;
+  int count;
+
+  if (numSamples == 0) {
+    return 0;
+  }
+  if (numSamples > maxSamples) {
+    numSamples = maxSamples;
+  }
+  buffer = stream->outputBuffer;
+  count = numSamples * stream->numChannels;
+  if (stream->floatSamples) {
+    floatBuffer = (const float*)buffer;
+    while (count--) {
+      *samples++ = floatToInteger(*floatBuffer++, SONIC_INT_FULL_SCALE,
+                                  2147483647L);
+    }
+  } else {
+    convertShortsToInts(samples, buffer, count);
+  }
+  removeOutputSamples(stream, numSamples);
+  return numSamples;
+}
+
+/* Read packed 24-bit data out of the stream.  Sometimes no data will be
+   available, and zero is returned, which is not an error condition. */
+int sonicReadInt24FromStream(sonicStream stream, unsigned char* samples,
+                             int maxSamples) {
+  int numSamples = stream->numOutputSamples;
+  short* buffer;
+  const float* floatBuffer;
+  int count;
+
+  if (numSamples == 0) {
+    return 0;
+  }
+  if (numSamples > maxSamples) {
+    numSamples = maxSamples;
+  }
+  buffer = stream->outputBuffer;
+  count = numSamples * stream->numChannels;
+  if (stream->floatSamples) {
+    floatBuffer = (const float*)buffer;
+    for (; count--; samples += 3) {
+      writeInt24(samples, floatToInteger(*floatBuffer++,
+                                         SONIC_INT24_FULL_SCALE, 8388607L));
+    }
+  } else {
+    for (; count--; samples += 3) {
+      writeInt24(samples, *buffer++ * 256L);
+    }
+  }
+  removeOutputSamples(stream, numSamples);
+  return numSamples;
+}
+
+/* Read data out of the stream into one array per channel.  Sometimes no data
+   will be available, and zero is returned, which is not an error condition. */
+int sonicReadFloatPlanarFromStream(sonicStream stream, float* const* samples,
+                                   int maxSamples) {
+  int numSamples = stream->numOutputSamples;
+  int numChannels = stream->numChannels;
+  const short* buffer = stream->outputBuffer;
+  const float* floatBuffer = (const float*)buffer;
+  float* out;
+  int i, j;
+
+  if (numSamples == 0) {
+    return 0;
+  }
+  if (numSamples > maxSamples) {
+    numSamples = maxSamples;
+  }
+  for (j = 0; j < numChannels; j++) {
+    out = samples[j];
+    if (stream->floatSamples) {
+      for (i = 0; i < numSamples; i++) {
+        out[i] = floatBuffer[i * numChannels + j];
+      }
+    } else {
+      for (i = 0; i < numSamples; i++) {
+        out[i] = shortToFloat(buffer[i * numChannels + j]);
+      }
+    }
+  }
+  removeOutputSamples(stream, numSamples);
+  return numSamples;
+}
+
+/* Read short data out of the stream into one array per channel.  Sometimes no
+   data will be available, and zero is returned, which is not an error
+   condition. */
+int sonicReadShortPlanarFromStream(sonicStream stream, short* const* samples,
+                                   int maxSamples) {
+  int numSamples = stream->numOutputSamples;
+  int numChannels = stream->numChannels;
+  const short* buffer = stream->outputBuffer;
+  const float* floatBuffer = (const float*)buffer;
+  short* out;
+  int i, j;
+
+  if (numSamples == 0) {
+    return 0;
+  }
+  if (numSamples > maxSamples) {
+    numSamples = maxSamples;
+  }
+  for (j = 0; j < numChannels; j++) {
+    out = samples[j];
+    if (stream->floatSamples) {
+      for (i = 0; i < numSamples; i++) {
+        out[i] = floatToShort(floatBuffer[i * numChannels + j]);
+      }
+    } else {
+      for (i = 0; i < numSamples; i++) {
+        out[i] = buffer[i * numChannels + j];
+      }
+    }
   }
-  stream->numOutputSamples = remainingSamples;
+  removeOutputSamples(stream, numSamples);
   return numSamples;
 }
 
+/* Set *samples to point to the processed samples in the output buffer, and
+   return how many there are.  They remain valid until the next call that
+   writes to, flushes, or reads from the stream.  There are none if the stream
+   processes floats. */
+int sonicPeekOutput(sonicStream stream, const short** samples) {
+  if (stream->floatSamples) {
+    *samples = NULL;
+    return 0;
+  }
+  *samples = stream->outputBuffer;
+  return stream->numOutputSamples;
+}
+
+/* The same as sonicPeekOutput, for streams that process floats. */
+int sonicPeekFloatOutput(sonicStream stream, const float** samples) {
+  if (!stream->floatSamples) {
+    *samples = NULL;
+    return 0;
+  }
+  *samples = (const float*)stream->outputBuffer;
+  return stream->numOutputSamples;
+}
+
+/* Release the first numSamples samples returned by sonicPeekOutput. */
+void sonicConsumeOutput(sonicStream stream, int numSamples) {
+  if (numSamples <= 0) {
+    return;
+  }
+  if (numSamples > stream->numOutputSamples) {
+    numSamples = stream->numOutputSamples;
+  }
+  removeOutputSamples(stream, numSamples);
+}
+
 /* Force the sonic stream to generate output using whatever data it currently
    has.  No extra delay will be added to the output, but flushing in the middle
    of words could introduce distortion. */
@@ -699,8 +2191,8 @@ int sonicFlushStream(sonicStream stream) {
   if (!enlargeInputBufferIfNeeded(stream, remainingSamples + 2 * maxRequired)) {
     return 0;
   }
-  memset(stream->inputBuffer + remainingSamples * stream->numChannels, 0,
-         2 * maxRequired * sizeof(short) * stream->numChannels);
+  memset(stream->inputBuffer + remainingSamples * stream->frameWidth, 0,
+         2 * maxRequired * sizeof(short) * stream->frameWidth);
   stream->numInputSamples += 2 * maxRequired;
   if (!sonicWriteShortToStream(stream, NULL, 0)) {
     return 0;
@@ -709,11 +2201,16 @@ int sonicFlushStream(sonicStream stream) {
   if (stream->numOutputSamples > expectedOutputSamples) {
     stream->numOutputSamples = expectedOutputSamples;
   }
-  /* Empty input and pitch buffers */
+  /* Empty input and pitch buffers.  The input that follows is not contiguous
+     with what came before, so saved pitch search state is no longer valid. */
+  stream->inputStreamPosition += stream->numInputSamples;
   stream->numInputSamples = 0;
+  stream->inputBuffer = stream->inputBufferBase;
+  stream->pitchWindowValid = 0;
   stream->inputPlayTime = 0.0f;
   stream->timeError = 0.0f;
   stream->numPitchSamples = 0;
+  stream->pitchBuffer = stream->pitchBufferBase;
   return 1;
 }
 
@@ -722,16 +2219,70 @@ int sonicSamplesAvailable(sonicStream stream) {
   return stream->numOutputSamples;
 }
 
-/* If skip is greater than one, average skip samples together and write them to
-   the down-sample buffer.  If numChannels is greater than one, mix the channels
-   together as we down sample. */
-static void downSampleInput(sonicStream stream, short* samples, int skip) {
-  int numSamples = stream->maxRequired / skip;
-  int samplesPerValue = stream->numChannels * skip;
+/* Choose the channel to search for the pitch period in, or return
+   SONIC_PITCH_CHANNEL_MIX to mix them all.  The loudest channel is the one with
+   the largest sum of absolute values over every SONIC_LOUDEST_CHANNEL_STEP'th
+   frame of the window. */
+static int selectPitchChannel(sonicStream stream, short* samples) {
+  int numChannels = stream->numChannels;
+  int numSamples = stream->maxRequired * numChannels;
+  int step = SONIC_LOUDEST_CHANNEL_STEP * numChannels;
+  int channel = stream->pitchChannel;
+  long loudness, maxLoudness = -1;
+  int i, j;
+
+  if (numChannels == 1 || channel >= numChannels ||
+      (channel < 0 && channel != SONIC_PITCH_CHANNEL_LOUDEST)) {
+    return SONIC_PITCH_CHANNEL_MIX;
+  }
+  if (channel != SONIC_PITCH_CHANNEL_LOUDEST) {
+    return channel;
+  }
+  for (j = 0; j < numChannels; j++) {
+    loudness = 0;
+    for (i = j; i < numSamples; i += step) {
+      loudness += samples[i] >= 0 ? samples[i] : -samples[i];
+    }
+    if (loudness > maxLoudness) {
+      maxLoudness = loudness;
+      channel = j;
+    }
+  }
+  return channel;
+}
+
+/* Down-sample numSamples values of the input by skip into downSampleBuffer,
+   averaging each skip frames.  All the channels are mixed together, unless a
+   single channel was chosen for this search, in which case only that channel
+   is read. */
+static void downSampleInput(sonicStream stream, short* samples, int skip,
+                            int numSamples) {
+  int numChannels = stream->numChannels;
+  int channel = stream->activePitchChannel;
+  int samplesPerValue = numChannels * skip;
   int i, j;
   int value;
   short* downSamples = stream->downSampleBuffer;
 
+  if (channel >= 0) {
+    samples += channel;
+    if (skip == 1) {
+      for (i = 0; i < numSamples; i++) {
+        downSamples[i] = *samples;
+        samples += numChannels;
+      }
+      return;
+    }
+    for (i = 0; i < numSamples; i++) {
+      value = 0;
+      for (j = 0; j < skip; j++) {
+        value += *samples;
+        samples += numChannels;
+      }
+      *downSamples++ = value / skip;
+    }
+    return;
+  }
   for (i = 0; i < numSamples; i++) {
     value = 0;
     for (j = 0; j < samplesPerValue; j++) {
@@ -742,506 +2293,3588 @@ static void downSampleInput(sonicStream stream, short* samples, int skip) {
   }
 }
 
-/* Find the best frequency match in the range, and given a sample skip multiple.
-   For now, just find the pitch of the first channel. */
-static int findPitchPeriodInRange(short* samples, int minPeriod, int maxPeriod,
-                                  int* retMinDiff, int* retMaxDiff) {
-  int period, bestPeriod = 0, worstPeriod = 255;
-  short* s;
-  short* p;
+/* Sum the absolute differences between two runs of samples.  This is the inner
+   loop of the AMDF pitch search, and is where sonic spends most of its time.
+   This is the reference version, which the SIMD versions below must match
+   exactly. */
+static unsigned long computeDiffScalar(const short* s, const short* p,
+                                       int numSamples) {
+  unsigned long diff = 0;
   short sVal, pVal;
-  unsigned long diff, minDiff = 1, maxDiff = 0;
-  int i;
 
-  for (period = minPeriod; period <= maxPeriod; period++) {
-    diff = 0;
-    s = samples;
-    p = samples + period;
-    for (i = 0; i < period; i++) {
-      sVal = *s++;
-      pVal = *p++;
-      diff += sVal >= pVal ? (unsigned short)(sVal - pVal)
-                           : (unsigned short)(pVal - sVal);
-    }
-    /* Note that the highest number of samples we add into diff will be less
-       than 256, since we skip samples.  Thus, diff is a 24 bit number, and
-       we can safely multiply by numSamples without overflow */
-    if (bestPeriod == 0 || diff * bestPeriod < minDiff * period) {
-      minDiff = diff;
-      bestPeriod = period;
-    }
-    if (diff * worstPeriod > maxDiff * period) {
-      maxDiff = diff;
-      worstPeriod = period;
-    }
+  while (numSamples--) {
+    sVal = *s++;
+    pVal = *p++;
+    diff += sVal >= pVal ? (unsigned short)(sVal - pVal)
+                         : (unsigned short)(pVal - sVal);
   }
-  *retMinDiff = minDiff / bestPeriod;
-  *retMaxDiff = maxDiff / worstPeriod;
-  return bestPeriod;
+  return diff;
 }
 
-/* At abrupt ends of voiced words, we can have pitch periods that are better
-   approximated by the previous pitch period estimate.  Try to detect this case.
- */
-static int prevPeriodBetter(sonicStream stream, int minDiff, int maxDiff,
-                            int preferNewPeriod) {
-  if (minDiff == 0 || stream->prevPeriod == 0) {
-    return 0;
-  }
-  if (preferNewPeriod) {
-    if (maxDiff > minDiff * 3) {
-      /* Got a reasonable match this period */
-      return 0;
+/* Sum the absolute differences like computeDiff, one block of
+   SONIC_PRUNE_BLOCK_SIZE samples at a time, but stop early once the sum
+   reaches limit.  Set *numSummed to the number of samples summed. */
+static unsigned long computeDiffBoundedScalar(const short* s, const short* p,
+                                              int numSamples,
+                                              unsigned long limit,
+                                              int* numSummed) {
+  unsigned long diff = 0;
+  int i = 0, end;
+
+  while (i < numSamples) {
+    end = i + SONIC_PRUNE_BLOCK_SIZE;
+    if (end > numSamples) {
+      end = numSamples;
     }
-    if (minDiff * 2 <= stream->prevMinDiff * 3) {
-      /* Mismatch is not that much greater this period */
-      return 0;
+    diff += computeDiffScalar(s + i, p + i, end - i);
+    i = end;
+    if (diff >= limit) {
+      break;
     }
-  } else {
-    if (minDiff <= stream->prevMinDiff) {
-      return 0;
+  }
+  *numSummed = i;
+  return diff;
+}
+
+/* Blend frames first through numSamples - 1 of two interleaved sound segments
+   the way overlapAdd does, ramping rampDown down while ramping rampUp up.
+   Rather than dividing each sample by numSamples, multiply its magnitude by
+   multiplier and shift it right by shift.  overlapAdd picks these so the
+   result is exactly the truncated quotient.  The result is then scaled by the
+   fixed-point volume.  This is the reference version, and also finishes the
+   frames left over by the SIMD versions. */
+static void overlapAddRangeScalar(short* out, const short* rampDown,
+                                  const short* rampUp, int first,
+                                  int numSamples, int numChannels,
+                                  unsigned long multiplier, int shift,
+                                  int volume) {
+  int offset = first * numChannels;
+  int i, t, x, sign, quotient;
+
+  out += offset;
+  rampDown += offset;
+  rampUp += offset;
+  for (t = first; t < numSamples; t++) {
+    for (i = 0; i < numChannels; i++) {
+      x = *rampDown++ * (numSamples - t) + *rampUp++ * t;
+      sign = x < 0 ? -1 : 0;
+      quotient = (int)(((sonicUint64)((x ^ sign) - sign) * multiplier) >>
+                       shift);
+      *out++ = scaleSample((quotient ^ sign) - sign, volume);
     }
   }
-  return 1;
 }
 
-/* Find the pitch period.  This is a critical step, and we may have to try
-   multiple ways to get a good answer.  This version uses Average Magnitude
-   Difference Function (AMDF).  To improve speed, we down sample by an integer
-   factor get in the 11KHz range, and then do it again with a narrower
-   frequency range without down sampling */
-static int findPitchPeriod(sonicStream stream, short* samples,
-                           int preferNewPeriod) {
-  int minPeriod = stream->minPeriod;
-  int maxPeriod = stream->maxPeriod;
-  int minDiff, maxDiff, retPeriod;
-  int skip = computeSkip(stream, stream->sampleRate);
-  int period;
+/* Blend all frames with overlapAddRangeScalar. */
+static void overlapAddScalar(short* out, const short* rampDown,
+                             const short* rampUp, int numSamples,
+                             int numChannels, unsigned long multiplier,
+                             int shift, int volume) {
+  overlapAddRangeScalar(out, rampDown, rampUp, 0, numSamples, numChannels,
+                        multiplier, shift, volume);
+}
 
-  if (stream->numChannels == 1 && skip == 1) {
-    period = findPitchPeriodInRange(samples, minPeriod, maxPeriod, &minDiff,
-                                    &maxDiff);
-  } else {
-    downSampleInput(stream, samples, skip);
-    period = findPitchPeriodInRange(stream->downSampleBuffer, minPeriod / skip,
-                                    maxPeriod / skip, &minDiff, &maxDiff);
-    if (skip != 1) {
-      period *= skip;
-      minPeriod = period - (skip << 2);
-      maxPeriod = period + (skip << 2);
-      if (minPeriod < stream->minPeriod) {
-        minPeriod = stream->minPeriod;
-      }
-      if (maxPeriod > stream->maxPeriod) {
-        maxPeriod = stream->maxPeriod;
-      }
-      if (stream->numChannels == 1) {
-        period = findPitchPeriodInRange(samples, minPeriod, maxPeriod, &minDiff,
-                                        &maxDiff);
-      } else {
-        downSampleInput(stream, samples, 1);
-        period = findPitchPeriodInRange(stream->downSampleBuffer, minPeriod,
-                                        maxPeriod, &minDiff, &maxDiff);
-      }
+/* Apply the filter weights from computeRateWeights to numPoints frames of in,
+   writing one output frame scaled by the fixed-point volume.  The filter can
+   overshoot, so the result is clipped.  Summing the high and low bytes of the
+   weights separately and then combining them gives exactly the same result as
+   summing the full weights with enough bits not to overflow. */
+static void interpolateFrameScalar(short* out, const short* in,
+                                   int numChannels, const short* weights,
+                                   int numPoints, int volume) {
+  const short* low = weights + numPoints;
+  int highSum, lowSum, total, value, i, t;
+
+  for (i = 0; i < numChannels; i++) {
+    highSum = 0;
+    lowSum = 0;
+    for (t = 0; t < numPoints; t++) {
+      value = in[t * numChannels + i];
+      highSum += value * weights[t];
+      lowSum += value * low[t];
     }
+    total = (highSum + (lowSum >> 8)) >> 8;
+    out[i] = scaleSample(CLAMP(total, SHRT_MIN, SHRT_MAX), volume);
   }
-  if (prevPeriodBetter(stream, minDiff, maxDiff, preferNewPeriod)) {
-    retPeriod = stream->prevPeriod;
-  } else {
-    retPeriod = period;
+}
+
+/* Copy numSamples samples from in to out, scaled by a fixed-point volume other
+   than 0. */
+static void scaleSamplesScalar(short* out, const short* in, int numSamples,
+                               int volume) {
+  while (numSamples--) {
+    *out++ = scaleSample(*in++, volume);
   }
-  stream->prevMinDiff = minDiff;
-  stream->prevPeriod = period;
-  return retPeriod;
 }
 
-/* Overlap two sound segments, ramp the volume of one down, while ramping the
-   other one from zero up, and add them, storing the result at the output. */
-static void overlapAdd(int numSamples, int numChannels, short* out,
-                       short* rampDown, short* rampUp) {
-  short* o;
-  short* u;
-  short* d;
+/* The float version of overlapAddRangeScalar, which scales the ramps by the
+   volume rather than the result, and does not clip. */
+static void overlapAddFloatRangeScalar(float* out, const float* rampDown,
+                                       const float* rampUp, int first,
+                                       int numSamples, int numChannels,
+                                       float volume) {
+  float scale = volume / numSamples;
+  float downWeight, upWeight;
+  int offset = first * numChannels;
   int i, t;
 
-  for (i = 0; i < numChannels; i++) {
-    o = out + i;
-    u = rampUp + i;
-    d = rampDown + i;
-    for (t = 0; t < numSamples; t++) {
-#ifdef SONIC_USE_SIN
-      float ratio = sin(t * M_PI / (2 * numSamples));
-      *o = *d * (1.0f - ratio) + *u * ratio;
-#else
-      *o = (*d * (numSamples - t) + *u * t) / numSamples;
-#endif
-      o += numChannels;
-      d += numChannels;
-      u += numChannels;
+  out += offset;
+  rampDown += offset;
+  rampUp += offset;
+  for (t = first; t < numSamples; t++) {
+    downWeight = (float)(numSamples - t) * scale;
+    upWeight = (float)t * scale;
+    for (i = 0; i < numChannels; i++) {
+      *out++ = *rampDown++ * downWeight + *rampUp++ * upWeight;
     }
   }
 }
 
-/* Just move the new samples in the output buffer to the pitch buffer */
-static int moveNewSamplesToPitchBuffer(sonicStream stream,
-                                       int originalNumOutputSamples) {
-  int numSamples = stream->numOutputSamples - originalNumOutputSamples;
-  int numChannels = stream->numChannels;
-  int pitchBufferSize = stream->pitchBufferSize;
-
-  if (stream->numPitchSamples + numSamples > pitchBufferSize) {
-    stream->pitchBufferSize += (pitchBufferSize >> 1) + numSamples;
-    stream->pitchBuffer = (short*)sonicRealloc(
-        stream->pitchBuffer, pitchBufferSize, stream->pitchBufferSize,
-        sizeof(short) * numChannels);
-  }
-  memcpy(stream->pitchBuffer + stream->numPitchSamples * numChannels,
-         stream->outputBuffer + originalNumOutputSamples * numChannels,
-         numSamples * sizeof(short) * numChannels);
-  stream->numOutputSamples = originalNumOutputSamples;
-  stream->numPitchSamples += numSamples;
-  return 1;
+/* Blend all frames with overlapAddFloatRangeScalar. */
+static void overlapAddFloatScalar(float* out, const float* rampDown,
+                                  const float* rampUp, int numSamples,
+                                  int numChannels, float volume) {
+  overlapAddFloatRangeScalar(out, rampDown, rampUp, 0, numSamples,
+                             numChannels, volume);
 }
 
-/* Remove processed samples from the pitch buffer. */
-static void removePitchSamples(sonicStream stream, int numSamples) {
-  int numChannels = stream->numChannels;
-  short* source = stream->pitchBuffer + numSamples * numChannels;
+/* The float version of interpolateFrameScalar.  The high and low bytes of
+   each weight are combined into a float, and the result is scaled by the
+   volume, without clipping. */
+static void interpolateFloatFrameScalar(float* out, const float* in,
+                                        int numChannels, const short* weights,
+                                        int numPoints, float volume) {
+  const short* low = weights + numPoints;
+  float taps[SONIC_HQ_FILTER_POINTS];
+  float scale = volume / 65536.0f;
+  float sum;
+  int i, t;
 
-  if (numSamples == 0) {
-    return;
+  for (t = 0; t < numPoints; t++) {
+    taps[t] = (float)(weights[t] * 256 + low[t]);
   }
-  if (numSamples != stream->numPitchSamples) {
-    memmove(
-        stream->pitchBuffer, source,
-        (stream->numPitchSamples - numSamples) * sizeof(short) * numChannels);
+  for (i = 0; i < numChannels; i++) {
+    sum = 0.0f;
+    for (t = 0; t < numPoints; t++) {
+      sum += in[t * numChannels + i] * taps[t];
+    }
+    out[i] = sum * scale;
   }
-  stream->numPitchSamples -= numSamples;
 }
 
-/* Approximate the sinc function times a Hann window from the sinc table. */
-static int findSincCoefficient(int i, int ratio, int width) {
-  int lobePoints = (SINC_TABLE_SIZE - 1) / SINC_FILTER_POINTS;
-  int left = i * lobePoints + (ratio * lobePoints) / width;
-  int right = left + 1;
-  int position = i * lobePoints * width + ratio * lobePoints - left * width;
-  int leftVal = sincTable[left];
-  int rightVal = sincTable[right];
-
-  return ((leftVal * (width - position) + rightVal * position) << 1) / width;
+/* Copy numSamples floats from in to out, scaled by the volume. */
+static void scaleFloatSamplesScalar(float* out, const float* in,
+                                    int numSamples, float volume) {
+  while (numSamples--) {
+    *out++ = *in++ * volume;
+  }
 }
 
-/* Return 1 if value >= 0, else -1.  This represents the sign of value. */
-static int getSign(int value) { return value >= 0 ? 1 : -1; }
+#ifdef SONIC_X86_SIMD
 
-/* Interpolate the new output sample. */
-static short interpolate(sonicStream stream, short* in, int oldSampleRate,
-                         int newSampleRate) {
-  /* Compute N-point sinc FIR-filter here.  Clip rather than overflow. */
-  int i;
-  int total = 0;
-  int position = stream->newRatePosition * oldSampleRate;
-  int leftPosition = stream->oldRatePosition * newSampleRate;
-  int rightPosition = (stream->oldRatePosition + 1) * newSampleRate;
-  int ratio = rightPosition - position - 1;
-  int width = rightPosition - leftPosition;
-  int weight, value;
-  int oldSign;
-  int overflowCount = 0;
+/* Return the number of samples in the shortest run of whole frames that also
+   fills a whole number of vectors of vectorSize samples. */
+static int overlapAddCycleSize(int numChannels, int vectorSize) {
+  int cycleSize = vectorSize;
 
-  for (i = 0; i < SINC_FILTER_POINTS; i++) {
-    weight = findSincCoefficient(i, ratio, width);
-    value = in[i * stream->numChannels] * weight;
-    oldSign = getSign(total);
-    total += value;
-    if (oldSign != getSign(total) && getSign(value) == oldSign) {
-      /* We must have overflowed.  This can happen with a sinc filter. */
-      overflowCount += oldSign;
-    }
+  while (cycleSize % numChannels != 0) {
+    cycleSize += vectorSize;
   }
-  /* It is better to clip than to wrap if there was a overflow. */
-  if (overflowCount > 0) {
-    return SHRT_MAX;
-  } else if (overflowCount < 0) {
-    return SHRT_MIN;
+  return cycleSize;
+}
+
+/* Write the weights for one vector of overlapAdd into weights.  Samples are
+   blended in pairs by a multiply-add of (rampDown, rampUp) with
+   (numSamples - t, t), where t is the frame of the sample.  The low half of a
+   vector holds samples 0-3 of each 8 in the vector, and the high half holds
+   samples 4-7, which is how the unpack instructions interleave the ramps.
+   start is the index of the first sample in the vector. */
+static void overlapAddWeights(short* weights, int start, int vectorSize,
+                              int high, int numSamples, int numChannels) {
+  int pair, sample, frame;
+
+  for (pair = 0; pair < vectorSize >> 1; pair++) {
+    sample = start + (pair & 3) + ((pair >> 2) << 3) + (high ? 4 : 0);
+    frame = sample / numChannels;
+    weights[pair << 1] = numSamples - frame;
+    weights[(pair << 1) + 1] = frame;
   }
-  return total >> 16;
 }
 
-/* Change the rate.  Interpolate with a sinc FIR filter using a Hann window. */
-static int adjustRate(sonicStream stream, float rate,
-                      int originalNumOutputSamples) {
-  int newSampleRate = stream->sampleRate / rate;
-  int oldSampleRate = stream->sampleRate;
-  int numChannels = stream->numChannels;
-  int position;
-  short *in, *out;
+/* SSE2 version of computeDiffScalar.  Samples are biased by 0x8000 so they can
+   be compared as unsigned values, and the absolute difference is then the OR of
+   the two saturating unsigned differences.  This is exact, since the absolute
+   difference of two shorts always fits in 16 unsigned bits.  The differences
+   are widened to 32 bits before accumulating.  Periods are at most
+   SONIC_MAX_SAMPLE_RATE/SONIC_MIN_PITCH samples, so no 32-bit lane can
+   overflow. */
+__attribute__((target("sse2"))) static unsigned long computeDiffSSE2(
+    const short* s, const short* p, int numSamples) {
+  __m128i bias = _mm_set1_epi16((short)0x8000);
+  __m128i zero = _mm_setzero_si128();
+  __m128i total = _mm_setzero_si128();
+  __m128i a, b, diff;
+  unsigned int lanes[4];
   int i;
-  int N = SINC_FILTER_POINTS;
 
-  /* Set these values to help with the integer math */
-  while (newSampleRate > (1 << 14) || oldSampleRate > (1 << 14)) {
-    newSampleRate >>= 1;
-    oldSampleRate >>= 1;
+  for (i = 0; i + 8 <= numSamples; i += 8) {
+    a = _mm_xor_si128(_mm_loadu_si128((const __m128i*)(s + i)), bias);
+    b = _mm_xor_si128(_mm_loadu_si128((const __m128i*)(p + i)), bias);
+    diff = _mm_or_si128(_mm_subs_epu16(a, b), _mm_subs_epu16(b, a));
+    total = _mm_add_epi32(total, _mm_unpacklo_epi16(diff, zero));
+    total = _mm_add_epi32(total, _mm_unpackhi_epi16(diff, zero));
   }
-  if (stream->numOutputSamples == originalNumOutputSamples) {
-    return 1;
+  _mm_storeu_si128((__m128i*)lanes, total);
+  return (unsigned long)lanes[0] + lanes[1] + lanes[2] + lanes[3] +
+         computeDiffScalar(s + i, p + i, numSamples - i);
+}
+
+/* AVX2 version of computeDiffSSE2, handling 16 samples per iteration.  The
+   tail is summed here too, rather than by calling computeDiffSSE2, since
+   mixing legacy SSE code with dirty AVX registers is very slow on some CPUs. */
+__attribute__((target("avx2"))) static unsigned long computeDiffAVX2(
+    const short* s, const short* p, int numSamples) {
+  __m256i bias = _mm256_set1_epi16((short)0x8000);
+  __m256i zero = _mm256_setzero_si256();
+  __m256i total = _mm256_setzero_si256();
+  __m256i a, b, diff;
+  unsigned int lanes[8];
+  unsigned long sum;
+  short sVal, pVal;
+  int i;
+
+  for (i = 0; i + 16 <= numSamples; i += 16) {
+    a = _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)(s + i)), bias);
+    b = _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)(p + i)), bias);
+    diff = _mm256_or_si256(_mm256_subs_epu16(a, b), _mm256_subs_epu16(b, a));
+    total = _mm256_add_epi32(total, _mm256_unpacklo_epi16(diff, zero));
+    total = _mm256_add_epi32(total, _mm256_unpackhi_epi16(diff, zero));
   }
-  if (!moveNewSamplesToPitchBuffer(stream, originalNumOutputSamples)) {
-    return 0;
+  _mm256_storeu_si256((__m256i*)lanes, total);
+  sum = (unsigned long)lanes[0] + lanes[1] + lanes[2] + lanes[3] + lanes[4] +
+        lanes[5] + lanes[6] + lanes[7];
+  for (; i < numSamples; i++) {
+    sVal = s[i];
+    pVal = p[i];
+    sum += sVal >= pVal ? (unsigned short)(sVal - pVal)
+                        : (unsigned short)(pVal - sVal);
   }
-  /* Leave at least N pitch sample in the buffer */
-  for (position = 0; position < stream->numPitchSamples - N; position++) {
-    while ((stream->oldRatePosition + 1) * newSampleRate >
-           stream->newRatePosition * oldSampleRate) {
-      if (!enlargeOutputBufferIfNeeded(stream, 1)) {
-        return 0;
-      }
-      out = stream->outputBuffer + stream->numOutputSamples * numChannels;
-      in = stream->pitchBuffer + position * numChannels;
+  return sum;
+}
+
+/* SSE2 version of computeDiffBoundedScalar.  The lanes are only added together
+   at the end of each block. */
+__attribute__((target("sse2"))) static unsigned long computeDiffBoundedSSE2(
+    const short* s, const short* p, int numSamples, unsigned long limit,
+    int* numSummed) {
+  __m128i bias = _mm_set1_epi16((short)0x8000);
+  __m128i zero = _mm_setzero_si128();
+  __m128i total, a, b, diff;
+  unsigned long sum = 0;
+  short sVal, pVal;
+  int i = 0, end;
+
+  while (i < numSamples) {
+    end = i + SONIC_PRUNE_BLOCK_SIZE;
+    if (end > numSamples) {
+      end = numSamples;
+    }
+    total = _mm_setzero_si128();
+    for (; i + 8 <= end; i += 8) {
+      a = _mm_xor_si128(_mm_loadu_si128((const __m128i*)(s + i)), bias);
+      b = _mm_xor_si128(_mm_loadu_si128((const __m128i*)(p + i)), bias);
+      diff = _mm_or_si128(_mm_subs_epu16(a, b), _mm_subs_epu16(b, a));
+      total = _mm_add_epi32(total, _mm_unpacklo_epi16(diff, zero));
+      total = _mm_add_epi32(total, _mm_unpackhi_epi16(diff, zero));
+    }
+    total = _mm_add_epi32(total, _mm_shuffle_epi32(total, 0x4e));
+    total = _mm_add_epi32(total, _mm_shuffle_epi32(total, 0xb1));
+    sum += (unsigned int)_mm_cvtsi128_si32(total);
+    for (; i < end; i++) {
+      sVal = s[i];
+      pVal = p[i];
+      sum += sVal >= pVal ? (unsigned short)(sVal - pVal)
+                          : (unsigned short)(pVal - sVal);
+    }
+    if (sum >= limit) {
+      break;
+    }
+  }
+  *numSummed = i;
+  return sum;
+}
+
+/* AVX2 version of computeDiffBoundedScalar. */
+__attribute__((target("avx2"))) static unsigned long computeDiffBoundedAVX2(
+    const short* s, const short* p, int numSamples, unsigned long limit,
+    int* numSummed) {
+  __m256i bias = _mm256_set1_epi16((short)0x8000);
+  __m256i zero = _mm256_setzero_si256();
+  __m256i total, a, b, diff;
+  __m128i half;
+  unsigned long sum = 0;
+  short sVal, pVal;
+  int i = 0, end;
+
+  while (i < numSamples) {
+    end = i + SONIC_PRUNE_BLOCK_SIZE;
+    if (end > numSamples) {
+      end = numSamples;
+    }
+    total = _mm256_setzero_si256();
+    for (; i + 16 <= end; i += 16) {
+      a = _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)(s + i)), bias);
+      b = _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)(p + i)), bias);
+      diff =
+          _mm256_or_si256(_mm256_subs_epu16(a, b), _mm256_subs_epu16(b, a));
+      total = _mm256_add_epi32(total, _mm256_unpacklo_epi16(diff, zero));
+      total = _mm256_add_epi32(total, _mm256_unpackhi_epi16(diff, zero));
+    }
+    half = _mm_add_epi32(_mm256_castsi256_si128(total),
+                         _mm256_extracti128_si256(total, 1));
+    half = _mm_add_epi32(half, _mm_shuffle_epi32(half, 0x4e));
+    half = _mm_add_epi32(half, _mm_shuffle_epi32(half, 0xb1));
+    sum += (unsigned int)_mm_cvtsi128_si32(half);
+    for (; i < end; i++) {
+      sVal = s[i];
+      pVal = p[i];
+      sum += sVal >= pVal ? (unsigned short)(sVal - pVal)
+                          : (unsigned short)(pVal - sVal);
+    }
+    if (sum >= limit) {
+      break;
+    }
+  }
+  *numSummed = i;
+  return sum;
+}
+
+/* Overlap-adds with more channels than this use overlapAddScalar, since a
+   cycle of whole frames and whole vectors gets too long. */
+#define SONIC_MAX_SIMD_OVERLAP_CHANNELS 16
+
+/* Divide four 32-bit lanes by the overlap length, using the multiplier and
+   shift from overlapAdd, truncating toward zero like C division. */
+__attribute__((target("sse2"))) static __m128i divideLanesSSE2(
+    __m128i x, __m128i multiplier, __m128i shift) {
+  __m128i sign = _mm_srai_epi32(x, 31);
+  __m128i magnitude = _mm_sub_epi32(_mm_xor_si128(x, sign), sign);
+  __m128i even = _mm_srl_epi64(_mm_mul_epu32(magnitude, multiplier), shift);
+  __m128i odd = _mm_srl_epi64(
+      _mm_mul_epu32(_mm_srli_epi64(magnitude, 32), multiplier), shift);
+  __m128i quotient = _mm_or_si128(even, _mm_slli_epi64(odd, 32));
+
+  return _mm_sub_epi32(_mm_xor_si128(quotient, sign), sign);
+}
+
+/* Scale eight samples by a fixed-point volume, set in every lane of volume,
+   the way scaleSample does.  The products are widened to 32 bits from their
+   low and high halves, and after shifting, the pack saturates them to 16 bits,
+   leaving only -32768 to clip to -32767. */
+__attribute__((target("sse2"))) static __m128i scaleLanesSSE2(__m128i samples,
+                                                             __m128i volume) {
+  __m128i low = _mm_mullo_epi16(samples, volume);
+  __m128i high = _mm_mulhi_epi16(samples, volume);
+  __m128i first = _mm_srai_epi32(_mm_unpacklo_epi16(low, high), 8);
+  __m128i second = _mm_srai_epi32(_mm_unpackhi_epi16(low, high), 8);
+
+  return _mm_max_epi16(_mm_packs_epi32(first, second),
+                       _mm_set1_epi16(-32767));
+}
+
+/* SSE2 version of scaleSamplesScalar. */
+__attribute__((target("sse2"))) static void scaleSamplesSSE2(
+    short* out, const short* in, int numSamples, int volume) {
+  __m128i lanesVolume = _mm_set1_epi16((short)volume);
+  int i;
+
+  for (i = 0; i + 8 <= numSamples; i += 8) {
+    _mm_storeu_si128(
+        (__m128i*)(out + i),
+        scaleLanesSSE2(_mm_loadu_si128((const __m128i*)(in + i)),
+                       lanesVolume));
+  }
+  scaleSamplesScalar(out + i, in + i, numSamples - i, volume);
+}
+
+/* SSE2 version of overlapAddScalar, blending 8 samples per vector.  The ramp
+   weights repeat with a period of one cycle of whole frames and whole vectors,
+   which is a single vector for 1, 2, 4 and 8 channels.  They are computed once
+   per call and stepped forward one cycle at a time. */
+__attribute__((target("sse2"))) static void overlapAddSSE2(
+    short* out, const short* rampDown, const short* rampUp, int numSamples,
+    int numChannels, unsigned long multiplier, int shift, int volume) {
+  __m128i weights[2 * SONIC_MAX_SIMD_OVERLAP_CHANNELS];
+  __m128i lanesMultiplier = _mm_set1_epi32((int)multiplier);
+  __m128i lanesShift = _mm_cvtsi32_si128(shift);
+  __m128i lanesVolume = _mm_set1_epi16((short)volume);
+  __m128i step, down, up, low, high, result;
+  short vectorWeights[8];
+  int cycleSize, cycleFrames, numVectors, i, t, offset;
+
+  if (numChannels > SONIC_MAX_SIMD_OVERLAP_CHANNELS) {
+    overlapAddScalar(out, rampDown, rampUp, numSamples, numChannels,
+                     multiplier, shift, volume);
+    return;
+  }
+  cycleSize = overlapAddCycleSize(numChannels, 8);
+  cycleFrames = cycleSize / numChannels;
+  numVectors = cycleSize >> 3;
+  for (i = 0; i < 2 * numVectors; i++) {
+    overlapAddWeights(vectorWeights, (i >> 1) << 3, 8, i & 1, numSamples,
+                      numChannels);
+    weights[i] = _mm_loadu_si128((const __m128i*)vectorWeights);
+  }
+  step = _mm_set1_epi32((cycleFrames << 16) | (-cycleFrames & 0xffff));
+  for (t = 0; t + cycleFrames <= numSamples; t += cycleFrames) {
+    for (i = 0; i < numVectors; i++) {
+      offset = t * numChannels + (i << 3);
+      down = _mm_loadu_si128((const __m128i*)(rampDown + offset));
+      up = _mm_loadu_si128((const __m128i*)(rampUp + offset));
+      low = divideLanesSSE2(
+          _mm_madd_epi16(_mm_unpacklo_epi16(down, up), weights[2 * i]),
+          lanesMultiplier, lanesShift);
+      high = divideLanesSSE2(
+          _mm_madd_epi16(_mm_unpackhi_epi16(down, up), weights[2 * i + 1]),
+          lanesMultiplier, lanesShift);
+      result = _mm_packs_epi32(low, high);
+      if (volume != 0) {
+        result = scaleLanesSSE2(result, lanesVolume);
+      }
+      _mm_storeu_si128((__m128i*)(out + offset), result);
+      weights[2 * i] = _mm_add_epi16(weights[2 * i], step);
+      weights[2 * i + 1] = _mm_add_epi16(weights[2 * i + 1], step);
+    }
+  }
+  overlapAddRangeScalar(out, rampDown, rampUp, t, numSamples, numChannels,
+                        multiplier, shift, volume);
+}
+
+/* AVX2 version of divideLanesSSE2, for eight 32-bit lanes. */
+__attribute__((target("avx2"))) static __m256i divideLanesAVX2(
+    __m256i x, __m256i multiplier, __m128i shift) {
+  __m256i sign = _mm256_srai_epi32(x, 31);
+  __m256i magnitude = _mm256_sub_epi32(_mm256_xor_si256(x, sign), sign);
+  __m256i even =
+      _mm256_srl_epi64(_mm256_mul_epu32(magnitude, multiplier), shift);
+  __m256i odd = _mm256_srl_epi64(
+      _mm256_mul_epu32(_mm256_srli_epi64(magnitude, 32), multiplier), shift);
+  __m256i quotient = _mm256_or_si256(even, _mm256_slli_epi64(odd, 32));
+
+  return _mm256_sub_epi32(_mm256_xor_si256(quotient, sign), sign);
+}
+
+/* AVX2 version of scaleLanesSSE2, for sixteen samples. */
+__attribute__((target("avx2"))) static __m256i scaleLanesAVX2(
+    __m256i samples, __m256i volume) {
+  __m256i low = _mm256_mullo_epi16(samples, volume);
+  __m256i high = _mm256_mulhi_epi16(samples, volume);
+  __m256i first = _mm256_srai_epi32(_mm256_unpacklo_epi16(low, high), 8);
+  __m256i second = _mm256_srai_epi32(_mm256_unpackhi_epi16(low, high), 8);
+
+  return _mm256_max_epi16(_mm256_packs_epi32(first, second),
+                          _mm256_set1_epi16(-32767));
+}
+
+/* AVX2 version of overlapAddSSE2, blending 16 samples per vector.  The AVX2
+   unpack and pack instructions work within each 128-bit half, so the low
+   weights cover samples 0-3 and 8-11, and the high weights cover samples 4-7
+   and 12-15, which the pack puts back in order. */
+__attribute__((target("avx2"))) static void overlapAddAVX2(
+    short* out, const short* rampDown, const short* rampUp, int numSamples,
+    int numChannels, unsigned long multiplier, int shift, int volume) {
+  __m256i weights[2 * SONIC_MAX_SIMD_OVERLAP_CHANNELS];
+  __m256i lanesMultiplier = _mm256_set1_epi32((int)multiplier);
+  __m128i lanesShift = _mm_cvtsi32_si128(shift);
+  __m256i lanesVolume = _mm256_set1_epi16((short)volume);
+  __m256i step, down, up, low, high, result;
+  short vectorWeights[16];
+  int cycleSize, cycleFrames, numVectors, i, t, offset;
+
+  if (numChannels > SONIC_MAX_SIMD_OVERLAP_CHANNELS) {
+    overlapAddScalar(out, rampDown, rampUp, numSamples, numChannels,
+                     multiplier, shift, volume);
+    return;
+  }
+  cycleSize = overlapAddCycleSize(numChannels, 16);
+  cycleFrames = cycleSize / numChannels;
+  numVectors = cycleSize >> 4;
+  for (i = 0; i < 2 * numVectors; i++) {
+    overlapAddWeights(vectorWeights, (i >> 1) << 4, 16, i & 1, numSamples,
+                      numChannels);
+    weights[i] = _mm256_loadu_si256((const __m256i*)vectorWeights);
+  }
+  step = _mm256_set1_epi32((cycleFrames << 16) | (-cycleFrames & 0xffff));
+  for (t = 0; t + cycleFrames <= numSamples; t += cycleFrames) {
+    for (i = 0; i < numVectors; i++) {
+      offset = t * numChannels + (i << 4);
+      down = _mm256_loadu_si256((const __m256i*)(rampDown + offset));
+      up = _mm256_loadu_si256((const __m256i*)(rampUp + offset));
+      low = divideLanesAVX2(
+          _mm256_madd_epi16(_mm256_unpacklo_epi16(down, up), weights[2 * i]),
+          lanesMultiplier, lanesShift);
+      high = divideLanesAVX2(
+          _mm256_madd_epi16(_mm256_unpackhi_epi16(down, up),
+                            weights[2 * i + 1]),
+          lanesMultiplier, lanesShift);
+      result = _mm256_packs_epi32(low, high);
+      if (volume != 0) {
+        result = scaleLanesAVX2(result, lanesVolume);
+      }
+      _mm256_storeu_si256((__m256i*)(out + offset), result);
+      weights[2 * i] = _mm256_add_epi16(weights[2 * i], step);
+      weights[2 * i + 1] = _mm256_add_epi16(weights[2 * i + 1], step);
+    }
+  }
+  overlapAddRangeScalar(out, rampDown, rampUp, t, numSamples, numChannels,
+                        multiplier, shift, volume);
+}
+
+/* Return the sum of the four 32-bit lanes of sums. */
+__attribute__((target("sse2"))) static int sumLanesSSE2(__m128i sums) {
+  sums = _mm_add_epi32(sums, _mm_srli_si128(sums, 8));
+  sums = _mm_add_epi32(sums, _mm_srli_si128(sums, 4));
+  return _mm_cvtsi128_si32(sums);
+}
+
+/* Apply the filter to 8 adjacent channels of in, or to 4 if wide is 0, and
+   return the clipped outputs.  Taps are taken in pairs, interleaving the two
+   input frames, so one multiply-add applies both taps to each channel.  This
+   can read up to 3 samples past the channels wanted in each frame, which is
+   safe since adjustRate always leaves another frame after the filter. */
+__attribute__((target("sse2"))) static __m128i interpolateChannelsSSE2(
+    const short* in, int numChannels, const short* weights, int numPoints,
+    int wide) {
+  const short* low = weights + numPoints;
+  __m128i zero = _mm_setzero_si128();
+  __m128i highSums = zero, lowSums = zero;
+  __m128i wideHighSums = zero, wideLowSums = zero;
+  __m128i first, second = zero, pairs, highWeights, lowWeights;
+  int t;
+
+  for (t = 0; t < numPoints; t += 2) {
+    if (t + 1 < numPoints) {
+      highWeights = _mm_unpacklo_epi16(_mm_set1_epi16(weights[t]),
+                                       _mm_set1_epi16(weights[t + 1]));
+      lowWeights = _mm_unpacklo_epi16(_mm_set1_epi16(low[t]),
+                                      _mm_set1_epi16(low[t + 1]));
+    } else {
+      highWeights = _mm_unpacklo_epi16(_mm_set1_epi16(weights[t]), zero);
+      lowWeights = _mm_unpacklo_epi16(_mm_set1_epi16(low[t]), zero);
+    }
+    if (wide) {
+      first = _mm_loadu_si128((const __m128i*)(in + t * numChannels));
+      if (t + 1 < numPoints) {
+        second =
+            _mm_loadu_si128((const __m128i*)(in + (t + 1) * numChannels));
+      }
+      pairs = _mm_unpackhi_epi16(first, second);
+      wideHighSums =
+          _mm_add_epi32(wideHighSums, _mm_madd_epi16(pairs, highWeights));
+      wideLowSums =
+          _mm_add_epi32(wideLowSums, _mm_madd_epi16(pairs, lowWeights));
+    } else {
+      first = _mm_loadl_epi64((const __m128i*)(in + t * numChannels));
+      if (t + 1 < numPoints) {
+        second =
+            _mm_loadl_epi64((const __m128i*)(in + (t + 1) * numChannels));
+      }
+    }
+    pairs = _mm_unpacklo_epi16(first, second);
+    highSums = _mm_add_epi32(highSums, _mm_madd_epi16(pairs, highWeights));
+    lowSums = _mm_add_epi32(lowSums, _mm_madd_epi16(pairs, lowWeights));
+  }
+  highSums = _mm_srai_epi32(
+      _mm_add_epi32(highSums, _mm_srai_epi32(lowSums, 8)), 8);
+  wideHighSums = _mm_srai_epi32(
+      _mm_add_epi32(wideHighSums, _mm_srai_epi32(wideLowSums, 8)), 8);
+  return _mm_packs_epi32(highSums, wideHighSums);
+}
+
+/* SSE2 version of interpolateFrameScalar.  Mono input is contiguous, so the
+   filter is applied to 8 samples at a time with multiply-adds.  Otherwise,
+   the weights are applied to 8 channels at a time, which shares them across
+   every channel in the frame. */
+__attribute__((target("sse2"))) static void interpolateFrameSSE2(
+    short* out, const short* in, int numChannels, const short* weights,
+    int numPoints, int volume) {
+  const short* low = weights + numPoints;
+  __m128i highSums = _mm_setzero_si128();
+  __m128i lowSums = _mm_setzero_si128();
+  __m128i samples;
+  short lanes[8];
+  int highSum, lowSum, total, t, i;
+
+  if (numChannels != 1) {
+    for (i = 0; i < numChannels; i += 8) {
+      samples = interpolateChannelsSSE2(in + i, numChannels, weights,
+                                        numPoints, numChannels - i > 4);
+      if (volume != 0) {
+        samples = scaleLanesSSE2(samples, _mm_set1_epi16((short)volume));
+      }
+      if (numChannels - i >= 8) {
+        _mm_storeu_si128((__m128i*)(out + i), samples);
+      } else {
+        _mm_storeu_si128((__m128i*)lanes, samples);
+        memcpy(out + i, lanes, (numChannels - i) * sizeof(short));
+      }
+    }
+    return;
+  }
+  for (t = 0; t + 8 <= numPoints; t += 8) {
+    samples = _mm_loadu_si128((const __m128i*)(in + t));
+    highSums = _mm_add_epi32(
+        highSums,
+        _mm_madd_epi16(samples,
+                       _mm_loadu_si128((const __m128i*)(weights + t))));
+    lowSums = _mm_add_epi32(
+        lowSums,
+        _mm_madd_epi16(samples, _mm_loadu_si128((const __m128i*)(low + t))));
+  }
+  if (t + 4 <= numPoints) {
+    samples = _mm_loadl_epi64((const __m128i*)(in + t));
+    highSums = _mm_add_epi32(
+        highSums,
+        _mm_madd_epi16(samples,
+                       _mm_loadl_epi64((const __m128i*)(weights + t))));
+    lowSums = _mm_add_epi32(
+        lowSums,
+        _mm_madd_epi16(samples, _mm_loadl_epi64((const __m128i*)(low + t))));
+    t += 4;
+  }
+  highSum = sumLanesSSE2(highSums);
+  lowSum = sumLanesSSE2(lowSums);
+  for (; t < numPoints; t++) {
+    highSum += in[t] * weights[t];
+    lowSum += in[t] * low[t];
+  }
+  total = (highSum + (lowSum >> 8)) >> 8;
+  *out = scaleSample(CLAMP(total, SHRT_MIN, SHRT_MAX), volume);
+}
+
+/* SSE2 version of scaleFloatSamplesScalar. */
+__attribute__((target("sse2"))) static void scaleFloatSamplesSSE2(
+    float* out, const float* in, int numSamples, float volume) {
+  __m128 lanesVolume = _mm_set1_ps(volume);
+  int i;
+
+  for (i = 0; i + 4 <= numSamples; i += 4) {
+    _mm_storeu_ps(out + i, _mm_mul_ps(_mm_loadu_ps(in + i), lanesVolume));
+  }
+  scaleFloatSamplesScalar(out + i, in + i, numSamples - i, volume);
+}
+
+/* SSE2 version of overlapAddFloatScalar, blending 4 samples per vector.  Like
+   overlapAddSSE2, it works a cycle of whole frames and whole vectors at a
+   time, adding the frame of each sample within the cycle to the frame the
+   cycle starts at.  The weights are computed the same way as in the scalar
+   version, so the result is exactly the same. */
+__attribute__((target("sse2"))) static void overlapAddFloatSSE2(
+    float* out, const float* rampDown, const float* rampUp, int numSamples,
+    int numChannels, float volume) {
+  __m128 frameOffsets[SONIC_MAX_SIMD_OVERLAP_CHANNELS];
+  __m128 scale = _mm_set1_ps(volume / numSamples);
+  __m128 total = _mm_set1_ps((float)numSamples);
+  __m128 start, frames, down, up;
+  float vectorOffsets[4];
+  int cycleSize, cycleFrames, numVectors, i, j, t, offset;
+
+  if (numChannels > SONIC_MAX_SIMD_OVERLAP_CHANNELS) {
+    overlapAddFloatScalar(out, rampDown, rampUp, numSamples, numChannels,
+                          volume);
+    return;
+  }
+  cycleSize = overlapAddCycleSize(numChannels, 4);
+  cycleFrames = cycleSize / numChannels;
+  numVectors = cycleSize >> 2;
+  for (i = 0; i < numVectors; i++) {
+    for (j = 0; j < 4; j++) {
+      vectorOffsets[j] = (float)(((i << 2) + j) / numChannels);
+    }
+    frameOffsets[i] = _mm_loadu_ps(vectorOffsets);
+  }
+  for (t = 0; t + cycleFrames <= numSamples; t += cycleFrames) {
+    start = _mm_set1_ps((float)t);
+    for (i = 0; i < numVectors; i++) {
+      offset = t * numChannels + (i << 2);
+      frames = _mm_add_ps(start, frameOffsets[i]);
+      down = _mm_mul_ps(_mm_loadu_ps(rampDown + offset),
+                        _mm_mul_ps(_mm_sub_ps(total, frames), scale));
+      up = _mm_mul_ps(_mm_loadu_ps(rampUp + offset), _mm_mul_ps(frames, scale));
+      _mm_storeu_ps(out + offset, _mm_add_ps(down, up));
+    }
+  }
+  overlapAddFloatRangeScalar(out, rampDown, rampUp, t, numSamples,
+                             numChannels, volume);
+}
+
+/* SSE2 version of interpolateFloatFrameScalar.  The weights are converted to
+   floats 4 at a time.  Mono input is filtered 4 taps at a time, and otherwise
+   each tap is applied to 4 channels at a time, which like
+   interpolateChannelsSSE2 can read up to 3 samples past the frame. */
+__attribute__((target("sse2"))) static void interpolateFloatFrameSSE2(
+    float* out, const float* in, int numChannels, const short* weights,
+    int numPoints, float volume) {
+  const short* low = weights + numPoints;
+  float taps[SONIC_HQ_FILTER_POINTS];
+  float lanes[4];
+  float scale = volume / 65536.0f;
+  __m128i high, lowBytes;
+  __m128 sums;
+  float sum;
+  int i, t;
+
+  for (t = 0; t + 4 <= numPoints; t += 4) {
+    high = _mm_loadl_epi64((const __m128i*)(weights + t));
+    lowBytes = _mm_loadl_epi64((const __m128i*)(low + t));
+    high = _mm_srai_epi32(_mm_unpacklo_epi16(high, high), 16);
+    lowBytes = _mm_srli_epi32(_mm_unpacklo_epi16(lowBytes, lowBytes), 16);
+    _mm_storeu_ps(taps + t, _mm_cvtepi32_ps(_mm_add_epi32(
+                                _mm_slli_epi32(high, 8), lowBytes)));
+  }
+  for (; t < numPoints; t++) {
+    taps[t] = (float)(weights[t] * 256 + low[t]);
+  }
+  if (numChannels == 1) {
+    sums = _mm_setzero_ps();
+    for (t = 0; t + 4 <= numPoints; t += 4) {
+      sums = _mm_add_ps(sums, _mm_mul_ps(_mm_loadu_ps(in + t),
+                                         _mm_loadu_ps(taps + t)));
+    }
+    sums = _mm_add_ps(sums, _mm_movehl_ps(sums, sums));
+    sums = _mm_add_ss(sums, _mm_shuffle_ps(sums, sums, 1));
+    sum = _mm_cvtss_f32(sums);
+    for (; t < numPoints; t++) {
+      sum += in[t] * taps[t];
+    }
+    *out = sum * scale;
+    return;
+  }
+  for (i = 0; i < numChannels; i += 4) {
+    sums = _mm_setzero_ps();
+    for (t = 0; t < numPoints; t++) {
+      sums = _mm_add_ps(sums, _mm_mul_ps(_mm_loadu_ps(in + t * numChannels + i),
+                                         _mm_set1_ps(taps[t])));
+    }
+    sums = _mm_mul_ps(sums, _mm_set1_ps(scale));
+    if (numChannels - i >= 4) {
+      _mm_storeu_ps(out + i, sums);
+    } else {
+      _mm_storeu_ps(lanes, sums);
+      memcpy(out + i, lanes, (numChannels - i) * sizeof(float));
+    }
+  }
+}
+
+#endif /* SONIC_X86_SIMD */
+
+static unsigned long computeDiffResolve(const short* s, const short* p,
+                                        int numSamples);
+static unsigned long computeDiffBoundedResolve(const short* s, const short* p,
+                                               int numSamples,
+                                               unsigned long limit,
+                                               int* numSummed);
+static void overlapAddResolve(short* out, const short* rampDown,
+                              const short* rampUp, int numSamples,
+                              int numChannels, unsigned long multiplier,
+                              int shift, int volume);
+static void interpolateFrameResolve(short* out, const short* in,
+                                    int numChannels, const short* weights,
+                                    int numPoints, int volume);
+static void scaleSamplesResolve(short* out, const short* in, int numSamples,
+                                int volume);
+static void overlapAddFloatResolve(float* out, const float* rampDown,
+                                   const float* rampUp, int numSamples,
+                                   int numChannels, float volume);
+static void interpolateFloatFrameResolve(float* out, const float* in,
+                                         int numChannels, const short* weights,
+                                         int numPoints, float volume);
+static void scaleFloatSamplesResolve(float* out, const float* in,
+                                     int numSamples, float volume);
+
+/* The SIMD kernels to use.  initStream replaces them with the fastest
+   versions this CPU has, once, under kernelMutex, so no thread can call one
+   while another is setting it.  Until then they point at the resolve
+   functions, which do the same. */
+static unsigned long (*computeDiff)(const short* s, const short* p,
+                                    int numSamples) = computeDiffResolve;
+static unsigned long (*computeDiffBounded)(
+    const short* s, const short* p, int numSamples, unsigned long limit,
+    int* numSummed) = computeDiffBoundedResolve;
+static void (*overlapAddFrames)(short* out, const short* rampDown,
+                                const short* rampUp, int numSamples,
+                                int numChannels, unsigned long multiplier,
+                                int shift, int volume) = overlapAddResolve;
+static void (*interpolateFrame)(short* out, const short* in, int numChannels,
+                                const short* weights, int numPoints,
+                                int volume) = interpolateFrameResolve;
+static void (*scaleSamples)(short* out, const short* in, int numSamples,
+                            int volume) = scaleSamplesResolve;
+static void (*overlapAddFloatFrames)(float* out, const float* rampDown,
+                                     const float* rampUp, int numSamples,
+                                     int numChannels,
+                                     float volume) = overlapAddFloatResolve;
+static void (*interpolateFloatFrame)(
+    float* out, const float* in, int numChannels, const short* weights,
+    int numPoints, float volume) = interpolateFloatFrameResolve;
+static void (*scaleFloatSamples)(float* out, const float* in, int numSamples,
+                                 float volume) = scaleFloatSamplesResolve;
+
+/* Select the SIMD kernels for this CPU. */
+static void selectKernels(void) {
+#ifdef SONIC_X86_SIMD
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    computeDiff = computeDiffAVX2;
+    computeDiffBounded = computeDiffBoundedAVX2;
+    overlapAddFrames = overlapAddAVX2;
+    interpolateFrame = interpolateFrameSSE2;
+    scaleSamples = scaleSamplesSSE2;
+    overlapAddFloatFrames = overlapAddFloatSSE2;
+    interpolateFloatFrame = interpolateFloatFrameSSE2;
+    scaleFloatSamples = scaleFloatSamplesSSE2;
+    convertFloatsToShorts = convertFloatsToShortsSSE2;
+    convertShortsToFloats = convertShortsToFloatsSSE2;
+    convertUnsignedCharsToShorts = convertUnsignedCharsToShortsSSE2;
+    convertShortsToUnsignedChars = convertShortsToUnsignedCharsSSE2;
+    convertIntsToShorts = convertIntsToShortsSSE2;
+    convertShortsToInts = convertShortsToIntsSSE2;
+  } else if (__builtin_cpu_supports("sse2")) {
+    computeDiff = computeDiffSSE2;
+    computeDiffBounded = computeDiffBoundedSSE2;
+    overlapAddFrames = overlapAddSSE2;
+    interpolateFrame = interpolateFrameSSE2;
+    scaleSamples = scaleSamplesSSE2;
+    overlapAddFloatFrames = overlapAddFloatSSE2;
+    interpolateFloatFrame = interpolateFloatFrameSSE2;
+    scaleFloatSamples = scaleFloatSamplesSSE2;
+    convertFloatsToShorts = convertFloatsToShortsSSE2;
+    convertShortsToFloats = convertShortsToFloatsSSE2;
+    convertUnsignedCharsToShorts = convertUnsignedCharsToShortsSSE2;
+    convertShortsToUnsignedChars = convertShortsToUnsignedCharsSSE2;
+    convertIntsToShorts = convertIntsToShortsSSE2;
+    convertShortsToInts = convertShortsToIntsSSE2;
+  } else {
+    computeDiff = computeDiffScalar;
+    computeDiffBounded = computeDiffBoundedScalar;
+    overlapAddFrames = overlapAddScalar;
+    interpolateFrame = interpolateFrameScalar;
+    scaleSamples = scaleSamplesScalar;
+    overlapAddFloatFrames = overlapAddFloatScalar;
+    interpolateFloatFrame = interpolateFloatFrameScalar;
+    scaleFloatSamples = scaleFloatSamplesScalar;
+    convertFloatsToShorts = convertFloatsToShortsScalar;
+    convertShortsToFloats = convertShortsToFloatsScalar;
+    convertUnsignedCharsToShorts = convertUnsignedCharsToShortsScalar;
+    convertShortsToUnsignedChars = convertShortsToUnsignedCharsScalar;
+    convertIntsToShorts = convertIntsToShortsScalar;
+    convertShortsToInts = convertShortsToIntsScalar;
+  }
+#else
+  computeDiff = computeDiffScalar;
+  computeDiffBounded = computeDiffBoundedScalar;
+  overlapAddFrames = overlapAddScalar;
+  interpolateFrame = interpolateFrameScalar;
+  scaleSamples = scaleSamplesScalar;
+  overlapAddFloatFrames = overlapAddFloatScalar;
+  interpolateFloatFrame = interpolateFloatFrameScalar;
+  scaleFloatSamples = scaleFloatSamplesScalar;
+  convertFloatsToShorts = convertFloatsToShortsScalar;
+  convertShortsToFloats = convertShortsToFloatsScalar;
+  convertUnsignedCharsToShorts = convertUnsignedCharsToShortsScalar;
+  convertShortsToUnsignedChars = convertShortsToUnsignedCharsScalar;
+  convertIntsToShorts = convertIntsToShortsScalar;
+  convertShortsToInts = convertShortsToIntsScalar;
+#endif /* SONIC_X86_SIMD */
+}
+
+/* Select the SIMD kernels for this CPU, and then call computeDiff. */
+static unsigned long computeDiffResolve(const short* s, const short* p,
+                                        int numSamples) {
+  initKernels();
+  return computeDiff(s, p, numSamples);
+}
+
+/* Select the SIMD kernels for this CPU, and then call computeDiffBounded. */
+static unsigned long computeDiffBoundedResolve(const short* s, const short* p,
+                                               int numSamples,
+                                               unsigned long limit,
+                                               int* numSummed) {
+  initKernels();
+  return computeDiffBounded(s, p, numSamples, limit, numSummed);
+}
+
+/* Select the SIMD kernels for this CPU, and then call overlapAddFrames. */
+static void overlapAddResolve(short* out, const short* rampDown,
+                              const short* rampUp, int numSamples,
+                              int numChannels, unsigned long multiplier,
+                              int shift, int volume) {
+  initKernels();
+  overlapAddFrames(out, rampDown, rampUp, numSamples, numChannels, multiplier,
+                   shift, volume);
+}
+
+/* Select the SIMD kernels for this CPU, and then call interpolateFrame. */
+static void interpolateFrameResolve(short* out, const short* in,
+                                    int numChannels, const short* weights,
+                                    int numPoints, int volume) {
+  initKernels();
+  interpolateFrame(out, in, numChannels, weights, numPoints, volume);
+}
+
+/* Select the SIMD kernels for this CPU, and then call scaleSamples. */
+static void scaleSamplesResolve(short* out, const short* in, int numSamples,
+                                int volume) {
+  initKernels();
+  scaleSamples(out, in, numSamples, volume);
+}
+
+/* Select the SIMD kernels for this CPU, and then call
+   overlapAddFloatFrames. */
+static void overlapAddFloatResolve(float* out, const float* rampDown,
+                                   const float* rampUp, int numSamples,
+                                   int numChannels, float volume) {
+  initKernels();
+  overlapAddFloatFrames(out, rampDown, rampUp, numSamples, numChannels,
+                        volume);
+}
+
+/* Select the SIMD kernels for this CPU, and then call
+   interpolateFloatFrame. */
+static void interpolateFloatFrameResolve(float* out, const float* in,
+                                         int numChannels, const short* weights,
+                                         int numPoints, float volume) {
+  initKernels();
+  interpolateFloatFrame(out, in, numChannels, weights, numPoints, volume);
+}
+
+/* Select the SIMD kernels for this CPU, and then call scaleFloatSamples. */
+static void scaleFloatSamplesResolve(float* out, const float* in,
+                                     int numSamples, float volume) {
+  initKernels();
+  scaleFloatSamples(out, in, numSamples, volume);
+}
+
+/* Select the SIMD kernels for this CPU, and then call
+   convertFloatsToShorts. */
+static void convertFloatsToShortsResolve(short* out, const float* in,
+                                         int numSamples) {
+  initKernels();
+  convertFloatsToShorts(out, in, numSamples);
+}
+
+/* Select the SIMD kernels for this CPU, and then call
+   convertShortsToFloats. */
+static void convertShortsToFloatsResolve(float* out, const short* in,
+                                         int numSamples) {
+  initKernels();
+  convertShortsToFloats(out, in, numSamples);
+}
+
+/* Select the SIMD kernels for this CPU, and then call
+   convertUnsignedCharsToShorts. */
+static void convertUnsignedCharsToShortsResolve(short* out,
+                                                const unsigned char* in,
+                                                int numSamples) {
+  initKernels();
+  convertUnsignedCharsToShorts(out, in, numSamples);
+}
+
+/* Select the SIMD kernels for this CPU, and then call
+   convertShortsToUnsignedChars. */
+static void convertShortsToUnsignedCharsResolve(unsigned char* out,
+                                                const short* in,
+                                                int numSamples) {
+  initKernels();
+  convertShortsToUnsignedChars(out, in, numSamples);
+}
+
+/* Select the SIMD kernels for this CPU, and then call convertIntsToShorts. */
+static void convertIntsToShortsResolve(short* out, const int* in,
+                                       int numSamples) {
+  initKernels();
+  convertIntsToShorts(out, in, numSamples);
+}
+
+/* Select the SIMD kernels for this CPU, and then call convertShortsToInts. */
+static void convertShortsToIntsResolve(int* out, const short* in,
+                                       int numSamples) {
+  initKernels();
+  convertShortsToInts(out, in, numSamples);
+}
+
+/* Copy numSamples frames from in to out, scaling them by the stream's output
+   volume unless it is 0. */
+static void copySamples(sonicStream stream, short* out, const short* in,
+                        int numSamples) {
+  int count = numSamples * stream->numChannels;
+
+  if (stream->outputVolume == 0) {
+    memcpy(out, in, numSamples * sizeof(short) * stream->frameWidth);
+  } else if (stream->floatSamples) {
+    scaleFloatSamples((float*)out, (const float*)in, count, stream->volume);
+  } else {
+    scaleSamples(out, in, count, stream->outputVolume);
+  }
+}
+
+/* Copy from the input buffer to the output buffer, and remove the samples from
+   the input buffer. */
+static int copyInputToOutput(sonicStream stream, int numSamples) {
+  if (!enlargeOutputBufferIfNeeded(stream, numSamples)) {
+    return 0;
+  }
+  copySamples(stream,
+              stream->outputBuffer +
+                  stream->numOutputSamples * stream->frameWidth,
+              stream->inputBuffer, numSamples);
+  stream->numOutputSamples += numSamples;
+  removeInputSamples(stream, numSamples);
+  return 1;
+}
+
+/* Copy from samples to the output buffer */
+static int copyToOutput(sonicStream stream, short* samples, int numSamples) {
+  if (!enlargeOutputBufferIfNeeded(stream, numSamples)) {
+    return 0;
+  }
+  copySamples(stream,
+              stream->outputBuffer +
+                  stream->numOutputSamples * stream->frameWidth,
+              samples, numSamples);
+  stream->numOutputSamples += numSamples;
+  return 1;
+}
+
+/* Find the best frequency match in the range, and given a sample skip multiple.
+   For now, just find the pitch of the first channel. */
+static int findPitchPeriodInRange(short* samples, int minPeriod, int maxPeriod,
+                                  int* retMinDiff, int* retMaxDiff) {
+  int period, bestPeriod = 0, worstPeriod = 255;
+  unsigned long diff, minDiff = 1, maxDiff = 0;
+
+  for (period = minPeriod; period <= maxPeriod; period++) {
+    diff = computeDiff(samples, samples + period, period);
+    /* Note that the highest number of samples we add into diff will be less
+       than 256, since we skip samples.  Thus, diff is a 24 bit number, and
+       we can safely multiply by numSamples without overflow */
+    if (bestPeriod == 0 || diff * bestPeriod < minDiff * period) {
+      minDiff = diff;
+      bestPeriod = period;
+    }
+    if (diff * worstPeriod > maxDiff * period) {
+      maxDiff = diff;
+      worstPeriod = period;
+    }
+  }
+  *retMinDiff = minDiff / bestPeriod;
+  *retMaxDiff = maxDiff / worstPeriod;
+  return bestPeriod;
+}
+
+/* Add more of the AMDF sum for a period that was pruned, until it covers the
+   whole period, or it reaches limit. */
+static void resumePrunedDiff(sonicStream stream, short* samples, int period,
+                             unsigned long limit) {
+  unsigned long diff = stream->prunedDiffs[period];
+  int summed = stream->prunedCounts[period];
+  int count;
+
+  if (diff >= limit) {
+    return;
+  }
+  diff += computeDiffBounded(samples + summed, samples + period + summed,
+                             period - summed, limit - diff, &count);
+  stream->prunedDiffs[period] = diff;
+  stream->prunedCounts[period] = summed + count;
+}
+
+/* Find the pitch period the same way as findPitchPeriodInRange, but stop
+   summing a period's AMDF as soon as it can no longer be the best.  Since the
+   differences are never negative, a partial sum is a lower bound on the full
+   sum, so it is checked after each block of SONIC_PRUNE_BLOCK_SIZE samples
+   against the best period so far.  A good guess at the answer, seedPeriod, is
+   summed first, so periods before it can be pruned too.  Pass 0 if there is no
+   guess.
+
+   The worst diff is only ever used to check if it is more than 3 times the best
+   diff, so it does not have to be exact above that.  If no partial sum shows
+   that it is, the pruned sums are resumed until one does, or they are all
+   complete.  This way the output is exactly the same as without pruning. */
+static int findPitchPeriodPruned(sonicStream stream, short* samples,
+                                 int minPeriod, int maxPeriod, int seedPeriod,
+                                 int* retMinDiff, int* retMaxDiff) {
+  unsigned long* diffs = stream->prunedDiffs;
+  int* counts = stream->prunedCounts;
+  int period, bestPeriod = 0, worstPeriod = 255;
+  unsigned long diff, minDiff = 1, maxDiff = 0, seedDiff = 0, limit;
+  /* minDiff*period/bestPeriod and seedDiff*period/seedPeriod, as quotients
+     and remainders, are stepped along with period to avoid dividing for each
+     period. */
+  unsigned long bestQuotient = 0, bestRemainder = 0, bestStep = 0;
+  unsigned long bestStepRemainder = 0, seedQuotient = 0, seedRemainder = 0;
+  unsigned long seedStep = 0, seedStepRemainder = 0;
+  int summed, numPruned = 0;
+
+  if (seedPeriod < minPeriod || seedPeriod > maxPeriod) {
+    seedPeriod = 0;
+  } else {
+    seedDiff = computeDiff(samples, samples + seedPeriod, seedPeriod);
+    seedQuotient = seedDiff * minPeriod / seedPeriod;
+    seedRemainder = seedDiff * minPeriod % seedPeriod;
+    seedStep = seedDiff / seedPeriod;
+    seedStepRemainder = seedDiff % seedPeriod;
+  }
+  for (period = minPeriod; period <= maxPeriod; period++) {
+    if (period == seedPeriod) {
+      diff = seedDiff;
+      summed = period;
+    } else {
+      /* This period loses once diff*bestPeriod >= minDiff*period, or
+         diff*seedPeriod > seedDiff*period. */
+      limit = ULONG_MAX;
+      if (bestPeriod != 0) {
+        limit = bestQuotient + (bestRemainder != 0);
+      }
+      if (seedPeriod != 0 && seedQuotient + 1 < limit) {
+        limit = seedQuotient + 1;
+      }
+      diff = computeDiffBounded(samples, samples + period, period, limit,
+                                &summed);
+    }
+    diffs[period] = diff;
+    counts[period] = summed;
+    if (summed < period) {
+      numPruned++;
+    } else if (bestPeriod == 0 || diff * bestPeriod < minDiff * period) {
+      minDiff = diff;
+      bestPeriod = period;
+      bestQuotient = minDiff;
+      bestRemainder = 0;
+      bestStep = minDiff / bestPeriod;
+      bestStepRemainder = minDiff % bestPeriod;
+    }
+    if (diff * worstPeriod > maxDiff * period) {
+      maxDiff = diff;
+      worstPeriod = period;
+    }
+    bestQuotient += bestStep;
+    bestRemainder += bestStepRemainder;
+    if (bestRemainder >= (unsigned long)bestPeriod) {
+      bestQuotient++;
+      bestRemainder -= bestPeriod;
+    }
+    if (seedPeriod != 0) {
+      seedQuotient += seedStep;
+      seedRemainder += seedStepRemainder;
+      if (seedRemainder >= (unsigned long)seedPeriod) {
+        seedQuotient++;
+        seedRemainder -= seedPeriod;
+      }
+    }
+  }
+  minDiff /= bestPeriod;
+  /* The worst diff is more than 3 times the best if the sum for some period is
+     at least limit times the period. */
+  limit = 3 * minDiff + 1;
+  for (period = minPeriod; period <= maxPeriod && numPruned > 0 &&
+                           maxDiff < limit * worstPeriod;
+       period++) {
+    if (counts[period] < period) {
+      resumePrunedDiff(stream, samples, period, limit * period);
+      diff = diffs[period];
+      if (diff * worstPeriod > maxDiff * period) {
+        maxDiff = diff;
+        worstPeriod = period;
+      }
+    }
+  }
+  for (period = minPeriod; period <= maxPeriod && numPruned > 0; period++) {
+    stream->pitchSamplesPruned += period - counts[period];
+  }
+  *retMinDiff = minDiff;
+  *retMaxDiff = maxDiff / worstPeriod;
+  return bestPeriod;
+}
+
+/* Select the best and worst periods from AMDF sums already computed for each
+   period in the range.  This must match the selection made in
+   findPitchPeriodInRange exactly. */
+static int selectPitchPeriod(unsigned long* diffs, int minPeriod,
+                             int maxPeriod, int* retMinDiff, int* retMaxDiff) {
+  int period, bestPeriod = 0, worstPeriod = 255;
+  unsigned long diff, minDiff = 1, maxDiff = 0;
+
+  for (period = minPeriod; period <= maxPeriod; period++) {
+    diff = diffs[period];
+    if (bestPeriod == 0 || diff * bestPeriod < minDiff * period) {
+      minDiff = diff;
+      bestPeriod = period;
+    }
+    if (diff * worstPeriod > maxDiff * period) {
+      maxDiff = diff;
+      worstPeriod = period;
+    }
+  }
+  *retMinDiff = minDiff / bestPeriod;
+  *retMaxDiff = maxDiff / worstPeriod;
+  return bestPeriod;
+}
+
+/* Find the pitch period the same way as findPitchPeriodInRange, but reuse the
+   AMDF sums from the previous search.  The sum for a period covers the first
+   period samples of the window, so if the window has only moved a few samples
+   since the last search, we can subtract the differences that left the window
+   and add the ones that entered it, rather than summing them all again.  The
+   sums are exact, so the result is the same as a full search.  position is the
+   position of samples in the input stream, and samples has been down-sampled
+   by skip. */
+static int findPitchPeriodIncrementally(sonicStream stream, short* samples,
+                                        long position, int skip,
+                                        int minPeriod, int maxPeriod,
+                                        int* retMinDiff, int* retMaxDiff) {
+  unsigned long* diffs = stream->pitchDiffs;
+  short* window = stream->pitchWindow;
+  long delta = position - stream->pitchWindowPosition;
+  int step = delta / skip;
+  int reuse = stream->pitchWindowValid && stream->pitchWindowSkip == skip &&
+              stream->pitchWindowMinPeriod == minPeriod &&
+              stream->pitchWindowMaxPeriod == maxPeriod &&
+              stream->pitchWindowChannel == stream->activePitchChannel &&
+              delta >= 0 && delta % skip == 0;
+  int period;
+
+  for (period = minPeriod; period <= maxPeriod; period++) {
+    if (reuse && 2 * step < period) {
+      diffs[period] += computeDiff(samples + period - step,
+                                   samples + 2 * period - step, step);
+      diffs[period] -= computeDiff(window, window + period, step);
+    } else {
+      diffs[period] = computeDiff(samples, samples + period, period);
+    }
+  }
+  memcpy(window, samples, (stream->maxRequired / skip) * sizeof(short));
+  stream->pitchWindowPosition = position;
+  stream->pitchWindowSkip = skip;
+  stream->pitchWindowMinPeriod = minPeriod;
+  stream->pitchWindowMaxPeriod = maxPeriod;
+  stream->pitchWindowChannel = stream->activePitchChannel;
+  stream->pitchWindowValid = 1;
+  return selectPitchPeriod(diffs, minPeriod, maxPeriod, retMinDiff,
+                           retMaxDiff);
+}
+
+/* Search the full pitch range of the window, which has been down-sampled by
+   skip.  Use the incremental search if it is enabled. */
+static int findPitchPeriodInWindow(sonicStream stream, short* samples,
+                                   long position, int skip, int* retMinDiff,
+                                   int* retMaxDiff) {
+  int minPeriod = stream->minPeriod / skip;
+  int maxPeriod = stream->maxPeriod / skip;
+
+  if (stream->incrementalPitchSearch) {
+    return findPitchPeriodIncrementally(stream, samples, position, skip,
+                                        minPeriod, maxPeriod, retMinDiff,
+                                        retMaxDiff);
+  }
+  /* Pruning only pays off in voiced speech, since otherwise the worst diff is
+     rarely more than 3 times the best, and the pruned sums all have to be
+     completed anyway.  Voicing rarely changes from one period to the next, so
+     only prune if the previous search found a good match. */
+  if (stream->pitchPruning && stream->prevMinDiff * 3 < stream->prevMaxDiff) {
+    return findPitchPeriodPruned(stream, samples, minPeriod, maxPeriod,
+                                 stream->prevPeriod / skip, retMinDiff,
+                                 retMaxDiff);
+  }
+  return findPitchPeriodInRange(samples, minPeriod, maxPeriod, retMinDiff,
+                                retMaxDiff);
+}
+
+/* Compute an in-place complex FFT of n points, where n is a power of 2.  The
+   real and imaginary parts are in separate arrays, so the compiler can
+   vectorize the butterflies.  Each stage of half-size h uses the twiddle
+   factors at twiddles[h .. 2h - 1], with the sines n points later, so the
+   same table works for any FFT size up to n. */
+static void computeFFT(float* re, float* im, int n, const float* twiddles,
+                       int tableSize) {
+  const float* wr;
+  const float* wi;
+  float* ar;
+  float* ai;
+  float* br;
+  float* bi;
+  int i, j, k, bit, half;
+  float tr, ti;
+
+  /* Reorder the data in bit-reversed index order. */
+  for (i = 1, j = 0; i < n; i++) {
+    for (bit = n >> 1; j & bit; bit >>= 1) {
+      j ^= bit;
+    }
+    j ^= bit;
+    if (i < j) {
+      tr = re[i];
+      re[i] = re[j];
+      re[j] = tr;
+      ti = im[i];
+      im[i] = im[j];
+      im[j] = ti;
+    }
+  }
+  /* The first stage needs no multiplies. */
+  for (i = 0; i < n; i += 2) {
+    tr = re[i + 1];
+    ti = im[i + 1];
+    re[i + 1] = re[i] - tr;
+    im[i + 1] = im[i] - ti;
+    re[i] += tr;
+    im[i] += ti;
+  }
+  for (half = 2; half < n; half <<= 1) {
+    wr = twiddles + half;
+    wi = twiddles + tableSize + half;
+    for (i = 0; i < n; i += half << 1) {
+      ar = re + i;
+      ai = im + i;
+      br = ar + half;
+      bi = ai + half;
+      for (k = 0; k < half; k++) {
+        tr = wr[k] * br[k] - wi[k] * bi[k];
+        ti = wr[k] * bi[k] + wi[k] * br[k];
+        br[k] = ar[k] - tr;
+        bi[k] = ai[k] - ti;
+        ar[k] += tr;
+        ai[k] += ti;
+      }
+    }
+  }
+}
+
+/* Find the pitch period with an FFT, rather than AMDF.  For each period p,
+   this computes the squared difference function over a fixed window of W =
+   maxPeriod samples:
+
+       d(p) = sum((x[i] - x[i + p])^2) = e(0) + e(p) - 2*r(p)
+
+   where e(p) is the energy of x[p] to x[p + W - 1], which comes from prefix
+   sums, and r(p) is the correlation of the first W samples with the window.
+   Both real signals are packed into one complex FFT, and separated using the
+   FFT's symmetry.  Since r is real, its inverse FFT is done as a complex FFT
+   of half the size.  This is O(N log N) for all periods at once, rather than
+   O(N^2) for AMDF.  The returned diffs are RMS differences per sample, so they
+   are on about the same scale as the AMDF diffs used by prevPeriodBetter. */
+static int findPitchPeriodFFT(sonicStream stream, short* samples,
+                              int* retMinDiff, int* retMaxDiff) {
+  int n = stream->fftSize;
+  int half = n >> 1;
+  int window = stream->maxPeriod;
+  int numSamples = stream->maxRequired;
+  float* re = stream->fftBuffer;
+  float* im = stream->fftBuffer + n;
+  const float* twiddles = stream->fftTwiddles;
+  double* energies = stream->fftEnergies;
+  int period, bestPeriod = 0, worstPeriod = 0;
+  double diff, minDiff = 0.0, maxDiff = 0.0, value, correlation, sum;
+  double normalized, bestNormalized = 0.0;
+  int foundDip = 0;
+  float zr, zi, yr, yi, ar, ai, br, bi, cr, ci, dr, di, wr, wi;
+  int i, k;
+
+  if (stream->numChannels != 1) {
+    downSampleInput(stream, samples, 1, numSamples);
+    samples = stream->downSampleBuffer;
+  }
+  energies[0] = 0.0;
+  for (i = 0; i < numSamples; i++) {
+    value = samples[i] / 32768.0;
+    energies[i + 1] = energies[i] + value * value;
+    re[i] = i < window ? value : 0.0f;
+    im[i] = value;
+  }
+  for (; i < n; i++) {
+    re[i] = 0.0f;
+    im[i] = 0.0f;
+  }
+  computeFFT(re, im, n, twiddles, n);
+  /* Separate the two spectra A and B, and replace them with conj(A)*B, the
+     spectrum of the correlation.  Bins k and n - k are done together, since
+     each needs the other. */
+  for (k = 0; k <= half; k++) {
+    i = (n - k) & (n - 1);
+    zr = re[k];
+    zi = im[k];
+    yr = re[i];
+    yi = im[i];
+    ar = 0.5f * (zr + yr);
+    ai = 0.5f * (zi - yi);
+    br = 0.5f * (zi + yi);
+    bi = 0.5f * (yr - zr);
+    cr = ar * br + ai * bi;
+    ci = ar * bi - ai * br;
+    re[k] = cr;
+    im[k] = ci;
+    re[i] = cr;
+    im[i] = -ci;
+  }
+  /* Fold the spectrum so a half-size FFT gives the even samples of r in the
+     real parts, and the odd ones in the imaginary parts.  The inverse FFT is
+     done as a forward FFT of the conjugate. */
+  for (k = 0; k < half; k++) {
+    wr = twiddles[half + k];
+    wi = -twiddles[n + half + k];
+    cr = re[k] + re[k + half];
+    ci = im[k] + im[k + half];
+    dr = re[k] - re[k + half];
+    di = im[k] - im[k + half];
+    re[k] = cr - (dr * wi + di * wr);
+    im[k] = -(ci + dr * wr - di * wi);
+  }
+  computeFFT(re, im, half, twiddles, n);
+  /* Like YIN, normalize d(p) by its mean over periods 1 to p, and pick the
+     first dip below SONIC_FFT_PITCH_THRESHOLD, or the lowest point if there is
+     none.  A fixed window otherwise has nearly equal dips at each multiple of
+     the pitch period. */
+  sum = 0.0;
+  for (period = 1; period <= stream->maxPeriod; period++) {
+    correlation = (period & 1) ? -im[period >> 1] : re[period >> 1];
+    diff = energies[window] + energies[period + window] - energies[period] -
+           2.0 * correlation / n;
+    if (diff < 0.0) {
+      diff = 0.0;
+    }
+    sum += diff;
+    if (period < stream->minPeriod) {
+      continue;
+    }
+    normalized = sum > 0.0 ? diff * period / sum : 1.0;
+    if (worstPeriod == 0 || diff > maxDiff) {
+      maxDiff = diff;
+      worstPeriod = period;
+    }
+    if (bestPeriod == 0 || normalized < bestNormalized) {
+      if (!foundDip) {
+        bestNormalized = normalized;
+        bestPeriod = period;
+        minDiff = diff;
+      }
+    } else if (bestNormalized < SONIC_FFT_PITCH_THRESHOLD) {
+      foundDip = 1;
+    }
+  }
+  *retMinDiff = minDiff > 0.0 ? (int)(32768.0 * sqrt(minDiff / window)) : 0;
+  *retMaxDiff = maxDiff > 0.0 ? (int)(32768.0 * sqrt(maxDiff / window)) : 0;
+  return bestPeriod;
+}
+
+/* At abrupt ends of voiced words, we can have pitch periods that are better
+   approximated by the previous pitch period estimate.  Try to detect this case.
+ */
+static int prevPeriodBetter(sonicStream stream, int minDiff, int maxDiff,
+                            int preferNewPeriod) {
+  if (minDiff == 0 || stream->prevPeriod == 0) {
+    return 0;
+  }
+  if (preferNewPeriod) {
+    if (maxDiff > minDiff * 3) {
+      /* Got a reasonable match this period */
+      return 0;
+    }
+    if (minDiff * 2 <= stream->prevMinDiff * 3) {
+      /* Mismatch is not that much greater this period */
+      return 0;
+    }
+  } else {
+    if (minDiff <= stream->prevMinDiff) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/* Refine a period found with down-sampling by skip, using a pyramid of
+   searches.  Each level is down-sampled SONIC_PITCH_PYRAMID_RATIO times less
+   than the one before, and searches within 4 of the previous level's samples
+   of its period, so the last search at the full sample rate only has to cover
+   a few periods, no matter how high the sample rate is. */
+static int refinePitchPeriodInPyramid(sonicStream stream, short* samples,
+                                      int period, int skip, int* retMinDiff,
+                                      int* retMaxDiff) {
+  int levelSkip, minPeriod, maxPeriod;
+  short* levelSamples;
+
+  while (skip > 1) {
+    levelSkip = skip / SONIC_PITCH_PYRAMID_RATIO;
+    if (levelSkip < 1) {
+      levelSkip = 1;
+    }
+    minPeriod = period - (skip << 2);
+    maxPeriod = period + (skip << 2);
+    if (minPeriod < stream->minPeriod) {
+      minPeriod = stream->minPeriod;
+    }
+    if (maxPeriod > stream->maxPeriod) {
+      maxPeriod = stream->maxPeriod;
+    }
+    minPeriod = (minPeriod + levelSkip - 1) / levelSkip;
+    maxPeriod /= levelSkip;
+    if (stream->numChannels == 1 && levelSkip == 1) {
+      levelSamples = samples;
+    } else {
+      downSampleInput(stream, samples, levelSkip, maxPeriod << 1);
+      levelSamples = stream->downSampleBuffer;
+    }
+    period = levelSkip * findPitchPeriodInRange(levelSamples, minPeriod,
+                                                maxPeriod, retMinDiff,
+                                                retMaxDiff);
+    skip = levelSkip;
+  }
+  return period;
+}
+
+/* Search for the pitch period over the full pitch range.  This version uses
+   Average Magnitude Difference Function (AMDF).  To improve speed, we down
+   sample by an integer factor get in the 11KHz range, and then do it again
+   with a narrower frequency range without down sampling.  position is the
+   position of samples in the input stream. */
+static int searchPitchPeriod(sonicStream stream, short* samples, long position,
+                             int* retMinDiff, int* retMaxDiff) {
+  int minPeriod = stream->minPeriod;
+  int maxPeriod = stream->maxPeriod;
+  int minDiff, maxDiff;
+  int skip = computeSkip(stream, stream->sampleRate);
+  int period;
+
+  if (stream->pitchDetector == SONIC_PITCH_DETECTOR_FFT) {
+    return findPitchPeriodFFT(stream, samples, retMinDiff, retMaxDiff);
+  }
+  if (stream->numChannels == 1 && skip == 1) {
+    period = findPitchPeriodInWindow(stream, samples, position, 1, &minDiff,
+                                     &maxDiff);
+  } else {
+    downSampleInput(stream, samples, skip, stream->maxRequired / skip);
+    period = findPitchPeriodInWindow(stream, stream->downSampleBuffer,
+                                     position, skip, &minDiff, &maxDiff);
+    if (skip != 1 && stream->pitchPyramid) {
+      period = refinePitchPeriodInPyramid(stream, samples, period * skip, skip,
+                                          &minDiff, &maxDiff);
+    } else if (skip != 1) {
+      period *= skip;
+      minPeriod = period - (skip << 2);
+      maxPeriod = period + (skip << 2);
+      if (minPeriod < stream->minPeriod) {
+        minPeriod = stream->minPeriod;
+      }
+      if (maxPeriod > stream->maxPeriod) {
+        maxPeriod = stream->maxPeriod;
+      }
+      if (stream->numChannels == 1) {
+        period = findPitchPeriodInRange(samples, minPeriod, maxPeriod, &minDiff,
+                                        &maxDiff);
+      } else {
+        downSampleInput(stream, samples, 1, maxPeriod << 1);
+        period = findPitchPeriodInRange(stream->downSampleBuffer, minPeriod,
+                                        maxPeriod, &minDiff, &maxDiff);
+      }
+    }
+  }
+  *retMinDiff = minDiff;
+  *retMaxDiff = maxDiff;
+  return period;
+}
+
+/* Look for the pitch period in a narrow band around the previous period.
+   Voiced speech changes pitch slowly, so this usually finds the same period a
+   full search would, at a fraction of the cost.  Return 0 if the best match
+   is at the edge of the band, since then the pitch has probably moved out of
+   it, or if the match is poor, in which case we should do a full search.  The
+   AMDF at half the previous period is used as a reference for how poor a match
+   is, since a voiced signal is close to out of phase with itself there.  When
+   down-sampling, the band is kept narrower than the range of the refinement
+   search, so tracking is never slower than a full search. */
+static int trackPitchPeriod(sonicStream stream, short* samples,
+                            int* retPeriod, int* retMinDiff,
+                            int* retMaxDiff) {
+  int prevPeriod = stream->prevPeriod;
+  int halfPeriod = prevPeriod >> 1;
+  int band = prevPeriod >> SONIC_PITCH_TRACKING_BAND_SHIFT;
+  int skip = computeSkip(stream, stream->sampleRate);
+  int minPeriod, maxPeriod, period, minDiff, maxDiff, halfPeriodDiff;
+
+  if (skip != 1 && band > (skip << 1)) {
+    band = skip << 1;
+  }
+  if (band < 2) {
+    band = 2;
+  }
+  minPeriod = prevPeriod - band;
+  maxPeriod = prevPeriod + band;
+  if (minPeriod < stream->minPeriod) {
+    minPeriod = stream->minPeriod;
+  }
+  if (maxPeriod > stream->maxPeriod) {
+    maxPeriod = stream->maxPeriod;
+  }
+  if (stream->numChannels != 1) {
+    downSampleInput(stream, samples, 1, maxPeriod << 1);
+    samples = stream->downSampleBuffer;
+  }
+  period = findPitchPeriodInRange(samples, minPeriod, maxPeriod, &minDiff,
+                                  &maxDiff);
+  if ((period == minPeriod && minPeriod != stream->minPeriod) ||
+      (period == maxPeriod && maxPeriod != stream->maxPeriod)) {
+    return 0;
+  }
+  halfPeriodDiff =
+      computeDiff(samples, samples + halfPeriod, halfPeriod) / halfPeriod;
+  if (halfPeriodDiff > maxDiff) {
+    maxDiff = halfPeriodDiff;
+  }
+  if (minDiff * 3 >= maxDiff) {
+    return 0;
+  }
+  *retPeriod = period;
+  *retMinDiff = minDiff;
+  *retMaxDiff = maxDiff;
+  return 1;
+}
+
+/* Find the pitch period.  This is a critical step, and we may have to try
+   multiple ways to get a good answer.  If pitch tracking is enabled, first
+   look near the previous period, and only search the full range if that
+   fails.  position is the position of samples in the input stream. */
+static int findPitchPeriod(sonicStream stream, short* samples, long position,
+                           int preferNewPeriod) {
+  int minDiff, maxDiff, retPeriod;
+  int period;
+
+  stream->activePitchChannel = selectPitchChannel(stream, samples);
+  /* Only track the pitch if the previous period was a good match, since
+     otherwise we are probably not in voiced speech. */
+  if (stream->pitchTracking && stream->prevPeriod != 0 &&
+      stream->prevMinDiff * 3 < stream->prevMaxDiff &&
+      trackPitchPeriod(stream, samples, &period, &minDiff, &maxDiff)) {
+    /* The saved sums of the incremental search are now out of date. */
+    stream->pitchWindowValid = 0;
+  } else {
+    period = searchPitchPeriod(stream, samples, position, &minDiff, &maxDiff);
+  }
+  if (prevPeriodBetter(stream, minDiff, maxDiff, preferNewPeriod)) {
+    retPeriod = stream->prevPeriod;
+  } else {
+    retPeriod = period;
+  }
+  stream->prevMinDiff = minDiff;
+  stream->prevMaxDiff = maxDiff;
+  stream->prevPeriod = period;
+  return retPeriod;
+}
+
+#ifdef SONIC_USE_SIN
+/* Compute the sine ramp for an overlap-add of numSamples frames, unless it is
+   the same length as the last one. */
+static float* findSineRamp(sonicStream stream, int numSamples) {
+  float* ramp = stream->sineRamp;
+  int t;
+
+  /* Successive periods are often the same length, so keep the last ramp. */
+  if (stream->sineRampSize != numSamples) {
+    for (t = 0; t < numSamples; t++) {
+      ramp[t] = sin(t * M_PI / (2 * numSamples));
+    }
+    stream->sineRampSize = numSamples;
+  }
+  return ramp;
+}
+#endif /* SONIC_USE_SIN */
+
+/* The float version of overlapAdd, for streams that process floats. */
+static void overlapAddFloat(sonicStream stream, int numSamples, float* out,
+                            const float* rampDown, const float* rampUp) {
+  float volume = stream->outputVolume != 0 ? stream->volume : 1.0f;
+#ifdef SONIC_USE_SIN
+  float* ramp = findSineRamp(stream, numSamples);
+  float ratio;
+  int i, t;
+
+  for (t = 0; t < numSamples; t++) {
+    ratio = ramp[t];
+    for (i = 0; i < stream->numChannels; i++) {
+      *out++ = (*rampDown++ * (1.0f - ratio) + *rampUp++ * ratio) * volume;
+    }
+  }
+#else
+  overlapAddFloatFrames(out, rampDown, rampUp, numSamples, stream->numChannels,
+                        volume);
+#endif /* SONIC_USE_SIN */
+}
+
+/* Overlap two sound segments, ramp the volume of one down, while ramping the
+   other one from zero up, and add them, storing the result at the output
+   scaled by the stream's output volume. */
+static void overlapAdd(sonicStream stream, int numSamples, short* out,
+                       short* rampDown, short* rampUp) {
+  int numChannels = stream->numChannels;
+  int volume = stream->outputVolume;
+  int i, t;
+#ifdef SONIC_USE_SIN
+  float* ramp;
+  float ratio;
+
+  if (numSamples <= 0) {
+    return;
+  }
+  if (stream->floatSamples) {
+    overlapAddFloat(stream, numSamples, (float*)out, (const float*)rampDown,
+                    (const float*)rampUp);
+    return;
+  }
+  ramp = findSineRamp(stream, numSamples);
+  for (t = 0; t < numSamples; t++) {
+    ratio = ramp[t];
+    for (i = 0; i < numChannels; i++) {
+      *out++ = scaleSample(
+          (short)(*rampDown++ * (1.0f - ratio) + *rampUp++ * ratio), volume);
+    }
+  }
+#else
+  int bits = 0, shift;
+  unsigned long multiplier;
+
+  /* Skipping or inserting a short period at extreme speeds can round the
+     overlap down to nothing, which has no reciprocal. */
+  if (numSamples <= 0) {
+    return;
+  }
+  if (stream->floatSamples) {
+    overlapAddFloat(stream, numSamples, (float*)out, (const float*)rampDown,
+                    (const float*)rampUp);
+    return;
+  }
+  if (numSamples >= SONIC_MAX_RECIPROCAL_OVERLAP) {
+    for (t = 0; t < numSamples; t++) {
       for (i = 0; i < numChannels; i++) {
-        *out++ = interpolate(stream, in, oldSampleRate, newSampleRate);
-        in++;
+        *out++ = scaleSample(
+            (*rampDown++ * (numSamples - t) + *rampUp++ * t) / numSamples,
+            volume);
+      }
+    }
+    return;
+  }
+  /* With 2^bits > numSamples, |x| <= 32768*numSamples, and
+     multiplier = floor(2^shift/numSamples) + 1, the error in |x|*multiplier
+     is less than 2^shift/numSamples, so shifting gives exactly the quotient. */
+  while ((1 << bits) <= numSamples) {
+    bits++;
+  }
+  shift = 15 + 2 * bits;
+  multiplier = (unsigned long)(((sonicUint64)1 << shift) / numSamples) + 1;
+  overlapAddFrames(out, rampDown, rampUp, numSamples, numChannels, multiplier,
+                   shift, volume);
+#endif /* SONIC_USE_SIN */
+}
+
+/* Swap the output buffer with the pitch buffer.  When changing the rate, this
+   is done around the speed change, so that it writes directly to the pitch
+   buffer rather than to the output buffer. */
+static void swapOutputAndPitchBuffers(sonicStream stream) {
+  short* buffer = stream->outputBuffer;
+  short* base = stream->outputBufferBase;
+  int size = stream->outputBufferSize;
+  int numSamples = stream->numOutputSamples;
+
+  stream->outputBuffer = stream->pitchBuffer;
+  stream->outputBufferBase = stream->pitchBufferBase;
+  stream->outputBufferSize = stream->pitchBufferSize;
+  stream->numOutputSamples = stream->numPitchSamples;
+  stream->pitchBuffer = buffer;
+  stream->pitchBufferBase = base;
+  stream->pitchBufferSize = size;
+  stream->numPitchSamples = numSamples;
+}
+
+/* Remove processed samples from the pitch buffer. */
+static void removePitchSamples(sonicStream stream, int numSamples) {
+  stream->numPitchSamples -= numSamples;
+  if (stream->numPitchSamples > 0) {
+    stream->pitchBuffer += numSamples * stream->frameWidth;
+  } else {
+    stream->pitchBuffer = stream->pitchBufferBase;
+  }
+}
+
+/* Approximate the sinc function times a Hann window from the sinc table. */
+static int findSincCoefficient(int i, int ratio, int width) {
+  int lobePoints = (SINC_TABLE_SIZE - 1) / SINC_FILTER_POINTS;
+  int left = i * lobePoints + (ratio * lobePoints) / width;
+  int right = left + 1;
+  int position = i * lobePoints * width + ratio * lobePoints - left * width;
+  int leftVal = sincTable[left];
+  int rightVal = sincTable[right];
+
+  return ((leftVal * (width - position) + rightVal * position) << 1) / width;
+}
+
+/* Return the number of input frames the resampler filters. */
+static int resamplerPoints(int resampler) {
+  switch (resampler) {
+    case SONIC_RESAMPLER_LINEAR:
+      return 2;
+    case SONIC_RESAMPLER_CUBIC:
+      return 4;
+    case SONIC_RESAMPLER_HIGH_QUALITY:
+      return SONIC_HQ_FILTER_POINTS;
+  }
+  return SINC_FILTER_POINTS;
+}
+
+/* Return the Catmull-Rom cubic interpolation kernel at distance x. */
+static double findCubicCoefficient(double x) {
+  if (x < 0.0) {
+    x = -x;
+  }
+  if (x <= 1.0) {
+    return (1.5 * x - 2.5) * x * x + 1.0;
+  }
+  if (x < 2.0) {
+    return ((-0.5 * x + 2.5) * x - 4.0) * x + 2.0;
+  }
+  return 0.0;
+}
+
+/* Return the high quality filter at distance x: a sinc function with the
+   given cutoff, as a fraction of the input Nyquist frequency, times a Blackman
+   window SONIC_HQ_FILTER_POINTS wide. */
+static double findHighQualityCoefficient(double x, double cutoff) {
+  double phase = 2.0 * M_PI * (x / SONIC_HQ_FILTER_POINTS + 0.5);
+  double window = 0.42 - 0.5 * cos(phase) + 0.08 * cos(2.0 * phase);
+  double sincWeight = 1.0;
+
+  if (x > 1e-9 || x < -1e-9) {
+    sincWeight = sin(M_PI * cutoff * x) / (M_PI * cutoff * x);
+  }
+  return cutoff * sincWeight * window;
+}
+
+/* Store weight i of a filter of numPoints points.  Each weight is split into a
+   signed high byte and an unsigned low byte, so the filter can be applied with
+   16-bit multiplies: the high bytes come first, followed by the low bytes.
+   The low bytes are never negative, so -1 in the first one marks a filter bank
+   phase that is not computed yet. */
+static void setRateWeight(short* weights, int numPoints, int i, int weight) {
+  weights[i] = weight >> 8;
+  weights[numPoints + i] = weight & 0xff;
+}
+
+/* Compute the filter weights for an output sample at the given ratio, in
+   units of 1/65536.  The output sample lies between input frames
+   numPoints/2 - 1 and numPoints/2, ratio/width of a frame before the
+   second.  The sinc filter is interpolated from sincTable, as it always has
+   been.  The cubic and high quality filters are normalized to sum to exactly
+   65536, with the weight nearest the output absorbing the rounding.  The high
+   quality filter also lowers its cutoff when down-sampling, to avoid
+   aliasing. */
+static void computeRateWeights(short* weights, int resampler, int numPoints,
+                               int ratio, int width, int oldSampleRate) {
+  double values[SONIC_HQ_FILTER_POINTS];
+  double fraction = (double)ratio / width;
+  double cutoff = 1.0, sum = 0.0;
+  int center = numPoints >> 1;
+  int nearest = fraction < 0.5 ? center : center - 1;
+  int i, weight, total = 0;
+
+  if (resampler == SONIC_RESAMPLER_SINC) {
+    for (i = 0; i < numPoints; i++) {
+      setRateWeight(weights, numPoints, i,
+                    findSincCoefficient(i, ratio, width));
+    }
+    return;
+  }
+  if (resampler == SONIC_RESAMPLER_LINEAR) {
+    weight = (int)(((sonicUint64)ratio << 16) / width);
+    setRateWeight(weights, numPoints, 0, weight);
+    setRateWeight(weights, numPoints, 1, 65536 - weight);
+    return;
+  }
+  if (width < oldSampleRate) {
+    cutoff = (double)width / oldSampleRate;
+  }
+  for (i = 0; i < numPoints; i++) {
+    if (resampler == SONIC_RESAMPLER_CUBIC) {
+      values[i] = findCubicCoefficient(i + fraction - center);
+    } else {
+      values[i] = findHighQualityCoefficient(i + fraction - center, cutoff);
+    }
+    sum += values[i];
+  }
+  for (i = 0; i < numPoints; i++) {
+    if (i != nearest) {
+      weight = (int)floor(values[i] * 65536.0 / sum + 0.5);
+      setRateWeight(weights, numPoints, i, weight);
+      total += weight;
+    }
+  }
+  setRateWeight(weights, numPoints, nearest, 65536 - total);
+}
+
+/* Return the greatest common divisor of a and b. */
+static int greatestCommonDivisor(int a, int b) {
+  int temp;
+
+  while (b != 0) {
+    temp = a % b;
+    a = b;
+    b = temp;
+  }
+  return a;
+}
+
+/* Set up the filter bank for resampling from oldSampleRate to newSampleRate
+   with the stream's resampler.  The distance from an output sample to the next
+   input sample is always a multiple of the GCD of the two rates, so there are
+   newSampleRate/GCD distinct filters.  Return 0 if there is no memory for the
+   bank, in which case the weights are computed for each output sample
+   instead. */
+static int prepareRateWeights(sonicStream stream, int oldSampleRate,
+                              int newSampleRate, int numPoints) {
+  int step, numPhases, size, phase;
+  short* weights;
+
+  if (oldSampleRate == stream->rateWeightsOldRate &&
+      newSampleRate == stream->rateWeightsNewRate &&
+      stream->resampler == stream->rateWeightsResampler) {
+    return 1;
+  }
+  step = greatestCommonDivisor(oldSampleRate, newSampleRate);
+  numPhases = newSampleRate / step;
+  size = 2 * numPoints * numPhases;
+  if (size > stream->rateWeightsSize) {
+    weights = (short*)streamRealloc(stream, stream->rateWeights,
+                                    stream->rateWeightsSize, size,
+                                    sizeof(short));
+    if (weights == NULL) {
+      return 0;
+    }
+    stream->rateWeights = weights;
+    stream->rateWeightsSize = size;
+  }
+  for (phase = 0; phase < numPhases; phase++) {
+    stream->rateWeights[(2 * phase + 1) * numPoints] = -1;
+  }
+  stream->rateWeightsOldRate = oldSampleRate;
+  stream->rateWeightsNewRate = newSampleRate;
+  stream->rateWeightsResampler = stream->resampler;
+  stream->rateWeightsStep = step;
+  return 1;
+}
+
+/* Return the filter weights for the next output sample, from the filter bank
+   if there is one, or else computed into buffer. */
+static short* findRateWeights(sonicStream stream, short* buffer,
+                              int oldSampleRate, int newSampleRate,
+                              int numPoints, int useBank) {
+  int position = stream->newRatePosition * oldSampleRate;
+  int rightPosition = (stream->oldRatePosition + 1) * newSampleRate;
+  int ratio = rightPosition - position - 1;
+  int width = newSampleRate;
+  short* weights;
+
+  /* The ratio can only be out of range just after the pitch changes. */
+  if (!useBank || ratio >= width) {
+    computeRateWeights(buffer, stream->resampler, numPoints, ratio, width,
+                       oldSampleRate);
+    return buffer;
+  }
+  weights = stream->rateWeights +
+            2 * numPoints * ((ratio + 1) / stream->rateWeightsStep - 1);
+  if (weights[numPoints] < 0) {
+    computeRateWeights(weights, stream->resampler, numPoints, ratio, width,
+                       oldSampleRate);
+  }
+  return weights;
+}
+
+/* Change the rate of the samples in the pitch buffer, numNewSamples of which
+   were just added.  Interpolate with the stream's resampler, by default a sinc
+   FIR filter using a Hann window. */
+static int adjustRate(sonicStream stream, float rate, int numNewSamples) {
+  int newSampleRate = stream->sampleRate / rate;
+  int oldSampleRate = stream->sampleRate;
+  int numChannels = stream->numChannels;
+  int frameWidth = stream->frameWidth;
+  int floatSamples = stream->floatSamples;
+  float volume = stream->outputVolume != 0 ? stream->volume : 1.0f;
+  int position, maxNewSamples, roomLeft;
+  short *in, *out, *weights;
+  short buffer[2 * SONIC_HQ_FILTER_POINTS];
+  int useBank;
+  int N = resamplerPoints(stream->resampler);
+
+  /* Set these values to help with the integer math */
+  while (newSampleRate > (1 << 14) || oldSampleRate > (1 << 14)) {
+    newSampleRate >>= 1;
+    oldSampleRate >>= 1;
+  }
+  if (numNewSamples == 0) {
+    return 1;
+  }
+  useBank = prepareRateWeights(stream, oldSampleRate, newSampleRate, N);
+  /* Make room for the frames the loop below should write up front, rather
+     than checking for each one. */
+  maxNewSamples = (double)stream->numPitchSamples * newSampleRate /
+                  oldSampleRate + 2;
+  roomLeft = 0;
+  /* Leave at least N pitch sample in the buffer */
+  for (position = 0; position < stream->numPitchSamples - N; position++) {
+    while ((stream->oldRatePosition + 1) * newSampleRate >
+           stream->newRatePosition * oldSampleRate) {
+      if (roomLeft-- == 0) {
+        if (!enlargeOutputBufferIfNeeded(stream, maxNewSamples)) {
+          return 0;
+        }
+        roomLeft = maxNewSamples - 1;
+      }
+      out = stream->outputBuffer + stream->numOutputSamples * frameWidth;
+      in = stream->pitchBuffer + position * frameWidth;
+      weights = findRateWeights(stream, buffer, oldSampleRate, newSampleRate,
+                                N, useBank);
+      if (floatSamples) {
+        interpolateFloatFrame((float*)out, (const float*)in, numChannels,
+                              weights, N, volume);
+      } else {
+        interpolateFrame(out, in, numChannels, weights, N,
+                         stream->outputVolume);
+      }
+      stream->newRatePosition++;
+      stream->numOutputSamples++;
+    }
+    stream->oldRatePosition++;
+    if (stream->oldRatePosition == oldSampleRate) {
+      stream->oldRatePosition = 0;
+      stream->newRatePosition = 0;
+    }
+  }
+  removePitchSamples(stream, position);
+  return 1;
+}
+
+/* Skip over a pitch period.  Return the number of output samples. */
+static int skipPitchPeriod(sonicStream stream, short* samples, float speed,
+                           int period, int silent) {
+  long newSamples;
+  int frameWidth = stream->frameWidth;
+
+  if (speed >= 2.0f) {
+    /* For speeds >= 2.0, we skip over a portion of each pitch period rather
+       than dropping whole pitch periods. */
+    newSamples = period / (speed - 1.0f);
+  } else {
+    newSamples = period;
+  }
+  if (!enlargeOutputBufferIfNeeded(stream, newSamples)) {
+    return 0;
+  }
+  if (silent) {
+    /* There is nothing to blend, so just keep the samples after the ones we
+       skip. */
+    copySamples(stream,
+                stream->outputBuffer + stream->numOutputSamples * frameWidth,
+                samples + period * frameWidth, newSamples);
+  } else {
+    overlapAdd(stream, newSamples,
+               stream->outputBuffer + stream->numOutputSamples * frameWidth,
+               samples, samples + period * frameWidth);
+  }
+  stream->numOutputSamples += newSamples;
+  return newSamples;
+}
+
+/* Insert a pitch period, and determine how much input to copy directly. */
+static int insertPitchPeriod(sonicStream stream, short* samples, float speed,
+                             int period, int silent) {
+  long newSamples;
+  short* out;
+  int frameWidth = stream->frameWidth;
+
+  if (speed <= 0.5f) {
+    newSamples = period * speed / (1.0f - speed);
+  } else {
+    newSamples = period;
+  }
+  if (!enlargeOutputBufferIfNeeded(stream, period + newSamples)) {
+    return 0;
+  }
+  out = stream->outputBuffer + stream->numOutputSamples * frameWidth;
+  copySamples(stream, out, samples, period);
+  out = stream->outputBuffer + (stream->numOutputSamples + period) * frameWidth;
+  if (silent) {
+    copySamples(stream, out, samples + period * frameWidth, newSamples);
+  } else {
+    overlapAdd(stream, newSamples, out, samples + period * frameWidth,
+               samples);
+  }
+  stream->numOutputSamples += period + newSamples;
+  return newSamples;
+}
+
+/* PICOLA copies input to output until the total output samples == consumed
+   input samples * speed. */
+static int copyUnmodifiedSamples(sonicStream stream, short* samples,
+                                 float speed, int position, int* newSamples) {
+  int availableSamples = stream->numInputSamples - position;
+  float inputToCopyFloat =
+      1 - stream->timeError * speed / (stream->samplePeriod * (speed - 1.0));
+
+  *newSamples = inputToCopyFloat > availableSamples ? availableSamples
+                                                    : (int)inputToCopyFloat;
+  if (!copyToOutput(stream, samples, *newSamples)) {
+    return 0;
+  }
+  stream->timeError +=
+      *newSamples * stream->samplePeriod * (speed - 1.0) / speed;
+  return 1;
+}
+
+/* Return the pitch search window at samples as shorts.  If the stream
+   processes floats, they are converted into analysisBuffer, and the pitch
+   search and silence detection work on those. */
+static short* findAnalysisWindow(sonicStream stream, short* samples) {
+  const float* floats = (const float*)samples;
+  short* window = stream->analysisBuffer;
+  int numSamples = stream->maxRequired * stream->numChannels;
+
+  if (!stream->floatSamples) {
+    return samples;
+  }
+  convertFloatsToShorts(window, floats, numSamples);
+  return window;
+}
+
+/* Return 1 if the pitch search window at samples is silent, meaning that the
+   average absolute value of each block of SONIC_SILENCE_BLOCK_SIZE samples is
+   no more than the silence threshold.  The absolute values are summed with the
+   diff kernel, which stops at the first block that is too loud. */
+static int isSilent(sonicStream stream, short* samples) {
+  static const short zeros[SONIC_SILENCE_BLOCK_SIZE] = {0};
+  int numSamples = stream->maxRequired * stream->numChannels;
+  int i, count;
+
+  if (stream->silenceThreshold < 0) {
+    return 0;
+  }
+  for (i = 0; i < numSamples; i += count) {
+    count = numSamples - i;
+    if (count > SONIC_SILENCE_BLOCK_SIZE) {
+      count = SONIC_SILENCE_BLOCK_SIZE;
+    }
+    if (computeDiff(samples + i, zeros, count) >
+        (unsigned long)stream->silenceThreshold * count) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/* Resample as many pitch periods as we have buffered on the input.  Return 0 if
+   we fail to resize an input or output buffer.  Silent windows skip the pitch
+   search, and use the shortest period, which is what the search finds for
+   digital silence, so the output is the same. */
+static int changeSpeed(sonicStream stream, float speed) {
+  short *samples, *window;
+  int numSamples = stream->numInputSamples;
+  int position = 0, period, newSamples, silent, oldPosition;
+  int maxRequired = stream->maxRequired;
+
+  if (stream->numInputSamples < maxRequired) {
+    return 1;
+  }
+  do {
+    samples = stream->inputBuffer + position * stream->frameWidth;
+    if ((speed > 1.0f && speed < 2.0f && stream->timeError < 0.0f) ||
+        (speed < 1.0f && speed > 0.5f && stream->timeError > 0.0f)) {
+      /* Deal with the case where PICOLA is still copying input samples to
+         output unmodified, */
+      if (!copyUnmodifiedSamples(stream, samples, speed, position,
+                                 &newSamples)) {
+        return 0;
+      }
+      position += newSamples;
+    } else {
+      /* We are in the remaining cases, either inserting/removing a pitch period
+         for speed < 2.0X, or a portion of one for speed >= 2.0X. */
+      oldPosition = position;
+      window = findAnalysisWindow(stream, samples);
+      silent = isSilent(stream, window);
+      if (silent) {
+        period = stream->minPeriod;
+        stream->prevPeriod = period;
+        stream->prevMinDiff = 0;
+        stream->prevMaxDiff = 0;
+      } else {
+        period = findPitchPeriod(stream, window,
+                                 stream->inputStreamPosition + position, 1);
+      }
+#ifdef SONIC_SPECTROGRAM
+      if (stream->spectrogram != NULL) {
+        sonicAddPitchPeriodToSpectrogram(stream->spectrogram, window, period,
+                                         stream->numChannels);
+        newSamples = period;
+        position += period;
+      } else
+#endif /* SONIC_SPECTROGRAM */
+        if (speed > 1.0) {
+          newSamples = skipPitchPeriod(stream, samples, speed, period, silent);
+          position += period + newSamples;
+          if (speed < 2.0) {
+            stream->timeError += newSamples * stream->samplePeriod -
+                                 (period + newSamples) * stream->inputPlayTime /
+                                     stream->numInputSamples;
+          }
+        } else {
+          newSamples =
+              insertPitchPeriod(stream, samples, speed, period, silent);
+          position += newSamples;
+          if (speed > 0.5) {
+            stream->timeError +=
+                (period + newSamples) * stream->samplePeriod -
+                newSamples * stream->inputPlayTime / stream->numInputSamples;
+          }
+        }
+      if (newSamples == 0) {
+        return 0; /* Failed to resize output buffer */
+      }
+      if (silent) {
+        stream->silentSamples += position - oldPosition;
+      }
+    }
+  } while (position + maxRequired <= numSamples);
+  removeInputSamples(stream, position);
+  return 1;
+}
+
+/* Resample as many pitch periods as we have buffered on the input.  Return 0 if
+   we fail to resize an input or output buffer.  Also scale the output by the
+   volume, which the last stage applies as it writes its output. */
+static int processStreamInput(sonicStream stream) {
+  int originalNumPitchSamples = stream->numPitchSamples;
+  float rate = stream->rate * stream->pitch;
+  int volume = findFixedPointVolume(stream->volume);
+  float localSpeed;
+  int copied = 1;
+
+  if (stream->numInputSamples == 0) {
+    return 1;
+  }
+  if (rate != 1.0f) {
+    swapOutputAndPitchBuffers(stream);
+    stream->outputVolume = 0;
+  } else {
+    stream->outputVolume = volume;
+  }
+  localSpeed =
+      stream->numInputSamples * stream->samplePeriod / stream->inputPlayTime;
+  if (localSpeed > 1.00001 || localSpeed < 0.99999) {
+    changeSpeed(stream, localSpeed);
+  } else {
+    copied = copyInputToOutput(stream, stream->numInputSamples);
+  }
+  if (rate != 1.0f) {
+    swapOutputAndPitchBuffers(stream);
+  }
+  if (!copied) {
+    return 0;
+  }
+  if (rate != 1.0f) {
+    stream->outputVolume = volume;
+    if (!adjustRate(stream, rate,
+                    stream->numPitchSamples - originalNumPitchSamples)) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/* Write floating point data to the input buffer and process it. */
+int sonicWriteFloatToStream(sonicStream stream, const float* samples,
+                            int numSamples) {
+  if (!addFloatSamplesToInputBuffer(stream, samples, numSamples)) {
+    return 0;
+  }
+  return processStreamInput(stream);
+}
+
+/* Simple wrapper around sonicWriteFloatToStream that does the short to float
+   conversion for you. */
+int sonicWriteShortToStream(sonicStream stream, const short* samples,
+                            int numSamples) {
+  if (!addShortSamplesToInputBuffer(stream, samples, numSamples)) {
+    return 0;
+  }
+  return processStreamInput(stream);
+}
+
+/* Simple wrapper around sonicWriteFloatToStream that does the unsigned char to
+   float conversion for you. */
+int sonicWriteUnsignedCharToStream(sonicStream stream,
+                                   const unsigned char* samples,
+                                   int numSamples) {
+  if (!addUnsignedCharSamplesToInputBuffer(stream, samples, numSamples)) {
+    return 0;
+  }
+  return processStreamInput(stream);
+}
+
+/* Write 32-bit data to the input buffer and process it. */
+int sonicWriteIntToStream(sonicStream stream, const int* samples,
+                          int numSamples) {
+  if (!addIntSamplesToInputBuffer(stream, samples, numSamples)) {
+    return 0;
+  }
+  return processStreamInput(stream);
+}
+
+/* Write packed 24-bit data to the input buffer and process it. */
+int sonicWriteInt24ToStream(sonicStream stream, const unsigned char* samples,
+                            int numSamples) {
+  if (!addInt24SamplesToInputBuffer(stream, samples, numSamples)) {
+    return 0;
+  }
+  return processStreamInput(stream);
+}
+
+/* Write floating point data with one array per channel to the input buffer
+   and process it. */
+int sonicWriteFloatPlanarToStream(sonicStream stream,
+                                  const float* const* samples,
+                                  int numSamples) {
+  if (!addFloatPlanarSamplesToInputBuffer(stream, samples, numSamples)) {
+    return 0;
+  }
+  return processStreamInput(stream);
+}
+
+/* Write short data with one array per channel to the input buffer and process
+   it. */
+int sonicWriteShortPlanarToStream(sonicStream stream,
+                                  const short* const* samples,
+                                  int numSamples) {
+  if (!addShortPlanarSamplesToInputBuffer(stream, samples, numSamples)) {
+    return 0;
+  }
+  return processStreamInput(stream);
+}
+
+/* Return the number of bytes the input, output and pitch buffers would need
+   if numSamples more samples were written and none of the output were read.
+   The output is estimated from the speed and rate, with a few pitch periods to
+   spare.  Buffers are never shrunk, so none needs less than it has. */
+static double findMemoryNeeded(sonicStream stream, int numSamples) {
+  double speed = stream->speed / stream->pitch;
+  double rate = stream->rate * stream->pitch;
+  double slack = 2.0 * stream->maxRequired;
+  double input = (double)stream->numInputSamples + numSamples;
+  double speedOutput = input / speed + slack;
+  double output = speedOutput;
+  double pitch = 0.0;
+
+  if (rate != 1.0) {
+    output = speedOutput / rate + slack;
+    if (output < speedOutput) {
+      output = speedOutput;
+    }
+    pitch = stream->numPitchSamples + speedOutput;
+  }
+  output += stream->numOutputSamples;
+  if (input < stream->inputBufferSize) {
+    input = stream->inputBufferSize;
+  }
+  if (output < stream->outputBufferSize) {
+    output = stream->outputBufferSize;
+  }
+  if (pitch < stream->pitchBufferSize) {
+    pitch = stream->pitchBufferSize;
+  }
+  return (input + output + pitch) * sizeof(short) * stream->frameWidth;
+}
+
+/* Return how many of numSamples samples can be written without the buffers
+   needing more than stream->maxMemory bytes. */
+static int findSamplesThatFit(sonicStream stream, int numSamples) {
+  int low = 0, high = numSamples, middle;
+
+  if (stream->maxMemory == 0 ||
+      findMemoryNeeded(stream, numSamples) <= stream->maxMemory) {
+    return numSamples;
+  }
+  /* Binary search for the most samples that fit. */
+  while (low < high) {
+    middle = low + (high - low + 1) / 2;
+    if (findMemoryNeeded(stream, middle) <= stream->maxMemory) {
+      low = middle;
+    } else {
+      high = middle - 1;
+    }
+  }
+  return low;
+}
+
+/* Write as many floating point samples as fit within the stream's memory
+   limit, and return how many, or -1 if we run out of memory. */
+int sonicTryWriteFloatToStream(sonicStream stream, const float* samples,
+                               int numSamples) {
+  numSamples = findSamplesThatFit(stream, numSamples);
+  if (!sonicWriteFloatToStream(stream, samples, numSamples)) {
+    return -1;
+  }
+  return numSamples;
+}
+
+/* Write as many 16-bit samples as fit within the stream's memory limit, and
+   return how many, or -1 if we run out of memory. */
+int sonicTryWriteShortToStream(sonicStream stream, const short* samples,
+                               int numSamples) {
+  numSamples = findSamplesThatFit(stream, numSamples);
+  if (!sonicWriteShortToStream(stream, samples, numSamples)) {
+    return -1;
+  }
+  return numSamples;
+}
+
+/* Write as many 8-bit unsigned samples as fit within the stream's memory
+   limit, and return how many, or -1 if we run out of memory. */
+int sonicTryWriteUnsignedCharToStream(sonicStream stream,
+                                      const unsigned char* samples,
+                                      int numSamples) {
+  numSamples = findSamplesThatFit(stream, numSamples);
+  if (!sonicWriteUnsignedCharToStream(stream, samples, numSamples)) {
+    return -1;
+  }
+  return numSamples;
+}
+
+/* Return the number of samples that fit after the input buffer's samples. */
+static int inputBufferRoom(sonicStream stream) {
+  int offset = (stream->inputBuffer - stream->inputBufferBase) /
+               stream->frameWidth;
+
+  return stream->inputBufferSize - offset - stream->numInputSamples;
+}
+
+/* Make room for at least minSamples samples at the end of the input buffer,
+   and return a pointer to it, or NULL if memory realloc failed. */
+static short* acquireInput(sonicStream stream, int minSamples) {
+  if (!enlargeInputBufferIfNeeded(stream, minSamples > 0 ? minSamples : 1)) {
+    return NULL;
+  }
+  return stream->inputBuffer + stream->numInputSamples * stream->frameWidth;
+}
+
+/* Make room for at least minSamples samples at the end of the input buffer,
+   set *samples to point to it, and return how many samples fit there.
+   Return 0 if memory realloc failed, or if the stream processes floats. */
+int sonicAcquireInput(sonicStream stream, int minSamples, short** samples) {
+  *samples = stream->floatSamples ? NULL : acquireInput(stream, minSamples);
+  return *samples != NULL ? inputBufferRoom(stream) : 0;
+}
+
+/* The same as sonicAcquireInput, for streams that process floats. */
+int sonicAcquireFloatInput(sonicStream stream, int minSamples,
+                           float** samples) {
+  *samples = stream->floatSamples ? (float*)acquireInput(stream, minSamples)
+                                  : NULL;
+  return *samples != NULL ? inputBufferRoom(stream) : 0;
+}
+
+/* Add numSamples samples written to the space returned by sonicAcquireInput
+   to the input, and process them.  Return 0 if memory realloc failed,
+   otherwise 1. */
+int sonicCommitInput(sonicStream stream, int numSamples) {
+  int room = inputBufferRoom(stream);
+
+  if (numSamples > room) {
+    numSamples = room;
+  }
+  if (numSamples > 0) {
+    updateNumInputSamples(stream, numSamples);
+  }
+  return processStreamInput(stream);
+}
+
+/* Idle streams, ready to be reused by sonicAcquirePooledStream. */
+static sonicMutex streamPoolMutex = SONIC_MUTEX_INITIALIZER;
+static sonicStream pooledStreams = NULL;
+static int numPooledStreams = 0;
+
+/* Return an idle stream with the given sample rate and number of channels
+   from the stream pool, or create one if there are none.  Return NULL only if
+   we are out of memory. */
+sonicStream sonicAcquirePooledStream(int sampleRate, int numChannels) {
+#ifndef SONIC_NO_MALLOC
+  sonicStream stream, prevStream = NULL;
+
+  sampleRate = CLAMP(sampleRate, SONIC_MIN_SAMPLE_RATE, SONIC_MAX_SAMPLE_RATE);
+  numChannels = CLAMP(numChannels, SONIC_MIN_CHANNELS, SONIC_MAX_CHANNELS);
+  sonicLockMutex(&streamPoolMutex);
+  for (stream = pooledStreams; stream != NULL;
+       stream = stream->nextPooledStream) {
+    if (stream->sampleRate == sampleRate &&
+        stream->numChannels == numChannels) {
+      if (prevStream == NULL) {
+        pooledStreams = stream->nextPooledStream;
+      } else {
+        prevStream->nextPooledStream = stream->nextPooledStream;
       }
-      stream->newRatePosition++;
-      stream->numOutputSamples++;
+      numPooledStreams--;
+      sonicUnlockMutex(&streamPoolMutex);
+      stream->nextPooledStream = NULL;
+      return stream;
+    }
+    prevStream = stream;
+  }
+  sonicUnlockMutex(&streamPoolMutex);
+#endif /* SONIC_NO_MALLOC */
+  return sonicCreateStream(sampleRate, numChannels);
+}
+
+#ifndef SONIC_NO_MALLOC
+/* Return 1 if any of the stream's input, output or pitch buffers has grown
+   past the size it started at. */
+static int buffersHaveGrown(sonicStream stream) {
+  int bufferSize = initialBufferSize(stream->maxRequired, stream->maxChunk);
+
+  return stream->inputBufferSize > bufferSize ||
+         stream->outputBufferSize > bufferSize ||
+         stream->pitchBufferSize > bufferSize;
+}
+#endif /* SONIC_NO_MALLOC */
+
+/* Reset the stream and return it to the stream pool.  If the pool is full,
+   or the stream's buffers have grown, destroy it instead, so a batch call on
+   a long clip does not leave clip-sized buffers in the pool.  With
+   SONIC_NO_MALLOC, streams are never pooled, since they share one static
+   buffer. */
+void sonicReleasePooledStream(sonicStream stream) {
+#ifndef SONIC_NO_MALLOC
+  if (stream->arena == NULL) {
+    sonicResetStream(stream);
+    stream->userData = NULL;
+    if (buffersHaveGrown(stream)) {
+      sonicDestroyStream(stream);
+      return;
+    }
+    sonicLockMutex(&streamPoolMutex);
+    if (numPooledStreams < SONIC_MAX_POOLED_STREAMS) {
+      stream->nextPooledStream = pooledStreams;
+      pooledStreams = stream;
+      numPooledStreams++;
+      sonicUnlockMutex(&streamPoolMutex);
+      return;
+    }
+    sonicUnlockMutex(&streamPoolMutex);
+  }
+#endif /* SONIC_NO_MALLOC */
+  sonicDestroyStream(stream);
+}
+
+/* Destroy all the idle streams in the stream pool. */
+void sonicDestroyStreamPool(void) {
+  sonicStream stream, nextStream;
+
+  sonicLockMutex(&streamPoolMutex);
+  stream = pooledStreams;
+  pooledStreams = NULL;
+  numPooledStreams = 0;
+  sonicUnlockMutex(&streamPoolMutex);
+  while (stream != NULL) {
+    nextStream = stream->nextPooledStream;
+    sonicDestroyStream(stream);
+    stream = nextStream;
+  }
+}
+
+/* This is a non-stream oriented interface to just change the speed of a sound
+ * sample */
+int sonicChangeFloatSpeed(float* samples, int numSamples, float speed,
+                          float pitch, float rate, float volume,
+                          int useChordPitch, int sampleRate, int numChannels) {
+  sonicStream stream = sonicAcquirePooledStream(sampleRate, numChannels);
+
+  sonicSetSpeed(stream, speed);
+  sonicSetPitch(stream, pitch);
+  sonicSetRate(stream, rate);
+  sonicSetVolume(stream, volume);
+  sonicWriteFloatToStream(stream, samples, numSamples);
+  sonicFlushStream(stream);
+  numSamples = sonicSamplesAvailable(stream);
+  sonicReadFloatFromStream(stream, samples, numSamples);
+  sonicReleasePooledStream(stream);
+  return numSamples;
+}
+
+/* This is a non-stream oriented interface to just change the speed of a sound
+ * sample */
+int sonicChangeShortSpeed(short* samples, int numSamples, float speed,
+                          float pitch, float rate, float volume,
+                          int useChordPitch, int sampleRate, int numChannels) {
+  sonicStream stream = sonicAcquirePooledStream(sampleRate, numChannels);
+
+  sonicSetSpeed(stream, speed);
+  sonicSetPitch(stream, pitch);
+  sonicSetRate(stream, rate);
+  sonicSetVolume(stream, volume);
+  sonicWriteShortToStream(stream, samples, numSamples);
+  sonicFlushStream(stream);
+  numSamples = sonicSamplesAvailable(stream);
+  sonicReadShortFromStream(stream, samples, numSamples);
+  sonicReleasePooledStream(stream);
+  return numSamples;
+}
+
+#if !defined(SONIC_NO_THREADS) && !defined(SONIC_NO_MALLOC)
+
+/* A parallel speed change.  The buffer is split into segments, which the
+   threads take one at a time and process with streams of their own.  Once
+   they are done, the streams' output is stitched back together in samples. */
+typedef struct {
+  void* samples;
+  int floatSamples;
+  int sampleRate;
+  int numChannels;
+  float speed;
+  float pitch;
+  float rate;
+  float volume;
+  int numSegments;
+  /* Where each segment starts, followed by the end of the buffer. */
+  int* segmentStarts;
+  /* Each segment is processed with this many samples past its end. */
+  int overlap;
+  sonicStream* streams;
+  int nextSegment;
+  int failed;
+} sonicJobStruct;
+typedef sonicJobStruct* sonicJob;
+
+/* Guards nextSegment and failed in every parallel job. */
+static sonicMutex segmentMutex = SONIC_MUTEX_INITIALIZER;
+
+/* Return the sum of the absolute values of numSamples frames of the job's
+   samples, starting at frame start. */
+static double findBlockEnergy(sonicJob job, int start, int numSamples) {
+  int count = numSamples * job->numChannels;
+  double energy = 0.0;
+  const float* floats;
+  const short* shorts;
+  int i;
+
+  if (job->floatSamples) {
+    floats = (const float*)job->samples + start * job->numChannels;
+    for (i = 0; i < count; i++) {
+      energy += fabs(floats[i]);
+    }
+  } else {
+    shorts = (const short*)job->samples + start * job->numChannels;
+    for (i = 0; i < count; i++) {
+      energy += abs(shorts[i]);
+    }
+  }
+  return energy;
+}
+
+/* Split numSamples samples into segments of about the same length.  Each
+   boundary is moved to the middle of the quietest 10ms within half a second,
+   where a seam is least likely to be heard. */
+static void findSegmentStarts(sonicJob job, int numSamples) {
+  int blockSize = job->sampleRate / 100;
+  int radius = job->sampleRate / 2;
+  double energy, minEnergy;
+  int segment, nominal, start;
+
+  job->segmentStarts[0] = 0;
+  for (segment = 1; segment < job->numSegments; segment++) {
+    nominal = (int)((double)numSamples * segment / job->numSegments);
+    job->segmentStarts[segment] = nominal;
+    minEnergy = -1.0;
+    for (start = nominal - radius; start + blockSize <= nominal + radius;
+         start += blockSize) {
+      energy = findBlockEnergy(job, start, blockSize);
+      if (minEnergy < 0.0 || energy < minEnergy) {
+        minEnergy = energy;
+        job->segmentStarts[segment] = start + blockSize / 2;
+      }
+    }
+  }
+  job->segmentStarts[job->numSegments] = numSamples;
+}
+
+/* Mark the job as failed. */
+static void failJob(sonicJob job) {
+  sonicLockMutex(&segmentMutex);
+  job->failed = 1;
+  sonicUnlockMutex(&segmentMutex);
+}
+
+/* Process one segment of the job into its own stream.  The first samples of
+   the next segment are written too, so the pitch search near the end of the
+   segment sees real samples rather than the silence a flush pads with. */
+static void processSegment(sonicJob job, int segment) {
+  sonicStream stream =
+      sonicAcquirePooledStream(job->sampleRate, job->numChannels);
+  int start = job->segmentStarts[segment];
+  int end = job->segmentStarts[segment + 1] + job->overlap;
+  int numSamples, written = 1;
+
+  job->streams[segment] = stream;
+  if (stream == NULL) {
+    failJob(job);
+    return;
+  }
+  sonicSetSpeed(stream, job->speed);
+  sonicSetPitch(stream, job->pitch);
+  sonicSetRate(stream, job->rate);
+  sonicSetVolume(stream, job->volume);
+  if (end > job->segmentStarts[job->numSegments]) {
+    end = job->segmentStarts[job->numSegments];
+  }
+  for (; written && start < end; start += numSamples) {
+    numSamples = end - start;
+    if (numSamples > SONIC_SEGMENT_WRITE_CHUNK) {
+      numSamples = SONIC_SEGMENT_WRITE_CHUNK;
+    }
+    if (job->floatSamples) {
+      written = sonicWriteFloatToStream(
+          stream, (const float*)job->samples + start * job->numChannels,
+          numSamples);
+    } else {
+      written = sonicWriteShortToStream(
+          stream, (const short*)job->samples + start * job->numChannels,
+          numSamples);
+    }
+  }
+  if (!written || !sonicFlushStream(stream)) {
+    failJob(job);
+  }
+}
+
+/* Process segments of the job until there are none left. */
+SONIC_THREAD_FUNCTION(processSegments, arg) {
+  sonicJob job = (sonicJob)arg;
+  int segment;
+
+  for (;;) {
+    sonicLockMutex(&segmentMutex);
+    segment = job->nextSegment++;
+    sonicUnlockMutex(&segmentMutex);
+    if (segment >= job->numSegments) {
+      return SONIC_THREAD_RETURN;
+    }
+    processSegment(job, segment);
+  }
+}
+
+/* Blend the first numSamples frames of the stream's output into samples,
+   which already hold the end of the previous segment, fading from that to
+   this one. */
+static void crossFadeSegment(sonicJob job, sonicStream stream, int position,
+                             int numSamples) {
+  int numChannels = job->numChannels;
+  const short* fadeIn;
+  short* shorts = (short*)job->samples + position * numChannels;
+  float* floats = (float*)job->samples + position * numChannels;
+  long oldWeight, newWeight;
+  int i, j;
+
+  sonicPeekOutput(stream, &fadeIn);
+  for (i = 0; i < numSamples; i++) {
+    newWeight = i;
+    oldWeight = numSamples - i;
+    for (j = 0; j < numChannels; j++) {
+      if (job->floatSamples) {
+        *floats = (*floats * oldWeight + shortToFloat(*fadeIn) * newWeight) /
+                  numSamples;
+        floats++;
+      } else {
+        *shorts = (*shorts * oldWeight + *fadeIn * newWeight) / numSamples;
+        shorts++;
+      }
+      fadeIn++;
+    }
+  }
+  sonicConsumeOutput(stream, numSamples);
+}
+
+/* Copy the output of every segment into samples, and return the new number
+   of samples.  Each segment starts where its first sample would be at the
+   requested speed, so the total duration is right, and the segments are
+   cross-faded over the output of half of the overlap. */
+static int stitchSegments(sonicJob job) {
+  double ratio = CLAMP(job->speed, SONIC_MIN_SPEED, SONIC_MAX_SPEED) *
+                 CLAMP(job->rate, SONIC_MIN_RATE, SONIC_MAX_RATE);
+  int fadeLength = (int)(job->overlap / (2.0 * ratio)) + 1;
+  int numChannels = job->numChannels;
+  int end = 0, position, nextPosition, numSamples, numFaded, segment;
+  sonicStream stream;
+
+  for (segment = 0; segment < job->numSegments; segment++) {
+    stream = job->streams[segment];
+    position = (int)(job->segmentStarts[segment] / ratio + 0.5);
+    numSamples = sonicSamplesAvailable(stream);
+    if (segment + 1 < job->numSegments) {
+      nextPosition = (int)(job->segmentStarts[segment + 1] / ratio + 0.5);
+      if (numSamples > nextPosition + fadeLength - position) {
+        numSamples = nextPosition + fadeLength - position;
+      }
+    }
+    if (position > end) {
+      /* The previous segment came up short, which should not happen. */
+      if (job->floatSamples) {
+        memset((float*)job->samples + end * numChannels, 0,
+               (position - end) * numChannels * sizeof(float));
+      } else {
+        memset((short*)job->samples + end * numChannels, 0,
+               (position - end) * numChannels * sizeof(short));
+      }
+      end = position;
+    }
+    numFaded = end - position < numSamples ? end - position : numSamples;
+    crossFadeSegment(job, stream, position, numFaded);
+    if (job->floatSamples) {
+      sonicReadFloatFromStream(
+          stream, (float*)job->samples + (position + numFaded) * numChannels,
+          numSamples - numFaded);
+    } else {
+      sonicReadShortFromStream(
+          stream, (short*)job->samples + (position + numFaded) * numChannels,
+          numSamples - numFaded);
+    }
+    end = position + numSamples;
+  }
+  return end;
+}
+
+/* Change the speed of samples using numThreads threads, and return the new
+   number of samples, or -1 if the buffer is too short to split or we run out
+   of memory, in which case samples is unchanged. */
+static int changeSpeedInParallel(void* samples, int floatSamples,
+                                 int numSamples, float speed, float pitch,
+                                 float rate, float volume, int sampleRate,
+                                 int numChannels, int numThreads) {
+  sonicJobStruct job;
+  sonicThread* threads;
+  int minSegmentSamples, numStarted, segment;
+
+  sampleRate = CLAMP(sampleRate, SONIC_MIN_SAMPLE_RATE, SONIC_MAX_SAMPLE_RATE);
+  minSegmentSamples = SONIC_MIN_SEGMENT_SECONDS * sampleRate;
+  job.numSegments = numSamples / minSegmentSamples;
+  if (numThreads > 0 &&
+      job.numSegments > numThreads * SONIC_SEGMENTS_PER_THREAD) {
+    job.numSegments = numThreads * SONIC_SEGMENTS_PER_THREAD;
+  }
+  if (numThreads < 2 || job.numSegments < 2 ||
+      numChannels < SONIC_MIN_CHANNELS || numChannels > SONIC_MAX_CHANNELS) {
+    return -1;
+  }
+  if (numThreads > job.numSegments) {
+    numThreads = job.numSegments;
+  }
+  job.samples = samples;
+  job.floatSamples = floatSamples;
+  job.sampleRate = sampleRate;
+  job.numChannels = numChannels;
+  job.speed = speed;
+  job.pitch = pitch;
+  job.rate = rate;
+  job.volume = volume;
+  job.overlap = 4 * (sampleRate / SONIC_MIN_PITCH);
+  job.nextSegment = 0;
+  job.failed = 0;
+  job.segmentStarts = (int*)sonicCalloc(job.numSegments + 1, sizeof(int));
+  job.streams = (sonicStream*)sonicCalloc(job.numSegments,
+                                          sizeof(sonicStream));
+  threads = (sonicThread*)sonicCalloc(numThreads, sizeof(sonicThread));
+  if (job.segmentStarts == NULL || job.streams == NULL || threads == NULL) {
+    sonicFree(job.segmentStarts);
+    sonicFree(job.streams);
+    sonicFree(threads);
+    return -1;
+  }
+  findSegmentStarts(&job, numSamples);
+  /* This thread processes segments too. */
+  for (numStarted = 0; numStarted < numThreads - 1; numStarted++) {
+    if (!sonicStartThread(threads + numStarted, processSegments, &job)) {
+      break;
+    }
+  }
+  processSegments(&job);
+  while (numStarted > 0) {
+    sonicJoinThread(threads[--numStarted]);
+  }
+  numSamples = job.failed ? -1 : stitchSegments(&job);
+  for (segment = 0; segment < job.numSegments; segment++) {
+    if (job.streams[segment] != NULL) {
+      sonicReleasePooledStream(job.streams[segment]);
+    }
+  }
+  sonicFree(job.segmentStarts);
+  sonicFree(job.streams);
+  sonicFree(threads);
+  return numSamples;
+}
+
+#else
+
+/* Without threads, or with only one static buffer to allocate from, the
+   parallel batch functions work serially. */
+static int changeSpeedInParallel(void* samples, int floatSamples,
+                                 int numSamples, float speed, float pitch,
+                                 float rate, float volume, int sampleRate,
+                                 int numChannels, int numThreads) {
+  return -1;
+}
+
+#endif /* !SONIC_NO_THREADS && !SONIC_NO_MALLOC */
+
+/* The same as sonicChangeFloatSpeed, but splits the samples into segments that
+   are processed by numThreads threads. */
+int sonicChangeFloatSpeedParallel(float* samples, int numSamples, float speed,
+                                  float pitch, float rate, float volume,
+                                  int sampleRate, int numChannels,
+                                  int numThreads) {
+  int newNumSamples =
+      changeSpeedInParallel(samples, 1, numSamples, speed, pitch, rate,
+                            volume, sampleRate, numChannels, numThreads);
+
+  if (newNumSamples < 0) {
+    return sonicChangeFloatSpeed(samples, numSamples, speed, pitch, rate,
+                                 volume, 0, sampleRate, numChannels);
+  }
+  return newNumSamples;
+}
+
+/* The same as sonicChangeShortSpeed, but splits the samples into segments that
+   are processed by numThreads threads. */
+int sonicChangeShortSpeedParallel(short* samples, int numSamples, float speed,
+                                  float pitch, float rate, float volume,
+                                  int sampleRate, int numChannels,
+                                  int numThreads) {
+  int newNumSamples =
+      changeSpeedInParallel(samples, 0, numSamples, speed, pitch, rate,
+                            volume, sampleRate, numChannels, numThreads);
+
+  if (newNumSamples < 0) {
+    return sonicChangeShortSpeed(samples, numSamples, speed, pitch, rate,
+                                 volume, 0, sampleRate, numChannels);
+  }
+  return newNumSamples;
+}
+
+#if !defined(SONIC_NO_THREADS) && !defined(SONIC_NO_MALLOC)
+
+/* The states of a stream in a scheduler.  A queued stream has unprocessed
+   input and is in its queue's heap.  A running one is being processed by a
+   worker, and is in no heap. */
+#define SONIC_TASK_IDLE 0
+#define SONIC_TASK_QUEUED 1
+#define SONIC_TASK_RUNNING 2
+
+typedef struct sonicTaskStruct* sonicTask;
+typedef struct sonicQueueStruct* sonicQueue;
+
+/* A stream's state in a scheduler.  The stream's buffers are guarded by
+   mutex, and everything else by its queue's mutex. */
+struct sonicTaskStruct {
+  sonicStream stream;
+  sonicScheduler scheduler;
+  /* The queue the stream is added to when it has input.  Other workers steal
+     it from there. */
+  sonicQueue queue;
+  sonicMutex mutex;
+  int state;
+  /* The deadline of the oldest input not yet processed. */
+  double deadline;
+  /* How late the stream's input was last processed, in seconds. */
+  double lag;
+  int heapIndex;
+  /* Set if input arrived while the stream was running, so it must run
+     again. */
+  int pending;
+  int flush;
+  int failed;
+  /* Every stream in the scheduler, guarded by the scheduler's mutex. */
+  sonicTask prevTask;
+  sonicTask nextTask;
+};
+
+/* Each worker has a queue of streams to process, kept as a heap ordered by
+   deadline. */
+struct sonicQueueStruct {
+  sonicScheduler scheduler;
+  sonicMutex mutex;
+  /* Signalled whenever a stream in the queue finishes running. */
+  sonicCondition done;
+  sonicTask* heap;
+  int numTasks;
+  int heapSize;
+};
+
+struct sonicSchedulerStruct {
+  struct sonicQueueStruct* queues;
+  int numQueues;
+  sonicThread* threads;
+  int numThreads;
+  /* Guards the fields below. */
+  sonicMutex mutex;
+  /* Signalled when input is queued and a worker is waiting for some. */
+  sonicCondition wake;
+  int numSleeping;
+  int stopping;
+  int nextQueue;
+  sonicTask tasks;
+  double startTime;
+};
+
+/* Return the time in seconds from an arbitrary starting point. */
+static double getTime(void) {
+#ifdef _WIN32
+  LARGE_INTEGER counter, frequency;
+
+  QueryPerformanceCounter(&counter);
+  QueryPerformanceFrequency(&frequency);
+  return (double)counter.QuadPart / frequency.QuadPart;
+#else
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec * 1e-9;
+#endif
+}
+
+/* Move the task at index up the heap until its parent is due no later. */
+static void siftTaskUp(sonicQueue queue, int index) {
+  sonicTask task = queue->heap[index];
+  int parent;
+
+  while (index > 0) {
+    parent = (index - 1) / 2;
+    if (queue->heap[parent]->deadline <= task->deadline) {
+      break;
     }
-    stream->oldRatePosition++;
-    if (stream->oldRatePosition == oldSampleRate) {
-      stream->oldRatePosition = 0;
-      stream->newRatePosition = 0;
+    queue->heap[index] = queue->heap[parent];
+    queue->heap[index]->heapIndex = index;
+    index = parent;
+  }
+  queue->heap[index] = task;
+  task->heapIndex = index;
+}
+
+/* Move the task at index down the heap until its children are due no
+   earlier. */
+static void siftTaskDown(sonicQueue queue, int index) {
+  sonicTask task = queue->heap[index];
+  int child;
+
+  for (;;) {
+    child = 2 * index + 1;
+    if (child >= queue->numTasks) {
+      break;
+    }
+    if (child + 1 < queue->numTasks &&
+        queue->heap[child + 1]->deadline < queue->heap[child]->deadline) {
+      child++;
     }
+    if (task->deadline <= queue->heap[child]->deadline) {
+      break;
+    }
+    queue->heap[index] = queue->heap[child];
+    queue->heap[index]->heapIndex = index;
+    index = child;
   }
-  removePitchSamples(stream, position);
-  return 1;
+  queue->heap[index] = task;
+  task->heapIndex = index;
 }
 
-/* Skip over a pitch period.  Return the number of output samples. */
-static int skipPitchPeriod(sonicStream stream, short* samples, float speed,
-                           int period) {
-  long newSamples;
-  int numChannels = stream->numChannels;
+/* Add the task to its queue's heap.  Return 0 if we run out of memory. */
+static int pushTask(sonicQueue queue, sonicTask task) {
+  sonicTask* heap;
+  int heapSize;
 
-  if (speed >= 2.0f) {
-    /* For speeds >= 2.0, we skip over a portion of each pitch period rather
-       than dropping whole pitch periods. */
-    newSamples = period / (speed - 1.0f);
-  } else {
-    newSamples = period;
+  if (queue->numTasks == queue->heapSize) {
+    heapSize = queue->heapSize * 2 + 16;
+    heap = (sonicTask*)sonicRealloc(queue->heap, queue->heapSize, heapSize,
+                                    sizeof(sonicTask));
+    if (heap == NULL) {
+      return 0;
+    }
+    queue->heap = heap;
+    queue->heapSize = heapSize;
   }
-  if (!enlargeOutputBufferIfNeeded(stream, newSamples)) {
-    return 0;
+  queue->heap[queue->numTasks++] = task;
+  siftTaskUp(queue, queue->numTasks - 1);
+  task->state = SONIC_TASK_QUEUED;
+  return 1;
+}
+
+/* Remove the task at index from the heap. */
+static void removeTask(sonicQueue queue, int index) {
+  sonicTask last;
+
+  queue->numTasks--;
+  if (index < queue->numTasks) {
+    last = queue->heap[queue->numTasks];
+    queue->heap[index] = last;
+    siftTaskUp(queue, index);
+    siftTaskDown(queue, last->heapIndex);
   }
-  overlapAdd(newSamples, numChannels,
-             stream->outputBuffer + stream->numOutputSamples * numChannels,
-             samples, samples + period * numChannels);
-  stream->numOutputSamples += newSamples;
-  return newSamples;
 }
 
-/* Insert a pitch period, and determine how much input to copy directly. */
-static int insertPitchPeriod(sonicStream stream, short* samples, float speed,
-                             int period) {
-  long newSamples;
-  short* out;
-  int numChannels = stream->numChannels;
+/* Take the task due first from the queue, and mark it running.  Its flush
+   request and deadline are moved to *flush and *deadline, since new input can
+   change them while it runs.  Return NULL if the queue is empty. */
+static sonicTask takeTask(sonicQueue queue, int* flush, double* deadline) {
+  sonicTask task = NULL;
 
-  if (speed <= 0.5f) {
-    newSamples = period * speed / (1.0f - speed);
-  } else {
-    newSamples = period;
+  sonicLockMutex(&queue->mutex);
+  if (queue->numTasks > 0) {
+    task = queue->heap[0];
+    removeTask(queue, 0);
+    task->state = SONIC_TASK_RUNNING;
+    *flush = task->flush;
+    *deadline = task->deadline;
+    task->flush = 0;
   }
-  if (!enlargeOutputBufferIfNeeded(stream, period + newSamples)) {
-    return 0;
+  sonicUnlockMutex(&queue->mutex);
+  return task;
+}
+
+/* Find the deadline of the task due first in the queue.  Return 0 if the
+   queue is empty. */
+static int findFirstDeadline(sonicQueue queue, double* deadline) {
+  int found = 0;
+
+  sonicLockMutex(&queue->mutex);
+  if (queue->numTasks > 0) {
+    *deadline = queue->heap[0]->deadline;
+    found = 1;
   }
-  out = stream->outputBuffer + stream->numOutputSamples * numChannels;
-  memcpy(out, samples, period * sizeof(short) * numChannels);
-  out =
-      stream->outputBuffer + (stream->numOutputSamples + period) * numChannels;
-  overlapAdd(newSamples, numChannels, out, samples + period * numChannels,
-             samples);
-  stream->numOutputSamples += period + newSamples;
-  return newSamples;
+  sonicUnlockMutex(&queue->mutex);
+  return found;
 }
 
-/* PICOLA copies input to output until the total output samples == consumed
-   input samples * speed. */
-static int copyUnmodifiedSamples(sonicStream stream, short* samples,
-                                 float speed, int position, int* newSamples) {
-  int availableSamples = stream->numInputSamples - position;
-  float inputToCopyFloat =
-      1 - stream->timeError * speed / (stream->samplePeriod * (speed - 1.0));
+/* Take a task for the worker of the queue to run.  It runs its own tasks
+   first, and when it has none, steals the task due first from the others. */
+static sonicTask findTask(sonicQueue queue, int* flush, double* deadline) {
+  sonicScheduler scheduler = queue->scheduler;
+  sonicQueue victim = NULL;
+  sonicTask task = takeTask(queue, flush, deadline);
+  double first, earliest = 0.0;
+  int i;
 
-  *newSamples = inputToCopyFloat > availableSamples ? availableSamples
-                                                    : (int)inputToCopyFloat;
-  if (!copyToOutput(stream, samples, *newSamples)) {
-    return 0;
+  if (task != NULL) {
+    return task;
   }
-  stream->timeError +=
-      *newSamples * stream->samplePeriod * (speed - 1.0) / speed;
-  return 1;
+  for (i = 0; i < scheduler->numQueues; i++) {
+    if (findFirstDeadline(scheduler->queues + i, &first) &&
+        (victim == NULL || first < earliest)) {
+      victim = scheduler->queues + i;
+      earliest = first;
+    }
+  }
+  return victim != NULL ? takeTask(victim, flush, deadline) : NULL;
 }
 
-/* Resample as many pitch periods as we have buffered on the input.  Return 0 if
-   we fail to resize an input or output buffer. */
-static int changeSpeed(sonicStream stream, float speed) {
-  short* samples;
-  int numSamples = stream->numInputSamples;
-  int position = 0, period, newSamples;
-  int maxRequired = stream->maxRequired;
+/* Process the task's new input, or flush it, and then requeue it if more
+   input arrived meanwhile. */
+static void runTask(sonicTask task, int flush, double deadline) {
+  sonicQueue queue = task->queue;
+  int processed;
 
-  if (stream->numInputSamples < maxRequired) {
-    return 1;
+  sonicLockMutex(&task->mutex);
+  if (flush) {
+    processed = sonicFlushStream(task->stream);
+  } else {
+    processed = processStreamInput(task->stream);
   }
-  do {
-    samples = stream->inputBuffer + position * stream->numChannels;
-    if ((speed > 1.0f && speed < 2.0f && stream->timeError < 0.0f) ||
-        (speed < 1.0f && speed > 0.5f && stream->timeError > 0.0f)) {
-      /* Deal with the case where PICOLA is still copying input samples to
-         output unmodified, */
-      if (!copyUnmodifiedSamples(stream, samples, speed, position,
-                                 &newSamples)) {
-        return 0;
+  sonicUnlockMutex(&task->mutex);
+  sonicLockMutex(&queue->mutex);
+  task->lag = getTime() - queue->scheduler->startTime - deadline;
+  task->state = SONIC_TASK_IDLE;
+  if (!processed) {
+    task->failed = 1;
+  } else if (task->pending) {
+    task->pending = 0;
+    if (!pushTask(queue, task)) {
+      task->failed = 1;
+    }
+  }
+  sonicBroadcastCondition(&queue->done);
+  sonicUnlockMutex(&queue->mutex);
+}
+
+/* Run tasks until the scheduler is destroyed, waiting when there are none. */
+SONIC_THREAD_FUNCTION(runWorker, arg) {
+  sonicQueue queue = (sonicQueue)arg;
+  sonicScheduler scheduler = queue->scheduler;
+  sonicTask task;
+  double deadline;
+  int flush;
+
+  for (;;) {
+    task = findTask(queue, &flush, &deadline);
+    if (task == NULL) {
+      /* Look once more while holding the scheduler's mutex, so input queued
+         after that is sure to wake us. */
+      sonicLockMutex(&scheduler->mutex);
+      if (scheduler->stopping) {
+        sonicUnlockMutex(&scheduler->mutex);
+        return SONIC_THREAD_RETURN;
       }
-      position += newSamples;
-    } else {
-      /* We are in the remaining cases, either inserting/removing a pitch period
-         for speed < 2.0X, or a portion of one for speed >= 2.0X. */
-      period = findPitchPeriod(stream, samples, 1);
-#ifdef SONIC_SPECTROGRAM
-      if (stream->spectrogram != NULL) {
-        sonicAddPitchPeriodToSpectrogram(stream->spectrogram, samples, period,
-                                         stream->numChannels);
-        newSamples = period;
-        position += period;
-      } else
-#endif /* SONIC_SPECTROGRAM */
-        if (speed > 1.0) {
-          newSamples = skipPitchPeriod(stream, samples, speed, period);
-          position += period + newSamples;
-          if (speed < 2.0) {
-            stream->timeError += newSamples * stream->samplePeriod -
-                                 (period + newSamples) * stream->inputPlayTime /
-                                     stream->numInputSamples;
-          }
-        } else {
-          newSamples = insertPitchPeriod(stream, samples, speed, period);
-          position += newSamples;
-          if (speed > 0.5) {
-            stream->timeError +=
-                (period + newSamples) * stream->samplePeriod -
-                newSamples * stream->inputPlayTime / stream->numInputSamples;
-          }
-        }
-      if (newSamples == 0) {
-        return 0; /* Failed to resize output buffer */
+      scheduler->numSleeping++;
+      task = findTask(queue, &flush, &deadline);
+      if (task == NULL) {
+        sonicWaitCondition(&scheduler->wake, &scheduler->mutex);
       }
+      scheduler->numSleeping--;
+      sonicUnlockMutex(&scheduler->mutex);
     }
-  } while (position + maxRequired <= numSamples);
-  removeInputSamples(stream, position);
-  return 1;
+    if (task != NULL) {
+      runTask(task, flush, deadline);
+    }
+  }
 }
 
-/* Resample as many pitch periods as we have buffered on the input.  Return 0 if
-   we fail to resize an input or output buffer.  Also scale the output by the
-   volume. */
-static int processStreamInput(sonicStream stream) {
-  int originalNumOutputSamples = stream->numOutputSamples;
-  float rate = stream->rate * stream->pitch;
-  float localSpeed;
+/* Create a scheduler with numThreads worker threads.  Return NULL if we run
+   out of memory or cannot start a thread. */
+sonicScheduler sonicCreateScheduler(int numThreads) {
+  sonicScheduler scheduler;
+  sonicQueue queue;
+  int i;
 
-  if (stream->numInputSamples == 0) {
-    return 1;
+  if (numThreads < 1) {
+    numThreads = 1;
   }
-  localSpeed =
-      stream->numInputSamples * stream->samplePeriod / stream->inputPlayTime;
-  if (localSpeed > 1.00001 || localSpeed < 0.99999) {
-    changeSpeed(stream, localSpeed);
-  } else {
-    if (!copyInputToOutput(stream, stream->numInputSamples)) {
-      return 0;
-    }
+  scheduler = (sonicScheduler)sonicCalloc(1,
+                                          sizeof(struct sonicSchedulerStruct));
+  if (scheduler == NULL) {
+    return NULL;
   }
-  if (rate != 1.0f) {
-    if (!adjustRate(stream, rate, originalNumOutputSamples)) {
-      return 0;
+  scheduler->queues = (sonicQueue)sonicCalloc(numThreads,
+                                              sizeof(struct sonicQueueStruct));
+  scheduler->threads = (sonicThread*)sonicCalloc(numThreads,
+                                                 sizeof(sonicThread));
+  if (scheduler->queues == NULL || scheduler->threads == NULL) {
+    sonicFree(scheduler->queues);
+    sonicFree(scheduler->threads);
+    sonicFree(scheduler);
+    return NULL;
+  }
+  sonicInitMutex(&scheduler->mutex);
+  sonicInitCondition(&scheduler->wake);
+  scheduler->startTime = getTime();
+  scheduler->numQueues = numThreads;
+  for (i = 0; i < numThreads; i++) {
+    queue = scheduler->queues + i;
+    queue->scheduler = scheduler;
+    sonicInitMutex(&queue->mutex);
+    sonicInitCondition(&queue->done);
+  }
+  for (i = 0; i < numThreads; i++) {
+    if (!sonicStartThread(scheduler->threads + i, runWorker,
+                          scheduler->queues + i)) {
+      break;
     }
+    scheduler->numThreads++;
+  }
+  if (scheduler->numThreads < numThreads) {
+    /* The queues of workers that never started would never be run. */
+    sonicDestroyScheduler(scheduler);
+    return NULL;
+  }
+  return scheduler;
+}
+
+/* Remove the stream from its scheduler, once it is not running. */
+static void removeFromScheduler(sonicStream stream) {
+  sonicTask task = stream->task;
+  sonicScheduler scheduler = task->scheduler;
+  sonicQueue queue = task->queue;
+
+  sonicLockMutex(&queue->mutex);
+  while (task->state == SONIC_TASK_RUNNING) {
+    sonicWaitCondition(&queue->done, &queue->mutex);
+  }
+  if (task->state == SONIC_TASK_QUEUED) {
+    removeTask(queue, task->heapIndex);
+  }
+  sonicUnlockMutex(&queue->mutex);
+  sonicLockMutex(&scheduler->mutex);
+  if (task->prevTask == NULL) {
+    scheduler->tasks = task->nextTask;
+  } else {
+    task->prevTask->nextTask = task->nextTask;
+  }
+  if (task->nextTask != NULL) {
+    task->nextTask->prevTask = task->prevTask;
+  }
+  sonicUnlockMutex(&scheduler->mutex);
+  sonicDestroyMutex(&task->mutex);
+  sonicFree(task);
+  stream->task = NULL;
+}
+
+/* Stop the worker threads, remove every stream, and free the scheduler. */
+void sonicDestroyScheduler(sonicScheduler scheduler) {
+  sonicQueue queue;
+  int i;
+
+  sonicLockMutex(&scheduler->mutex);
+  scheduler->stopping = 1;
+  sonicBroadcastCondition(&scheduler->wake);
+  sonicUnlockMutex(&scheduler->mutex);
+  for (i = 0; i < scheduler->numThreads; i++) {
+    sonicJoinThread(scheduler->threads[i]);
+  }
+  while (scheduler->tasks != NULL) {
+    removeFromScheduler(scheduler->tasks->stream);
+  }
+  for (i = 0; i < scheduler->numQueues; i++) {
+    queue = scheduler->queues + i;
+    sonicFree(queue->heap);
+    sonicDestroyMutex(&queue->mutex);
+    sonicDestroyCondition(&queue->done);
+  }
+  sonicDestroyMutex(&scheduler->mutex);
+  sonicDestroyCondition(&scheduler->wake);
+  sonicFree(scheduler->queues);
+  sonicFree(scheduler->threads);
+  sonicFree(scheduler);
+}
+
+/* Return the number of seconds since the scheduler was created.  Deadlines
+   are given in this time. */
+double sonicGetSchedulerTime(sonicScheduler scheduler) {
+  return getTime() - scheduler->startTime;
+}
+
+/* Add the stream to the scheduler.  Return 0 if we run out of memory, or if
+   the stream is already in a scheduler. */
+int sonicAddStreamToScheduler(sonicScheduler scheduler, sonicStream stream) {
+  sonicTask task;
+
+  if (stream->task != NULL) {
+    return 0;
   }
-  if (stream->volume != 1.0f) {
-    /* Adjust output volume. */
-    scaleSamples(
-        stream->outputBuffer + originalNumOutputSamples * stream->numChannels,
-        (stream->numOutputSamples - originalNumOutputSamples) *
-            stream->numChannels,
-        stream->volume);
+  task = (sonicTask)sonicCalloc(1, sizeof(struct sonicTaskStruct));
+  if (task == NULL) {
+    return 0;
+  }
+  task->stream = stream;
+  task->scheduler = scheduler;
+  task->state = SONIC_TASK_IDLE;
+  sonicInitMutex(&task->mutex);
+  sonicLockMutex(&scheduler->mutex);
+  /* Spread the streams over the workers' queues. */
+  task->queue = scheduler->queues + scheduler->nextQueue;
+  scheduler->nextQueue = (scheduler->nextQueue + 1) % scheduler->numQueues;
+  task->nextTask = scheduler->tasks;
+  if (scheduler->tasks != NULL) {
+    scheduler->tasks->prevTask = task;
   }
+  scheduler->tasks = task;
+  sonicUnlockMutex(&scheduler->mutex);
+  stream->task = task;
   return 1;
 }
 
-/* Write floating point data to the input buffer and process it. */
-int sonicWriteFloatToStream(sonicStream stream, const float* samples,
-                            int numSamples) {
-  if (!addFloatSamplesToInputBuffer(stream, samples, numSamples)) {
+/* Remove the stream from its scheduler, waiting if a worker is processing
+   it.  Any input not yet processed stays in the stream. */
+void sonicRemoveStreamFromScheduler(sonicStream stream) {
+  if (stream->task != NULL) {
+    removeFromScheduler(stream);
+  }
+}
+
+/* Queue the task to be processed by the deadline, and wake a worker if one is
+   waiting.  Return 0 if processing the stream has failed. */
+static int queueTask(sonicTask task, double deadline, int flush) {
+  sonicScheduler scheduler = task->scheduler;
+  sonicQueue queue = task->queue;
+  int succeeded;
+
+  sonicLockMutex(&queue->mutex);
+  if (flush) {
+    task->flush = 1;
+  }
+  if (task->state == SONIC_TASK_IDLE) {
+    task->deadline = deadline;
+    if (!pushTask(queue, task)) {
+      task->failed = 1;
+    }
+  } else if (task->state == SONIC_TASK_QUEUED) {
+    if (deadline < task->deadline) {
+      task->deadline = deadline;
+      siftTaskUp(queue, task->heapIndex);
+    }
+  } else if (!task->pending || deadline < task->deadline) {
+    /* The worker has its own copy of the deadline it is running for. */
+    task->deadline = deadline;
+    task->pending = 1;
+  }
+  succeeded = !task->failed;
+  sonicUnlockMutex(&queue->mutex);
+  sonicLockMutex(&scheduler->mutex);
+  if (scheduler->numSleeping > 0) {
+    sonicSignalCondition(&scheduler->wake);
+  }
+  sonicUnlockMutex(&scheduler->mutex);
+  return succeeded;
+}
+
+/* Add short samples to the stream's input, to be processed by a worker by
+   deadline, in seconds of scheduler time.  Return 0 if the stream is not in a
+   scheduler, or if we run out of memory. */
+int sonicScheduleShortInput(sonicStream stream, const short* samples,
+                            int numSamples, double deadline) {
+  sonicTask task = stream->task;
+  int added;
+
+  if (task == NULL) {
     return 0;
   }
-  return processStreamInput(stream);
+  sonicLockMutex(&task->mutex);
+  added = addShortSamplesToInputBuffer(stream, samples, numSamples);
+  sonicUnlockMutex(&task->mutex);
+  return added && queueTask(task, deadline, 0);
 }
 
-/* Simple wrapper around sonicWriteFloatToStream that does the short to float
-   conversion for you. */
-int sonicWriteShortToStream(sonicStream stream, const short* samples,
-                            int numSamples) {
-  if (!addShortSamplesToInputBuffer(stream, samples, numSamples)) {
+/* The same as sonicScheduleShortInput, for floating point samples. */
+int sonicScheduleFloatInput(sonicStream stream, const float* samples,
+                            int numSamples, double deadline) {
+  sonicTask task = stream->task;
+  int added;
+
+  if (task == NULL) {
     return 0;
   }
-  return processStreamInput(stream);
+  sonicLockMutex(&task->mutex);
+  added = addFloatSamplesToInputBuffer(stream, samples, numSamples);
+  sonicUnlockMutex(&task->mutex);
+  return added && queueTask(task, deadline, 0);
 }
 
-/* Simple wrapper around sonicWriteFloatToStream that does the unsigned char to
-   float conversion for you. */
-int sonicWriteUnsignedCharToStream(sonicStream stream,
-                                   const unsigned char* samples,
-                                   int numSamples) {
-  if (!addUnsignedCharSamplesToInputBuffer(stream, samples, numSamples)) {
+/* Have a worker flush the stream by deadline, after processing any input
+   scheduled before.  Return 0 if the stream is not in a scheduler, or if
+   processing it has failed. */
+int sonicScheduleFlush(sonicStream stream, double deadline) {
+  if (stream->task == NULL) {
     return 0;
   }
-  return processStreamInput(stream);
+  return queueTask(stream->task, deadline, 1);
 }
 
-/* This is a non-stream oriented interface to just change the speed of a sound
- * sample */
-int sonicChangeFloatSpeed(float* samples, int numSamples, float speed,
-                          float pitch, float rate, float volume,
-                          int useChordPitch, int sampleRate, int numChannels) {
-  sonicStream stream = sonicCreateStream(sampleRate, numChannels);
+/* Read the output processed so far from a stream in a scheduler.  Return the
+   number of samples read. */
+int sonicReadScheduledShortOutput(sonicStream stream, short* samples,
+                                  int maxSamples) {
+  sonicTask task = stream->task;
+  int numSamples;
 
-  sonicSetSpeed(stream, speed);
-  sonicSetPitch(stream, pitch);
-  sonicSetRate(stream, rate);
-  sonicSetVolume(stream, volume);
-  sonicWriteFloatToStream(stream, samples, numSamples);
-  sonicFlushStream(stream);
-  numSamples = sonicSamplesAvailable(stream);
-  sonicReadFloatFromStream(stream, samples, numSamples);
-  sonicDestroyStream(stream);
+  if (task == NULL) {
+    return sonicReadShortFromStream(stream, samples, maxSamples);
+  }
+  sonicLockMutex(&task->mutex);
+  numSamples = sonicReadShortFromStream(stream, samples, maxSamples);
+  sonicUnlockMutex(&task->mutex);
   return numSamples;
 }
 
-/* This is a non-stream oriented interface to just change the speed of a sound
- * sample */
-int sonicChangeShortSpeed(short* samples, int numSamples, float speed,
-                          float pitch, float rate, float volume,
-                          int useChordPitch, int sampleRate, int numChannels) {
-  sonicStream stream = sonicCreateStream(sampleRate, numChannels);
+/* The same as sonicReadScheduledShortOutput, for floating point samples. */
+int sonicReadScheduledFloatOutput(sonicStream stream, float* samples,
+                                  int maxSamples) {
+  sonicTask task = stream->task;
+  int numSamples;
 
-  sonicSetSpeed(stream, speed);
-  sonicSetPitch(stream, pitch);
-  sonicSetRate(stream, rate);
-  sonicSetVolume(stream, volume);
-  sonicWriteShortToStream(stream, samples, numSamples);
-  sonicFlushStream(stream);
-  numSamples = sonicSamplesAvailable(stream);
-  sonicReadShortFromStream(stream, samples, numSamples);
-  sonicDestroyStream(stream);
+  if (task == NULL) {
+    return sonicReadFloatFromStream(stream, samples, maxSamples);
+  }
+  sonicLockMutex(&task->mutex);
+  numSamples = sonicReadFloatFromStream(stream, samples, maxSamples);
+  sonicUnlockMutex(&task->mutex);
   return numSamples;
 }
+
+/* Wait until all the input scheduled for the stream has been processed.
+   Return 0 if processing it has failed. */
+int sonicWaitForScheduledStream(sonicStream stream) {
+  sonicTask task = stream->task;
+  sonicQueue queue;
+  int succeeded;
+
+  if (task == NULL) {
+    return 1;
+  }
+  queue = task->queue;
+  sonicLockMutex(&queue->mutex);
+  while (task->state != SONIC_TASK_IDLE) {
+    sonicWaitCondition(&queue->done, &queue->mutex);
+  }
+  succeeded = !task->failed;
+  sonicUnlockMutex(&queue->mutex);
+  return succeeded;
+}
+
+/* Return how many seconds past its deadline the stream's input was last
+   processed, or how late its waiting input already is, if that is later.  It
+   is negative when the stream is keeping ahead of its deadlines.  Lags that
+   keep growing across the streams mean the workers are saturated. */
+double sonicGetStreamLag(sonicStream stream) {
+  sonicTask task = stream->task;
+  sonicQueue queue;
+  double lag, waiting;
+
+  if (task == NULL) {
+    return 0.0;
+  }
+  queue = task->queue;
+  sonicLockMutex(&queue->mutex);
+  lag = task->lag;
+  if (task->state == SONIC_TASK_QUEUED || task->pending) {
+    waiting = sonicGetSchedulerTime(task->scheduler) - task->deadline;
+    if (waiting > lag) {
+      lag = waiting;
+    }
+  }
+  sonicUnlockMutex(&queue->mutex);
+  return lag;
+}
+
+#else
+
+/* Without threads, or without malloc, there is no scheduler. */
+sonicScheduler sonicCreateScheduler(int numThreads) { return NULL; }
+void sonicDestroyScheduler(sonicScheduler scheduler) {}
+double sonicGetSchedulerTime(sonicScheduler scheduler) { return 0.0; }
+int sonicAddStreamToScheduler(sonicScheduler scheduler, sonicStream stream) {
+  return 0;
+}
+static void removeFromScheduler(sonicStream stream) {}
+void sonicRemoveStreamFromScheduler(sonicStream stream) {}
+int sonicScheduleShortInput(sonicStream stream, const short* samples,
+                            int numSamples, double deadline) {
+  return 0;
+}
+int sonicScheduleFloatInput(sonicStream stream, const float* samples,
+                            int numSamples, double deadline) {
+  return 0;
+}
+int sonicScheduleFlush(sonicStream stream, double deadline) { return 0; }
+int sonicReadScheduledShortOutput(sonicStream stream, short* samples,
+                                  int maxSamples) {
+  return sonicReadShortFromStream(stream, samples, maxSamples);
+}
+int sonicReadScheduledFloatOutput(sonicStream stream, float* samples,
+                                  int maxSamples) {
+  return sonicReadFloatFromStream(stream, samples, maxSamples);
+}
+int sonicWaitForScheduledStream(sonicStream stream) { return 1; }
+double sonicGetStreamLag(sonicStream stream) { return 0.0; }
+
+#endif /* !SONIC_NO_THREADS && !SONIC_NO_MALLOC */
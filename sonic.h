@@ -54,6 +54,8 @@ similar to high speed factors is used.
    sound quality slightly, at the expense of lots of floating point math. */
 /* #define SONIC_USE_SIN */
 
+#include <stddef.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -73,13 +75,33 @@ extern "C" {
  * symbols and call the sonicIntXXX functions directly.
  */
 #define sonicCreateStream sonicIntCreateStream
+#define sonicStreamMemoryRequired sonicIntStreamMemoryRequired
+#define sonicCreateStreamInBuffer sonicIntCreateStreamInBuffer
 #define sonicDestroyStream sonicIntDestroyStream
+#define sonicResetStream sonicIntResetStream
 #define sonicWriteFloatToStream sonicIntWriteFloatToStream
 #define sonicWriteShortToStream sonicIntWriteShortToStream
 #define sonicWriteUnsignedCharToStream sonicIntWriteUnsignedCharToStream
+#define sonicWriteIntToStream sonicIntWriteIntToStream
+#define sonicWriteInt24ToStream sonicIntWriteInt24ToStream
+#define sonicWriteFloatPlanarToStream sonicIntWriteFloatPlanarToStream
+#define sonicWriteShortPlanarToStream sonicIntWriteShortPlanarToStream
+#define sonicTryWriteFloatToStream sonicIntTryWriteFloatToStream
+#define sonicTryWriteShortToStream sonicIntTryWriteShortToStream
+#define sonicTryWriteUnsignedCharToStream sonicIntTryWriteUnsignedCharToStream
+#define sonicAcquireInput sonicIntAcquireInput
+#define sonicAcquireFloatInput sonicIntAcquireFloatInput
+#define sonicCommitInput sonicIntCommitInput
 #define sonicReadFloatFromStream sonicIntReadFloatFromStream
 #define sonicReadShortFromStream sonicIntReadShortFromStream
 #define sonicReadUnsignedCharFromStream sonicIntReadUnsignedCharFromStream
+#define sonicReadIntFromStream sonicIntReadIntFromStream
+#define sonicReadInt24FromStream sonicIntReadInt24FromStream
+#define sonicReadFloatPlanarFromStream sonicIntReadFloatPlanarFromStream
+#define sonicReadShortPlanarFromStream sonicIntReadShortPlanarFromStream
+#define sonicPeekOutput sonicIntPeekOutput
+#define sonicPeekFloatOutput sonicIntPeekFloatOutput
+#define sonicConsumeOutput sonicIntConsumeOutput
 #define sonicFlushStream sonicIntFlushStream
 #define sonicSamplesAvailable sonicIntSamplesAvailable
 #define sonicGetSpeed sonicIntGetSpeed
@@ -90,16 +112,57 @@ extern "C" {
 #define sonicSetRate sonicIntSetRate
 #define sonicGetVolume sonicIntGetVolume
 #define sonicSetVolume sonicIntSetVolume
+#define sonicGetChordPitch sonicIntGetChordPitch
+#define sonicSetChordPitch sonicIntSetChordPitch
 #define sonicGetQuality sonicIntGetQuality
 #define sonicSetQuality sonicIntSetQuality
+#define sonicGetMaxMemory sonicIntGetMaxMemory
+#define sonicSetMaxMemory sonicIntSetMaxMemory
+#define sonicGetFloatProcessing sonicIntGetFloatProcessing
+#define sonicSetFloatProcessing sonicIntSetFloatProcessing
 #define sonicGetSampleRate sonicIntGetSampleRate
 #define sonicSetSampleRate sonicIntSetSampleRate
 #define sonicGetNumChannels sonicIntGetNumChannels
 #define sonicGetUserData sonicIntGetUserData
 #define sonicSetUserData sonicIntSetUserData
 #define sonicSetNumChannels sonicIntSetNumChannels
+#define sonicGetIncrementalPitchSearch sonicIntGetIncrementalPitchSearch
+#define sonicSetIncrementalPitchSearch sonicIntSetIncrementalPitchSearch
+#define sonicGetPitchTracking sonicIntGetPitchTracking
+#define sonicSetPitchTracking sonicIntSetPitchTracking
+#define sonicGetPitchChannel sonicIntGetPitchChannel
+#define sonicSetPitchChannel sonicIntSetPitchChannel
+#define sonicGetSilenceThreshold sonicIntGetSilenceThreshold
+#define sonicSetSilenceThreshold sonicIntSetSilenceThreshold
+#define sonicGetSilentSamples sonicIntGetSilentSamples
+#define sonicGetPitchPyramid sonicIntGetPitchPyramid
+#define sonicSetPitchPyramid sonicIntSetPitchPyramid
+#define sonicGetPitchPruning sonicIntGetPitchPruning
+#define sonicSetPitchPruning sonicIntSetPitchPruning
+#define sonicGetPitchSamplesPruned sonicIntGetPitchSamplesPruned
+#define sonicGetPitchDetector sonicIntGetPitchDetector
+#define sonicSetPitchDetector sonicIntSetPitchDetector
+#define sonicGetResampler sonicIntGetResampler
+#define sonicSetResampler sonicIntSetResampler
 #define sonicChangeFloatSpeed sonicIntChangeFloatSpeed
 #define sonicChangeShortSpeed sonicIntChangeShortSpeed
+#define sonicChangeFloatSpeedParallel sonicIntChangeFloatSpeedParallel
+#define sonicChangeShortSpeedParallel sonicIntChangeShortSpeedParallel
+#define sonicAcquirePooledStream sonicIntAcquirePooledStream
+#define sonicReleasePooledStream sonicIntReleasePooledStream
+#define sonicDestroyStreamPool sonicIntDestroyStreamPool
+#define sonicCreateScheduler sonicIntCreateScheduler
+#define sonicDestroyScheduler sonicIntDestroyScheduler
+#define sonicGetSchedulerTime sonicIntGetSchedulerTime
+#define sonicAddStreamToScheduler sonicIntAddStreamToScheduler
+#define sonicRemoveStreamFromScheduler sonicIntRemoveStreamFromScheduler
+#define sonicScheduleShortInput sonicIntScheduleShortInput
+#define sonicScheduleFloatInput sonicIntScheduleFloatInput
+#define sonicScheduleFlush sonicIntScheduleFlush
+#define sonicReadScheduledShortOutput sonicIntReadScheduledShortOutput
+#define sonicReadScheduledFloatOutput sonicIntReadScheduledFloatOutput
+#define sonicWaitForScheduledStream sonicIntWaitForScheduledStream
+#define sonicGetStreamLag sonicIntGetStreamLag
 #define sonicEnableNonlinearSpeedup sonicIntEnableNonlinearSpeedup
 #define sonicSetDurationFeedbackStrength sonicIntSetDurationFeedbackStrength
 #define sonicComputeSpectrogram sonicIntComputeSpectrogram
@@ -134,8 +197,25 @@ extern "C" {
 /* These are used to down-sample some inputs to improve speed */
 #define SONIC_AMDF_FREQ 4000
 
+/* Pitch detectors that can be selected with sonicSetPitchDetector. */
+#define SONIC_PITCH_DETECTOR_AMDF 0
+#define SONIC_PITCH_DETECTOR_FFT 1
+
+/* Resamplers for rate and pitch changes that can be selected with
+   sonicSetResampler, from cheapest to best. */
+#define SONIC_RESAMPLER_LINEAR 0
+#define SONIC_RESAMPLER_CUBIC 1
+#define SONIC_RESAMPLER_SINC 2
+#define SONIC_RESAMPLER_HIGH_QUALITY 3
+
+/* Special values for sonicSetPitchChannel. */
+#define SONIC_PITCH_CHANNEL_MIX -1
+#define SONIC_PITCH_CHANNEL_LOUDEST -2
+
 struct sonicStreamStruct;
 typedef struct sonicStreamStruct* sonicStream;
+struct sonicSchedulerStruct;
+typedef struct sonicSchedulerStruct* sonicScheduler;
 
 /* For all of the following functions, numChannels is multiplied by numSamples
    to determine the actual number of values read or returned. */
@@ -143,8 +223,28 @@ typedef struct sonicStreamStruct* sonicStream;
 /* Create a sonic stream.  Return NULL only if we are out of memory and cannot
   allocate the stream. Set numChannels to 1 for mono, and 2 for stereo. */
 sonicStream sonicCreateStream(int sampleRate, int numChannels);
+/* Return the number of bytes of memory sonicCreateStreamInBuffer needs for a
+   stream that is never written more than maxChunk samples at a time.  This
+   assumes the output is read after each write, and that the stream does not
+   slow down by more than 2X.  Other cases, and features such as rate changes
+   and incremental pitch search, use more memory when the block has it. */
+size_t sonicStreamMemoryRequired(int sampleRate, int numChannels,
+                                 int maxChunk);
+/* Create a sonic stream that keeps all of its state in the size bytes at
+   memory rather than allocating any.  Each allocation starts on a 64-byte
+   boundary.  Return NULL if the block is too small.  Call sonicDestroyStream
+   when done, after which the caller can reuse the memory.  This works with or
+   without SONIC_NO_MALLOC, and any number of these streams can be used at
+   once. */
+sonicStream sonicCreateStreamInBuffer(void* memory, size_t size,
+                                      int sampleRate, int numChannels,
+                                      int maxChunk);
 /* Destroy the sonic stream. */
 void sonicDestroyStream(sonicStream stream);
+/* Return the stream to the state it was created in, dropping buffered samples
+   and restoring the default parameters, but keeping the sample rate, number
+   of channels, user data and allocated memory. */
+void sonicResetStream(sonicStream stream);
 /* Attach user data to the stream. */
 void sonicSetUserData(sonicStream stream, void *userData);
 /* Retrieve user data attached to the stream. */
@@ -160,6 +260,51 @@ int sonicWriteShortToStream(sonicStream stream, const short* samples, int numSam
    Return 0 if memory realloc failed, otherwise 1 */
 int sonicWriteUnsignedCharToStream(sonicStream stream, const unsigned char* samples,
                                    int numSamples);
+/* Use this to write 32-bit data to be speed up or down into the stream.
+   Unless the stream processes floats, samples are rounded to 16 bits.
+   Return 0 if memory realloc failed, otherwise 1 */
+int sonicWriteIntToStream(sonicStream stream, const int* samples,
+                          int numSamples);
+/* Use this to write packed 24-bit little-endian data to be speed up or down
+   into the stream, 3 bytes per sample.  Unless the stream processes floats,
+   samples are rounded to 16 bits.  Return 0 if memory realloc failed,
+   otherwise 1 */
+int sonicWriteInt24ToStream(sonicStream stream, const unsigned char* samples,
+                            int numSamples);
+/* These are the same as sonicWriteFloatToStream and sonicWriteShortToStream,
+   but take planar data: samples[i] points to the numSamples samples of
+   channel i.  They are interleaved straight into the stream's input buffer. */
+int sonicWriteFloatPlanarToStream(sonicStream stream,
+                                  const float* const* samples,
+                                  int numSamples);
+int sonicWriteShortPlanarToStream(sonicStream stream,
+                                  const short* const* samples,
+                                  int numSamples);
+/* These write as many samples as the stream's memory limit allows, assuming
+   none of the output is read in the meantime, and return how many they wrote.
+   This lets a producer wait for the consumer rather than have the stream grow
+   without bound.  Without a limit they write every sample.  Return -1 if
+   memory realloc failed. */
+int sonicTryWriteFloatToStream(sonicStream stream, const float* samples,
+                               int numSamples);
+int sonicTryWriteShortToStream(sonicStream stream, const short* samples,
+                               int numSamples);
+int sonicTryWriteUnsignedCharToStream(sonicStream stream,
+                                      const unsigned char* samples,
+                                      int numSamples);
+/* Use this to write 16-bit data into the stream without copying it.  Room is
+   made for at least minSamples samples in the stream's input buffer, *samples
+   is set to point to it, and the number of samples that fit is returned.
+   Return 0 if memory realloc failed, or if the stream processes floats. */
+int sonicAcquireInput(sonicStream stream, int minSamples, short** samples);
+/* The same as sonicAcquireInput, for streams that process floats.  Return 0
+   if they do not. */
+int sonicAcquireFloatInput(sonicStream stream, int minSamples,
+                           float** samples);
+/* Add the first numSamples samples written to the space returned by
+   sonicAcquireInput to the stream, and process them.  Return 0 if memory
+   realloc failed, otherwise 1 */
+int sonicCommitInput(sonicStream stream, int numSamples);
 /* Use this to read floating point data out of the stream.  Sometimes no data
    will be available, and zero is returned, which is not an error condition. */
 int sonicReadFloatFromStream(sonicStream stream, float* samples,
@@ -172,6 +317,32 @@ int sonicReadShortFromStream(sonicStream stream, short* samples,
    will be available, and zero is returned, which is not an error condition. */
 int sonicReadUnsignedCharFromStream(sonicStream stream, unsigned char* samples,
                                     int maxSamples);
+/* Use this to read 32-bit data out of the stream.  Sometimes no data will be
+   available, and zero is returned, which is not an error condition. */
+int sonicReadIntFromStream(sonicStream stream, int* samples, int maxSamples);
+/* Use this to read packed 24-bit little-endian data out of the stream, 3 bytes
+   per sample.  Sometimes no data will be available, and zero is returned,
+   which is not an error condition. */
+int sonicReadInt24FromStream(sonicStream stream, unsigned char* samples,
+                             int maxSamples);
+/* These are the same as sonicReadFloatFromStream and sonicReadShortFromStream,
+   but write planar data: samples[i] points to room for maxSamples samples of
+   channel i. */
+int sonicReadFloatPlanarFromStream(sonicStream stream, float* const* samples,
+                                   int maxSamples);
+int sonicReadShortPlanarFromStream(sonicStream stream, short* const* samples,
+                                   int maxSamples);
+/* Use this to read 16-bit data without copying it.  *samples is set to point
+   to the processed samples inside the stream, and their number is returned.
+   The pointer is valid until the stream is next written, flushed, or read.
+   Streams that process floats return 0. */
+int sonicPeekOutput(sonicStream stream, const short** samples);
+/* The same as sonicPeekOutput, for streams that process floats.  Return 0 if
+   they do not. */
+int sonicPeekFloatOutput(sonicStream stream, const float** samples);
+/* Release numSamples samples returned by sonicPeekOutput, once the caller is
+   done with them. */
+void sonicConsumeOutput(sonicStream stream, int numSamples);
 /* Force the sonic stream to generate output using whatever data it currently
    has.  No extra delay will be added to the output, but flushing in the middle
    of words could introduce distortion. */
@@ -206,16 +377,108 @@ int sonicGetQuality(sonicStream stream);
 /* Set the "quality".  Default 0 is virtually as good as 1, but very much
  * faster. */
 void sonicSetQuality(sonicStream stream, int quality);
+/* Get the stream's memory limit in bytes, or 0 if there is none. */
+size_t sonicGetMaxMemory(sonicStream stream);
+/* Limit the memory the stream's sample buffers can grow to, in bytes, or set
+   0 for no limit, which is the default.  Writes that need more memory fail as
+   if realloc had failed, and sonicTryWrite*ToStream write only what fits. */
+void sonicSetMaxMemory(sonicStream stream, size_t maxMemory);
+/* Get whether the stream processes floats. */
+int sonicGetFloatProcessing(sonicStream stream);
+/* Process samples as floats rather than 16-bit integers.  Default is off.
+   Float input and output is then copied rather than converted, and the
+   overlap-add, resampling and volume are computed in float without clipping,
+   so none of the precision of float samples is lost.  The pitch period is
+   still found from 16-bit copies of the samples.  Any samples in the stream
+   are converted.  The buffers take twice the memory.  Return 0 if memory
+   allocation failed, or if the buffers would pass the memory limit, otherwise
+   1. */
+int sonicSetFloatProcessing(sonicStream stream, int enable);
 /* Get the sample rate of the stream. */
 int sonicGetSampleRate(sonicStream stream);
 /* Set the sample rate of the stream.  This will drop any samples that have not
- * been read. */
+ * been read.  A stream in caller-provided memory keeps its old sample rate if
+ * the block is too small for the new one. */
 void sonicSetSampleRate(sonicStream stream, int sampleRate);
 /* Get the number of channels. */
 int sonicGetNumChannels(sonicStream stream);
 /* Set the number of channels.  This will drop any samples that have not been
- * read. */
+ * read.  A stream in caller-provided memory keeps its old number of channels
+ * if the block is too small for the new one. */
 void sonicSetNumChannels(sonicStream stream, int numChannels);
+/* Get the incremental pitch search setting. */
+int sonicGetIncrementalPitchSearch(sonicStream stream);
+/* Enable or disable the incremental pitch search.  Default is off.  When on,
+   the AMDF sums from each pitch search are kept and updated for the next
+   search, rather than recomputed from scratch.  This does not change the
+   output.  It saves the most time when successive searches are close
+   together, such as when slowing down by more than 2X, and when quality is 1.
+   Return 0 if memory allocation failed, otherwise 1. */
+int sonicSetIncrementalPitchSearch(sonicStream stream, int enable);
+/* Get the pitch tracking setting. */
+int sonicGetPitchTracking(sonicStream stream);
+/* Enable or disable pitch tracking.  Default is off.  When on, each pitch
+   search first looks in a narrow band around the previous pitch period, and
+   only searches the full pitch range if it finds no good match there.  This
+   is several times faster on voiced speech, especially when quality is 1, but
+   can pick slightly different periods than a full search. */
+void sonicSetPitchTracking(sonicStream stream, int enable);
+/* Get the channel used to find the pitch period. */
+int sonicGetPitchChannel(sonicStream stream);
+/* Set the channel used to find the pitch period of multi-channel input.  By
+   default, this is SONIC_PITCH_CHANNEL_MIX, which averages all the channels.
+   Searching just one channel, given by its index, is much faster with many
+   channels.  SONIC_PITCH_CHANNEL_LOUDEST picks the loudest channel for each
+   pitch period.  If the channel does not exist, the channels are mixed. */
+void sonicSetPitchChannel(sonicStream stream, int channel);
+/* Get the silence threshold. */
+int sonicGetSilenceThreshold(sonicStream stream);
+/* Set the silence threshold.  Where the average absolute sample value is no
+   more than this, the pitch search and blending are skipped, and samples are
+   just copied.  The default, 0, only does this for digital silence, which does
+   not change the output.  Higher values speed up processing of near silence,
+   with a small change in output.  Set it to -1 to disable this. */
+void sonicSetSilenceThreshold(sonicStream stream, int threshold);
+/* Get the number of input samples that were processed as silence. */
+long sonicGetSilentSamples(sonicStream stream);
+/* Get the pitch pyramid setting. */
+int sonicGetPitchPyramid(sonicStream stream);
+/* Enable or disable the pitch search pyramid.  When quality is 0, the pitch
+   period is first found at a low sample rate, and then refined at the full
+   rate.  With the pyramid, it is refined in several steps of increasing sample
+   rate instead, which is much faster at high sample rates, but can pick
+   slightly different periods. */
+void sonicSetPitchPyramid(sonicStream stream, int enable);
+/* Get the pitch pruning setting. */
+int sonicGetPitchPruning(sonicStream stream);
+/* Enable or disable pitch pruning.  When enabled, the pitch search stops
+   summing the differences for a candidate period as soon as it can no longer
+   be the best match.  The output is the same, and this is faster on voiced
+   speech when quality is 1.  Return 0 if memory allocation failed, otherwise
+   1. */
+int sonicSetPitchPruning(sonicStream stream, int enable);
+/* Get the number of samples the pruned pitch search did not have to compare,
+   summed over all candidate periods of all searches so far. */
+long sonicGetPitchSamplesPruned(sonicStream stream);
+/* Get the pitch detector. */
+int sonicGetPitchDetector(sonicStream stream);
+/* Set the pitch detector.  The default, SONIC_PITCH_DETECTOR_AMDF, uses the
+   Average Magnitude Difference Function.  SONIC_PITCH_DETECTOR_FFT computes a
+   squared difference function for all periods at once using an FFT, which is
+   faster at high sample rates, and always works at the full sample rate,
+   regardless of the quality setting.  It uses floating point math.  Return 0
+   if memory allocation failed, otherwise 1. */
+int sonicSetPitchDetector(sonicStream stream, int pitchDetector);
+/* Get the resampler used for rate and pitch changes. */
+int sonicGetResampler(sonicStream stream);
+/* Set the resampler used for rate and pitch changes.  SONIC_RESAMPLER_LINEAR
+   interpolates between 2 input samples, and SONIC_RESAMPLER_CUBIC uses a
+   4-point Catmull-Rom spline.  The default, SONIC_RESAMPLER_SINC, uses a
+   12-point windowed sinc filter.  SONIC_RESAMPLER_HIGH_QUALITY uses a
+   32-point windowed sinc filter, which also filters out frequencies above the
+   new Nyquist frequency when pitch is raised, at about twice the cost.
+   Unknown values select SONIC_RESAMPLER_SINC. */
+void sonicSetResampler(sonicStream stream, int resampler);
 /* This is a non-stream oriented interface to just change the speed of a sound
    sample.  It works in-place on the sample array, so there must be at least
    speed*numSamples available space in the array. Returns the new number of
@@ -230,6 +493,75 @@ int sonicChangeFloatSpeed(float* samples, int numSamples, float speed,
 int sonicChangeShortSpeed(short* samples, int numSamples, float speed,
                           float pitch, float rate, float volume,
                           int useChordPitch, int sampleRate, int numChannels);
+/* These are the same as sonicChangeFloatSpeed and sonicChangeShortSpeed, but
+   use numThreads threads, for long recordings.  The samples are split into
+   segments of at least 10 seconds at quiet points, each segment is processed
+   by its own stream with a little of the next segment for context, and the
+   results are cross-faded together at the position the requested speed puts
+   them, so the total duration is the same.  The output differs slightly from
+   the serial functions around each seam.  Buffers too short to split, builds
+   with SONIC_NO_THREADS or SONIC_NO_MALLOC, and a numThreads of 1 or less
+   fall back to the serial functions.  Like them, they use pooled streams,
+   which hold the output until it is copied back. */
+int sonicChangeFloatSpeedParallel(float* samples, int numSamples, float speed,
+                                  float pitch, float rate, float volume,
+                                  int sampleRate, int numChannels,
+                                  int numThreads);
+int sonicChangeShortSpeedParallel(short* samples, int numSamples, float speed,
+                                  float pitch, float rate, float volume,
+                                  int sampleRate, int numChannels,
+                                  int numThreads);
+/* Take an idle stream with the given sample rate and number of channels from
+   the stream pool, or create one if there are none.  The stream has its
+   default parameters.  Return NULL only if we are out of memory.  The pool is
+   safe to use from multiple threads, and the functions above use it. */
+sonicStream sonicAcquirePooledStream(int sampleRate, int numChannels);
+/* Reset a stream and return it to the stream pool, rather than destroying
+   it, so it can be reused without allocating memory. */
+void sonicReleasePooledStream(sonicStream stream);
+/* Destroy all the idle streams in the stream pool. */
+void sonicDestroyStreamPool(void);
+/* A scheduler processes the input of many streams with a fixed pool of
+   numThreads worker threads, so a server need not dedicate a thread to each
+   stream.  Input is scheduled with a deadline, in seconds since the scheduler
+   was created, and the workers process the streams due first, each taking
+   streams from its own queue and stealing from the others when it runs out.
+   Once a stream is added to a scheduler, write to it, flush it and read from
+   it only with the functions below, which may be called from any thread.
+   sonicCreateScheduler returns NULL if we are out of memory, or in builds with
+   SONIC_NO_THREADS or SONIC_NO_MALLOC. */
+sonicScheduler sonicCreateScheduler(int numThreads);
+/* Stop the workers and remove all the streams, without destroying them. */
+void sonicDestroyScheduler(sonicScheduler scheduler);
+/* Return the current time of the scheduler, in seconds. */
+double sonicGetSchedulerTime(sonicScheduler scheduler);
+/* Add a stream to the scheduler.  Returns 0 if out of memory, or if the
+   stream is already in a scheduler. */
+int sonicAddStreamToScheduler(sonicScheduler scheduler, sonicStream stream);
+/* Remove a stream from its scheduler, waiting for any processing of it to
+   finish.  Destroying or resetting a stream also does this. */
+void sonicRemoveStreamFromScheduler(sonicStream stream);
+/* Add samples to the stream's input, to be processed by the deadline.  Returns
+   0 if the stream is not in a scheduler, or if out of memory. */
+int sonicScheduleShortInput(sonicStream stream, const short* samples,
+                            int numSamples, double deadline);
+int sonicScheduleFloatInput(sonicStream stream, const float* samples,
+                            int numSamples, double deadline);
+/* Flush the stream by the deadline, after the input scheduled before. */
+int sonicScheduleFlush(sonicStream stream, double deadline);
+/* Read the output processed so far.  Returns the number of samples read. */
+int sonicReadScheduledShortOutput(sonicStream stream, short* samples,
+                                  int maxSamples);
+int sonicReadScheduledFloatOutput(sonicStream stream, float* samples,
+                                  int maxSamples);
+/* Wait until the input scheduled for the stream has been processed.  Returns
+   0 if processing it ran out of memory. */
+int sonicWaitForScheduledStream(sonicStream stream);
+/* Return how many seconds late the stream's input was last processed, or how
+   late its waiting input already is, if later.  It is negative while the
+   stream keeps ahead of its deadlines.  Lags that keep growing mean the
+   workers are saturated. */
+double sonicGetStreamLag(sonicStream stream);
 
 #ifdef SONIC_SPECTROGRAM
 /*
@@ -143,3 +143,26 @@ int sonicTestInputsDontCrash(void) {
   sonicDestroyStream(stream);
   return 1;
 }
+
+/* Test speed and pitch combinations that shrink the overlap of a skipped or
+   inserted pitch period to nothing at a low sample rate. */
+int sonicTestExtremeSpeedsAtLowRate(void) {
+  static const float speeds[] = {4.0f, 20.0f, 0.05f};
+  static const float pitches[] = {0.5f, 0.3f, 3.0f};
+  short samples[8000];
+  short readBuf[READ_BUF_LEN];
+  int numSamples = genSineWave(samples, 8000, 8000, 40, AMPLITUDE, 200);
+  sonicStream stream;
+  int i;
+
+  for (i = 0; i < 3; i++) {
+    stream = sonicCreateStream(8000, 1);
+    sonicSetSpeed(stream, speeds[i]);
+    sonicSetPitch(stream, pitches[i]);
+    processSomeSamples(stream, samples, numSamples);
+    assert(sonicFlushStream(stream));
+    while (sonicReadShortFromStream(stream, readBuf, READ_BUF_LEN) != 0);
+    sonicDestroyStream(stream);
+  }
+  return 1;
+}
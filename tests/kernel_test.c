@@ -0,0 +1,466 @@
+/* Sonic library
+   Copyright 2025
+   Bill Cox
+   This file is part of the Sonic Library.
+
+   This file is licensed under the Apache 2.0 license.
+*/
+
+/* Tests that the SIMD kernels give exactly the same results as the portable
+   versions.  The other tests only reach the kernels selected for the CPU they
+   run on, and rarely hit the lengths, channel counts and volumes where the
+   SIMD versions fall back to scalar code or saturate.  The kernels are private
+   to sonic.c, so it is included here, with SONIC_INTERNAL defined so its
+   public functions do not clash with the copy linked with the other tests. */
+
+#define SONIC_INTERNAL
+
+/* Unfortunate Google compatibility cruft. */
+#ifdef GOOGLE_BUILD
+#include "third_party/sonic/sonic.c"
+#else
+#include "sonic.c"
+#endif
+
+#include "tests.h"
+
+#ifdef SONIC_X86_SIMD
+
+/* Samples past the end of each output, which no kernel should write. */
+#define GUARD_SAMPLES 32
+#define GUARD_VALUE 0x1234
+/* Room for the longest overlap-add tested, and for the frame after the last
+   one that the interpolation kernels may read. */
+#define MAX_KERNEL_SAMPLES \
+  ((SONIC_MAX_SIMD_OVERLAP_CHANNELS + 1) * (SONIC_MAX_RECIPROCAL_OVERLAP + 1))
+
+/* The SIMD kernels, with the same types as the kernel pointers in sonic.c. */
+typedef unsigned long (*diffFunc)(const short* s, const short* p,
+                                  int numSamples);
+typedef unsigned long (*boundedDiffFunc)(const short* s, const short* p,
+                                         int numSamples, unsigned long limit,
+                                         int* numSummed);
+typedef void (*overlapAddFunc)(short* out, const short* rampDown,
+                               const short* rampUp, int numSamples,
+                               int numChannels, unsigned long multiplier,
+                               int shift, int volume);
+
+/* Run lengths covering no samples at all, the tails left over by each vector
+   width, and runs long enough to sum many vectors. */
+static const int lengths[] = {0,  1,  2,  3,  5,  7,  8,  9,   15,  16,
+                              17, 31, 32, 33, 63, 64, 65, 100, 255, 4097};
+/* Overlap lengths, which also include the longest that uses the fixed-point
+   reciprocal. */
+static const int overlaps[] = {0, 1, 2, 3, 5, 8, 13, 17, 100, 1000,
+                               SONIC_MAX_RECIPROCAL_OVERLAP - 1};
+/* Fixed-point volumes from SONIC_MIN_VOLUME to SONIC_MAX_VOLUME, as made by
+   findFixedPointVolume.  0 leaves samples alone, and the loud ones clip
+   full-scale samples. */
+static const int volumes[] = {0, 2, 64, 256, 300, 25600};
+static const float floatVolumes[] = {1.0f, 0.01f, 0.5f, 3.0f, 100.0f};
+
+#define NUM_ITEMS(array) ((int)(sizeof(array) / sizeof(array[0])))
+
+static unsigned long randomState = 1;
+
+/* Return 16 pseudo-random bits. */
+static int randomBits(void) {
+  randomState = (randomState * 1103515245UL + 12345) & 0xffffffffUL;
+  return (int)(randomState >> 16);
+}
+
+/* Fill samples with full-scale random values.  One in eight is one of the
+   extremes, where the SIMD versions saturate. */
+static void randomSamples(short* samples, int numSamples) {
+  int i, bits;
+
+  for (i = 0; i < numSamples; i++) {
+    bits = randomBits();
+    if ((bits & 0x7) == 0) {
+      samples[i] = bits & 0x8 ? SHRT_MAX : SHRT_MIN;
+    } else {
+      samples[i] = (short)(bits - 32768);
+    }
+  }
+}
+
+/* Fill samples with random values from -2 to 2, louder than full scale. */
+static void randomFloats(float* samples, int numSamples) {
+  int i;
+
+  for (i = 0; i < numSamples; i++) {
+    samples[i] = (randomBits() - 32768) / 16384.0f;
+  }
+}
+
+/* Fill weights with random filter weights for numPoints points, from -0.5
+   to 1.5, so filtering full-scale samples overshoots. */
+static void randomWeights(short* weights, int numPoints) {
+  int i;
+
+  for (i = 0; i < numPoints; i++) {
+    setRateWeight(weights, numPoints, i, randomBits() * 2 - 32768);
+  }
+}
+
+/* Fill both outputs, including their guard samples, with the same value, so
+   anything a kernel writes that it should not shows up as a difference. */
+static void clearOutputs(short* expected, short* actual, int numSamples) {
+  int i;
+
+  for (i = 0; i < numSamples + GUARD_SAMPLES; i++) {
+    expected[i] = GUARD_VALUE;
+    actual[i] = GUARD_VALUE;
+  }
+}
+
+/* Return 1 if the outputs match, including their guard samples. */
+static int sameShorts(const short* expected, const short* actual,
+                      int numSamples) {
+  return !memcmp(expected, actual,
+                 (numSamples + GUARD_SAMPLES) * sizeof(short));
+}
+
+/* Return 1 if the float outputs match. */
+static int sameFloats(const float* expected, const float* actual,
+                      int numSamples) {
+  int i;
+
+  for (i = 0; i < numSamples; i++) {
+    if (expected[i] != actual[i]) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/* Fill the inputs for computeDiff, either with random samples, or with
+   opposite extremes, which give the largest possible sum. */
+static void diffInputs(short* s, short* p, int numSamples, int extremes) {
+  int i;
+
+  randomSamples(s, numSamples);
+  randomSamples(p, numSamples);
+  if (extremes) {
+    for (i = 0; i < numSamples; i++) {
+      s[i] = SHRT_MAX;
+      p[i] = SHRT_MIN;
+    }
+  }
+}
+
+/* computeDiffSIMD must match computeDiffScalar. */
+static int sameDiffs(diffFunc computeDiffSIMD, short* s, short* p) {
+  int i, extremes;
+
+  for (extremes = 0; extremes <= 1; extremes++) {
+    for (i = 0; i < NUM_ITEMS(lengths); i++) {
+      diffInputs(s, p, lengths[i], extremes);
+      if (computeDiffSIMD(s, p, lengths[i]) !=
+          computeDiffScalar(s, p, lengths[i])) {
+        return 0;
+      }
+    }
+  }
+  return 1;
+}
+
+/* computeDiffBoundedSIMD must match computeDiffBoundedScalar, both in the sum
+   and in where it stops, for limits it reaches at once, part way through,
+   exactly at the end, and never. */
+static int sameBoundedDiffs(boundedDiffFunc computeDiffBoundedSIMD, short* s,
+                            short* p) {
+  unsigned long total, limits[5];
+  int numExpected, numActual;
+  int i, j, extremes;
+
+  for (extremes = 0; extremes <= 1; extremes++) {
+    for (i = 0; i < NUM_ITEMS(lengths); i++) {
+      diffInputs(s, p, lengths[i], extremes);
+      total = computeDiffScalar(s, p, lengths[i]);
+      limits[0] = 0;
+      limits[1] = 1;
+      limits[2] = total >> 1;
+      limits[3] = total;
+      limits[4] = ULONG_MAX;
+      for (j = 0; j < NUM_ITEMS(limits); j++) {
+        if (computeDiffBoundedSIMD(s, p, lengths[i], limits[j],
+                                   &numActual) !=
+                computeDiffBoundedScalar(s, p, lengths[i], limits[j],
+                                         &numExpected) ||
+            numActual != numExpected) {
+          return 0;
+        }
+      }
+    }
+  }
+  return 1;
+}
+
+/* overlapAddSIMD must match overlapAddScalar for every channel count it
+   vectorizes and one more, which it hands to the scalar version, at every
+   volume.  The multiplier and shift are found the way overlapAdd finds them,
+   except that there are none for an empty overlap. */
+static int sameOverlapAdds(overlapAddFunc overlapAddSIMD, short* rampDown,
+                           short* rampUp, short* expected, short* actual) {
+  unsigned long multiplier;
+  int numChannels, numSamples, i, v, bits, shift;
+
+  for (numChannels = 1; numChannels <= SONIC_MAX_SIMD_OVERLAP_CHANNELS + 1;
+       numChannels++) {
+    for (i = 0; i < NUM_ITEMS(overlaps); i++) {
+      numSamples = overlaps[i];
+      randomSamples(rampDown, numSamples * numChannels);
+      randomSamples(rampUp, numSamples * numChannels);
+      bits = 0;
+      while ((1 << bits) <= numSamples) {
+        bits++;
+      }
+      shift = 15 + 2 * bits;
+      multiplier = 0;
+      if (numSamples > 0) {
+        multiplier =
+            (unsigned long)(((sonicUint64)1 << shift) / numSamples) + 1;
+      }
+      for (v = 0; v < NUM_ITEMS(volumes); v++) {
+        clearOutputs(expected, actual, numSamples * numChannels);
+        overlapAddScalar(expected, rampDown, rampUp, numSamples, numChannels,
+                         multiplier, shift, volumes[v]);
+        overlapAddSIMD(actual, rampDown, rampUp, numSamples, numChannels,
+                       multiplier, shift, volumes[v]);
+        if (!sameShorts(expected, actual, numSamples * numChannels)) {
+          return 0;
+        }
+      }
+    }
+  }
+  return 1;
+}
+
+/* The SSE2 sample scaling and interpolation kernels must match the scalar
+   versions at every volume other than 0, which they are never called with. */
+static int sameScaledSamples(short* in, short* expected, short* actual) {
+  int i, v;
+
+  for (i = 0; i < NUM_ITEMS(lengths); i++) {
+    randomSamples(in, lengths[i]);
+    for (v = 1; v < NUM_ITEMS(volumes); v++) {
+      clearOutputs(expected, actual, lengths[i]);
+      scaleSamplesScalar(expected, in, lengths[i], volumes[v]);
+      scaleSamplesSSE2(actual, in, lengths[i], volumes[v]);
+      if (!sameShorts(expected, actual, lengths[i])) {
+        return 0;
+      }
+    }
+  }
+  return 1;
+}
+
+/* interpolateFrameSSE2 must match interpolateFrameScalar for every number of
+   points up to the most any resampler uses, every channel count, and every
+   volume.  The filters overshoot, so the clipping is tested too. */
+static int sameInterpolatedFrames(short* in, short* expected, short* actual) {
+  short weights[2 * SONIC_HQ_FILTER_POINTS];
+  int numPoints, numChannels, v;
+
+  for (numPoints = 1; numPoints <= SONIC_HQ_FILTER_POINTS; numPoints++) {
+    for (numChannels = 1; numChannels <= SONIC_MAX_CHANNELS; numChannels++) {
+      /* The kernels may read from the frame after the filter. */
+      randomSamples(in, (numPoints + 1) * numChannels);
+      randomWeights(weights, numPoints);
+      for (v = 0; v < NUM_ITEMS(volumes); v++) {
+        clearOutputs(expected, actual, numChannels);
+        interpolateFrameScalar(expected, in, numChannels, weights, numPoints,
+                               volumes[v]);
+        interpolateFrameSSE2(actual, in, numChannels, weights, numPoints,
+                             volumes[v]);
+        if (!sameShorts(expected, actual, numChannels)) {
+          return 0;
+        }
+      }
+    }
+  }
+  return 1;
+}
+
+/* The SSE2 float kernels must match the scalar versions.  They compute the
+   same products and sums, so the results are exactly the same, except that
+   mono interpolation sums its taps in a different order. */
+static int sameFloatKernels(float* in, float* other, float* expected,
+                            float* actual) {
+  short weights[2 * SONIC_HQ_FILTER_POINTS];
+  float error;
+  int numChannels, numPoints, i, v;
+
+  for (numChannels = 1; numChannels <= SONIC_MAX_SIMD_OVERLAP_CHANNELS + 1;
+       numChannels++) {
+    for (i = 0; i < NUM_ITEMS(lengths); i++) {
+      randomFloats(in, lengths[i] * numChannels);
+      randomFloats(other, lengths[i] * numChannels);
+      for (v = 0; v < NUM_ITEMS(floatVolumes); v++) {
+        overlapAddFloatScalar(expected, in, other, lengths[i], numChannels,
+                              floatVolumes[v]);
+        overlapAddFloatSSE2(actual, in, other, lengths[i], numChannels,
+                            floatVolumes[v]);
+        if (!sameFloats(expected, actual, lengths[i] * numChannels)) {
+          return 0;
+        }
+      }
+    }
+  }
+  for (i = 0; i < NUM_ITEMS(lengths); i++) {
+    randomFloats(in, lengths[i]);
+    for (v = 0; v < NUM_ITEMS(floatVolumes); v++) {
+      scaleFloatSamplesScalar(expected, in, lengths[i], floatVolumes[v]);
+      scaleFloatSamplesSSE2(actual, in, lengths[i], floatVolumes[v]);
+      if (!sameFloats(expected, actual, lengths[i])) {
+        return 0;
+      }
+    }
+  }
+  for (numPoints = 1; numPoints <= SONIC_HQ_FILTER_POINTS; numPoints++) {
+    for (numChannels = 1; numChannels <= SONIC_MAX_CHANNELS; numChannels++) {
+      randomFloats(in, (numPoints + 1) * numChannels);
+      randomWeights(weights, numPoints);
+      interpolateFloatFrameScalar(expected, in, numChannels, weights,
+                                  numPoints, 1.0f);
+      interpolateFloatFrameSSE2(actual, in, numChannels, weights, numPoints,
+                                1.0f);
+      if (numChannels != 1) {
+        if (!sameFloats(expected, actual, numChannels)) {
+          return 0;
+        }
+      } else {
+        error = expected[0] - actual[0];
+        if (error > 1e-4f || error < -1e-4f) {
+          return 0;
+        }
+      }
+    }
+  }
+  return 1;
+}
+
+/* The SSE2 conversion kernels must match the scalar versions, including for
+   floats louder than full scale, floats exactly half way between two shorts,
+   and the largest and smallest ints. */
+static int sameConversions(short* shorts, short* expected, short* actual,
+                           float* floats, float* expectedFloats,
+                           float* actualFloats) {
+  unsigned char* bytes = (unsigned char*)floats;
+  unsigned char* expectedBytes = (unsigned char*)expectedFloats;
+  unsigned char* actualBytes = (unsigned char*)actualFloats;
+  int* ints = (int*)floats;
+  int* expectedInts = (int*)expectedFloats;
+  int* actualInts = (int*)actualFloats;
+  int i, j, n;
+
+  for (i = 0; i < NUM_ITEMS(lengths); i++) {
+    n = lengths[i];
+    randomSamples(shorts, n);
+    randomFloats(floats, n);
+    for (j = 0; j < n; j += 3) {
+      floats[j] = (shorts[j] + 0.5f) / 32767.0f;
+    }
+    clearOutputs(expected, actual, n);
+    convertFloatsToShortsScalar(expected, floats, n);
+    convertFloatsToShortsSSE2(actual, floats, n);
+    if (!sameShorts(expected, actual, n)) {
+      return 0;
+    }
+    convertShortsToFloatsScalar(expectedFloats, shorts, n);
+    convertShortsToFloatsSSE2(actualFloats, shorts, n);
+    if (!sameFloats(expectedFloats, actualFloats, n)) {
+      return 0;
+    }
+    for (j = 0; j < n; j++) {
+      bytes[j] = (unsigned char)randomBits();
+    }
+    clearOutputs(expected, actual, n);
+    convertUnsignedCharsToShortsScalar(expected, bytes, n);
+    convertUnsignedCharsToShortsSSE2(actual, bytes, n);
+    if (!sameShorts(expected, actual, n)) {
+      return 0;
+    }
+    convertShortsToUnsignedCharsScalar(expectedBytes, shorts, n);
+    convertShortsToUnsignedCharsSSE2(actualBytes, shorts, n);
+    if (memcmp(expectedBytes, actualBytes, n)) {
+      return 0;
+    }
+    for (j = 0; j < n; j++) {
+      ints[j] = (int)(((unsigned long)randomBits() << 16) | randomBits());
+      if (j % 7 == 0) {
+        ints[j] = j % 2 ? INT_MAX : INT_MIN;
+      }
+    }
+    clearOutputs(expected, actual, n);
+    convertIntsToShortsScalar(expected, ints, n);
+    convertIntsToShortsSSE2(actual, ints, n);
+    if (!sameShorts(expected, actual, n)) {
+      return 0;
+    }
+    convertShortsToIntsScalar(expectedInts, shorts, n);
+    convertShortsToIntsSSE2(actualInts, shorts, n);
+    if (memcmp(expectedInts, actualInts, n * sizeof(int))) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/* Run all the kernel comparisons for the instruction sets this CPU has. */
+static int sameKernels(short* in, short* other, short* expected,
+                       short* actual, float* floats, float* otherFloats,
+                       float* expectedFloats, float* actualFloats) {
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("sse2") &&
+      (!sameDiffs(computeDiffSSE2, in, other) ||
+       !sameBoundedDiffs(computeDiffBoundedSSE2, in, other) ||
+       !sameOverlapAdds(overlapAddSSE2, in, other, expected, actual) ||
+       !sameScaledSamples(in, expected, actual) ||
+       !sameInterpolatedFrames(in, expected, actual) ||
+       !sameFloatKernels(floats, otherFloats, expectedFloats, actualFloats) ||
+       !sameConversions(in, expected, actual, floats, expectedFloats,
+                        actualFloats))) {
+    return 0;
+  }
+  if (__builtin_cpu_supports("avx2") &&
+      (!sameDiffs(computeDiffAVX2, in, other) ||
+       !sameBoundedDiffs(computeDiffBoundedAVX2, in, other) ||
+       !sameOverlapAdds(overlapAddAVX2, in, other, expected, actual))) {
+    return 0;
+  }
+  return 1;
+}
+
+#endif /* SONIC_X86_SIMD */
+
+/* Each SIMD kernel this CPU can run must give exactly the same results as its
+   portable version.  Without SIMD kernels, there is nothing to compare. */
+int sonicTestKernels(void) {
+#ifdef SONIC_X86_SIMD
+  int size = MAX_KERNEL_SAMPLES + GUARD_SAMPLES;
+  short* in = (short*)calloc(size, sizeof(short));
+  short* other = (short*)calloc(size, sizeof(short));
+  short* expected = (short*)calloc(size, sizeof(short));
+  short* actual = (short*)calloc(size, sizeof(short));
+  float* floats = (float*)calloc(size, sizeof(float));
+  float* otherFloats = (float*)calloc(size, sizeof(float));
+  float* expectedFloats = (float*)calloc(size, sizeof(float));
+  float* actualFloats = (float*)calloc(size, sizeof(float));
+  int passed = sameKernels(in, other, expected, actual, floats, otherFloats,
+                           expectedFloats, actualFloats);
+
+  free(in);
+  free(other);
+  free(expected);
+  free(actual);
+  free(floats);
+  free(otherFloats);
+  free(expectedFloats);
+  free(actualFloats);
+  return passed;
+#else
+  return 1;
+#endif /* SONIC_X86_SIMD */
+}
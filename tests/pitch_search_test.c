@@ -0,0 +1,474 @@
+/* Sonic library
+   Copyright 2025
+   Bill Cox
+   This file is part of the Sonic Library.
+
+   This file is licensed under the Apache 2.0 license.
+*/
+
+/* Tests for the optional pitch search modes. */
+
+/* Unfortunate Google compatibility cruft. */
+#ifdef GOOGLE_BUILD
+#include "third_party/sonic/sonic.h"
+#else
+#include "sonic.h"
+#endif
+
+#include "genwave.h"
+#include "tests.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define SAMPLE_RATE 44100
+#define AMPLITUDE 6000
+#define NUM_SEGMENTS 40
+#define SEGMENT_PERIODS 6
+#define MAX_SAMPLES (NUM_SEGMENTS * SEGMENT_PERIODS * (SAMPLE_RATE / 80))
+#define READ_BUF_LEN 1000
+#define SWAP_FRAMES 2500
+
+/* A function that enables a pitch search mode on a stream. */
+typedef void (*configureFunc)(sonicStream stream);
+
+/* Generate a crude voice: sine waves whose period glides up and down, with
+   some silence.  Return the number of samples generated. */
+static int genVoice(short* samples, int maxSamples) {
+  int numSamples = 0;
+  int i, period;
+
+  for (i = 0; i < NUM_SEGMENTS; i++) {
+    period = SAMPLE_RATE / (100 + 10 * (i % 15));
+    if (i % 10 == 9) {
+      memset(samples + numSamples, 0,
+             SEGMENT_PERIODS * period * sizeof(short));
+      numSamples += SEGMENT_PERIODS * period;
+    } else {
+      numSamples += genSineWave(samples + numSamples, maxSamples - numSamples,
+                                SAMPLE_RATE, period, AMPLITUDE,
+                                SEGMENT_PERIODS);
+    }
+  }
+  return numSamples;
+}
+
+/* Run the samples through a new stream that searches pitchChannel for the
+   pitch period, and return the output.  Each channel is quieter than the one
+   before, except that if rotate is set and the loudest channel is searched,
+   the order rotates every SWAP_FRAMES frames, so the loudest channel keeps
+   changing.  Set *numOutputSamples to the number of samples returned.  The
+   caller must free the result. */
+static short* processSamplesOnChannel(const short* samples, int numSamples,
+                                      int numChannels, float speed,
+                                      int quality, int pitchChannel,
+                                      int rotate, configureFunc configure,
+                                      int* numOutputSamples) {
+  sonicStream stream = sonicCreateStream(SAMPLE_RATE, numChannels);
+  int maxOutput = (int)(numSamples / speed) + SAMPLE_RATE;
+  short* output = (short*)calloc(maxOutput * numChannels, sizeof(short));
+  short* input = (short*)calloc(numSamples * numChannels, sizeof(short));
+  int i, j, rank, total = 0, samplesRead;
+
+  for (i = 0; i < numSamples; i++) {
+    for (j = 0; j < numChannels; j++) {
+      rank = j;
+      if (rotate && pitchChannel == SONIC_PITCH_CHANNEL_LOUDEST) {
+        rank = (j + i / SWAP_FRAMES) % numChannels;
+      }
+      input[i * numChannels + j] = samples[i] / (rank + 1);
+    }
+  }
+  sonicSetSpeed(stream, speed);
+  sonicSetQuality(stream, quality);
+  sonicSetPitchChannel(stream, pitchChannel);
+  if (configure != NULL) {
+    configure(stream);
+  }
+  for (i = 0; i < numSamples; i += READ_BUF_LEN) {
+    j = numSamples - i < READ_BUF_LEN ? numSamples - i : READ_BUF_LEN;
+    sonicWriteShortToStream(stream, input + i * numChannels, j);
+    do {
+      samplesRead = sonicReadShortFromStream(
+          stream, output + total * numChannels, maxOutput - total);
+      total += samplesRead;
+    } while (samplesRead > 0);
+  }
+  sonicFlushStream(stream);
+  total += sonicReadShortFromStream(stream, output + total * numChannels,
+                                    maxOutput - total);
+  sonicDestroyStream(stream);
+  free(input);
+  *numOutputSamples = total;
+  return output;
+}
+
+/* Run the samples through a new stream that mixes the channels to search for
+   the pitch period, and return the output. */
+static short* processSamples(const short* samples, int numSamples,
+                             int numChannels, float speed, int quality,
+                             configureFunc configure, int* numOutputSamples) {
+  return processSamplesOnChannel(samples, numSamples, numChannels, speed,
+                                 quality, SONIC_PITCH_CHANNEL_MIX, 0,
+                                 configure, numOutputSamples);
+}
+
+/* Return 1 if the stream produces exactly the same output for the samples with
+   configure applied as without, over a range of speeds, qualities and
+   channels, and when mixing the channels or searching the loudest one.  If
+   rotate is set, the loudest channel keeps changing. */
+static int sameOutput(const short* samples, int numSamples, int rotate,
+                      configureFunc configure) {
+  static const float speeds[] = {0.3f, 0.6f, 1.5f, 3.0f};
+  static const int pitchChannels[] = {SONIC_PITCH_CHANNEL_MIX,
+                                      SONIC_PITCH_CHANNEL_LOUDEST};
+  short *expected, *actual;
+  int numExpected, numActual;
+  int s, quality, numChannels, c, same = 1;
+
+  for (s = 0; s < sizeof(speeds) / sizeof(speeds[0]); s++) {
+    for (quality = 0; quality <= 1; quality++) {
+      for (numChannels = 1; numChannels <= 2; numChannels++) {
+        for (c = 0; c < numChannels; c++) {
+          expected = processSamplesOnChannel(samples, numSamples, numChannels,
+                                             speeds[s], quality,
+                                             pitchChannels[c], rotate, NULL,
+                                             &numExpected);
+          actual = processSamplesOnChannel(samples, numSamples, numChannels,
+                                           speeds[s], quality,
+                                           pitchChannels[c], rotate,
+                                           configure, &numActual);
+          if (numExpected != numActual ||
+              memcmp(expected, actual,
+                     numExpected * numChannels * sizeof(short))) {
+            same = 0;
+          }
+          free(expected);
+          free(actual);
+        }
+      }
+    }
+  }
+  return same;
+}
+
+/* Return 1 if configure does not change the output for a voice-like signal. */
+static int outputUnchanged(configureFunc configure) {
+  short* samples = (short*)calloc(MAX_SAMPLES, sizeof(short));
+  int numSamples = genVoice(samples, MAX_SAMPLES);
+  int same = sameOutput(samples, numSamples, 1, configure);
+
+  free(samples);
+  return same;
+}
+
+static void enableIncrementalPitchSearch(sonicStream stream) {
+  sonicSetIncrementalPitchSearch(stream, 1);
+}
+
+/* Run stereo samples through a stream that searches the first channel for
+   the pitch period, and then the second from halfway through.  Return the
+   number of samples of output, which is written to output. */
+static int processSwitchingChannel(const short* samples, int numSamples,
+                                   int incremental, short* output,
+                                   int maxOutput) {
+  sonicStream stream = sonicCreateStream(SAMPLE_RATE, 2);
+  int i, count, total = 0;
+
+  sonicSetSpeed(stream, 0.3f);
+  sonicSetQuality(stream, 1);
+  sonicSetIncrementalPitchSearch(stream, incremental);
+  sonicSetPitchChannel(stream, 0);
+  for (i = 0; i < numSamples; i += count) {
+    count = numSamples - i < READ_BUF_LEN ? numSamples - i : READ_BUF_LEN;
+    if (i >= numSamples / 2) {
+      sonicSetPitchChannel(stream, 1);
+    }
+    sonicWriteShortToStream(stream, samples + 2 * i, count);
+    total += sonicReadShortFromStream(stream, output + 2 * total,
+                                      maxOutput - total);
+  }
+  sonicFlushStream(stream);
+  total += sonicReadShortFromStream(stream, output + 2 * total,
+                                    maxOutput - total);
+  sonicDestroyStream(stream);
+  return total;
+}
+
+/* The incremental pitch search must find exactly the same periods as the full
+   search, even when the channel searched changes. */
+int sonicTestIncrementalPitchSearch(void) {
+  sonicStream stream = sonicCreateStream(SAMPLE_RATE, 1);
+  short *samples, *stereo, *expected, *actual;
+  int i, numSamples, maxOutput, numExpected, numActual, passed;
+
+  if (sonicGetIncrementalPitchSearch(stream) != 0 ||
+      !sonicSetIncrementalPitchSearch(stream, 1) ||
+      sonicGetIncrementalPitchSearch(stream) != 1) {
+    return 0;
+  }
+  sonicDestroyStream(stream);
+  if (!outputUnchanged(enableIncrementalPitchSearch)) {
+    return 0;
+  }
+  /* The channels differ, so the sums of one must not be reused for the
+     other. */
+  samples = (short*)calloc(MAX_SAMPLES, sizeof(short));
+  numSamples = genVoice(samples, MAX_SAMPLES);
+  stereo = (short*)calloc(2 * numSamples, sizeof(short));
+  for (i = 0; i < numSamples; i++) {
+    stereo[2 * i] = samples[i];
+    stereo[2 * i + 1] = samples[numSamples - 1 - i];
+  }
+  maxOutput = 4 * numSamples;
+  expected = (short*)calloc(2 * maxOutput, sizeof(short));
+  actual = (short*)calloc(2 * maxOutput, sizeof(short));
+  numExpected = processSwitchingChannel(stereo, numSamples, 0, expected,
+                                        maxOutput);
+  numActual = processSwitchingChannel(stereo, numSamples, 1, actual,
+                                      maxOutput);
+  passed = numExpected == numActual &&
+           !memcmp(expected, actual, 2 * numExpected * sizeof(short));
+  free(samples);
+  free(stereo);
+  free(expected);
+  free(actual);
+  return passed;
+}
+
+static void enablePitchTracking(sonicStream stream) {
+  sonicSetPitchTracking(stream, 1);
+}
+
+/* Pitch tracking should find the same period as a full search for a steady
+   tone, and should keep the output length right for a voice.  Rotating the
+   loudest channel would step the tone's volume, so it is not done here. */
+int sonicTestPitchTracking(void) {
+  short* samples = (short*)calloc(MAX_SAMPLES, sizeof(short));
+  int numSamples = genSineWave(samples, MAX_SAMPLES, SAMPLE_RATE,
+                               SAMPLE_RATE / 200, AMPLITUDE, 400);
+  short* output;
+  int numOutputSamples, expectedSamples;
+
+  if (!sameOutput(samples, numSamples, 0, enablePitchTracking)) {
+    return 0;
+  }
+  numSamples = genVoice(samples, MAX_SAMPLES);
+  output = processSamples(samples, numSamples, 1, 1.5f, 1, enablePitchTracking,
+                          &numOutputSamples);
+  free(output);
+  free(samples);
+  expectedSamples = (int)(numSamples / 1.5f);
+  return numOutputSamples > expectedSamples - SAMPLE_RATE / 100 &&
+         numOutputSamples < expectedSamples + SAMPLE_RATE / 100;
+}
+
+static void useLoudestChannel(sonicStream stream) {
+  sonicSetPitchChannel(stream, SONIC_PITCH_CHANNEL_LOUDEST);
+}
+
+static void useFirstChannel(sonicStream stream) {
+  sonicSetPitchChannel(stream, 0);
+}
+
+/* processSamples makes the first channel the loudest, so searching the loudest
+   channel should give the same output as searching the first, and the output
+   length should be right. */
+int sonicTestPitchChannel(void) {
+  sonicStream stream = sonicCreateStream(SAMPLE_RATE, 2);
+  short* samples;
+  short *loudest, *first;
+  int numSamples, numLoudest, numFirst, expectedSamples, quality;
+  int passed = 1;
+
+  if (sonicGetPitchChannel(stream) != SONIC_PITCH_CHANNEL_MIX) {
+    return 0;
+  }
+  sonicSetPitchChannel(stream, 1);
+  if (sonicGetPitchChannel(stream) != 1) {
+    return 0;
+  }
+  sonicDestroyStream(stream);
+  samples = (short*)calloc(MAX_SAMPLES, sizeof(short));
+  numSamples = genVoice(samples, MAX_SAMPLES);
+  expectedSamples = (int)(numSamples / 1.5f);
+  for (quality = 0; quality <= 1; quality++) {
+    loudest = processSamples(samples, numSamples, 2, 1.5f, quality,
+                             useLoudestChannel, &numLoudest);
+    first = processSamples(samples, numSamples, 2, 1.5f, quality,
+                           useFirstChannel, &numFirst);
+    if (numLoudest != numFirst ||
+        memcmp(loudest, first, numFirst * 2 * sizeof(short)) ||
+        numFirst <= expectedSamples - SAMPLE_RATE / 100 ||
+        numFirst >= expectedSamples + SAMPLE_RATE / 100) {
+      passed = 0;
+    }
+    free(loudest);
+    free(first);
+  }
+  free(samples);
+  return passed;
+}
+
+static void disableSilenceFastPath(sonicStream stream) {
+  sonicSetSilenceThreshold(stream, -1);
+}
+
+/* Digital silence should take the fast path, without changing the output. */
+int sonicTestSilenceFastPath(void) {
+  sonicStream stream = sonicCreateStream(SAMPLE_RATE, 1);
+  short* samples = (short*)calloc(MAX_SAMPLES, sizeof(short));
+  int numSamples = genVoice(samples, MAX_SAMPLES);
+  long silentSamples;
+
+  if (sonicGetSilenceThreshold(stream) != 0) {
+    return 0;
+  }
+  sonicSetSpeed(stream, 2.0f);
+  sonicWriteShortToStream(stream, samples, numSamples);
+  sonicFlushStream(stream);
+  silentSamples = sonicGetSilentSamples(stream);
+  sonicDestroyStream(stream);
+  free(samples);
+  return silentSamples > 0 && outputUnchanged(disableSilenceFastPath);
+}
+
+static void enablePitchPyramid(sonicStream stream) {
+  sonicSetPitchPyramid(stream, 1);
+}
+
+/* The pitch pyramid should find the same period as a full search for a steady
+   tone, and should keep the output length right for a voice. */
+int sonicTestPitchPyramid(void) {
+  sonicStream stream = sonicCreateStream(SAMPLE_RATE, 1);
+  short* samples;
+  short* output;
+  int numSamples, numOutputSamples, expectedSamples, numChannels;
+  int passed = 1;
+
+  if (sonicGetPitchPyramid(stream) != 0) {
+    return 0;
+  }
+  sonicSetPitchPyramid(stream, 1);
+  if (sonicGetPitchPyramid(stream) != 1) {
+    return 0;
+  }
+  sonicDestroyStream(stream);
+  samples = (short*)calloc(MAX_SAMPLES, sizeof(short));
+  numSamples = genSineWave(samples, MAX_SAMPLES, SAMPLE_RATE,
+                           SAMPLE_RATE / 200, AMPLITUDE, 400);
+  if (!sameOutput(samples, numSamples, 0, enablePitchPyramid)) {
+    passed = 0;
+  }
+  numSamples = genVoice(samples, MAX_SAMPLES);
+  expectedSamples = (int)(numSamples / 1.5f);
+  for (numChannels = 1; numChannels <= 2; numChannels++) {
+    output = processSamples(samples, numSamples, numChannels, 1.5f, 0,
+                            enablePitchPyramid, &numOutputSamples);
+    free(output);
+    if (numOutputSamples <= expectedSamples - SAMPLE_RATE / 100 ||
+        numOutputSamples >= expectedSamples + SAMPLE_RATE / 100) {
+      passed = 0;
+    }
+  }
+  free(samples);
+  return passed;
+}
+
+static void enablePitchPruning(sonicStream stream) {
+  sonicSetPitchPruning(stream, 1);
+}
+
+/* The pruned pitch search must find exactly the same periods as the full
+   search, and should skip some of the work on a voice. */
+int sonicTestPitchPruning(void) {
+  sonicStream stream = sonicCreateStream(SAMPLE_RATE, 1);
+  short* samples = (short*)calloc(MAX_SAMPLES, sizeof(short));
+  int numSamples = genVoice(samples, MAX_SAMPLES);
+  long samplesPruned;
+
+  if (sonicGetPitchPruning(stream) != 0 ||
+      !sonicSetPitchPruning(stream, 1) || sonicGetPitchPruning(stream) != 1) {
+    return 0;
+  }
+  sonicSetSpeed(stream, 1.5f);
+  sonicSetQuality(stream, 1);
+  sonicWriteShortToStream(stream, samples, numSamples);
+  sonicFlushStream(stream);
+  samplesPruned = sonicGetPitchSamplesPruned(stream);
+  sonicDestroyStream(stream);
+  free(samples);
+  return samplesPruned > 0 && outputUnchanged(enablePitchPruning);
+}
+
+static void enableFFTPitchDetector(sonicStream stream) {
+  sonicSetPitchDetector(stream, SONIC_PITCH_DETECTOR_FFT);
+}
+
+/* Return 1 if the first channel of the samples repeats every period frames,
+   ignoring the first and last tenth, where the stream starts and stops.
+   Skipping or inserting a whole period of a steady tone leaves it exactly
+   periodic, but a wrong period leaves a step in the wave. */
+static int isPeriodic(const short* samples, int numSamples, int numChannels,
+                      int period) {
+  int i;
+
+  for (i = numSamples / 10; i < numSamples - numSamples / 10 - period; i++) {
+    if (samples[i * numChannels] != samples[(i + period) * numChannels]) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/* The FFT pitch detector finds its period differently than the AMDF search, so
+   its output can differ.  It should still skip and insert whole periods of a
+   steady tone, and keep the output length right for a voice, for both
+   qualities and with more than one channel. */
+int sonicTestFFTPitchDetector(void) {
+  static const float speeds[] = {0.6f, 1.5f};
+  sonicStream stream = sonicCreateStream(SAMPLE_RATE, 1);
+  short* samples;
+  short* output;
+  int numSamples, numOutputSamples, expectedSamples;
+  int s, quality, numChannels, passed = 1;
+
+  if (sonicGetPitchDetector(stream) != SONIC_PITCH_DETECTOR_AMDF ||
+      !sonicSetPitchDetector(stream, SONIC_PITCH_DETECTOR_FFT) ||
+      sonicGetPitchDetector(stream) != SONIC_PITCH_DETECTOR_FFT) {
+    return 0;
+  }
+  sonicDestroyStream(stream);
+  samples = (short*)calloc(MAX_SAMPLES, sizeof(short));
+  numSamples = genSineWave(samples, MAX_SAMPLES, SAMPLE_RATE,
+                           SAMPLE_RATE / 200, AMPLITUDE, 400);
+  for (s = 0; s < sizeof(speeds) / sizeof(speeds[0]); s++) {
+    for (quality = 0; quality <= 1; quality++) {
+      for (numChannels = 1; numChannels <= 2; numChannels++) {
+        output = processSamples(samples, numSamples, numChannels, speeds[s],
+                                quality, enableFFTPitchDetector,
+                                &numOutputSamples);
+        if (!isPeriodic(output, numOutputSamples, numChannels,
+                        SAMPLE_RATE / 200)) {
+          passed = 0;
+        }
+        free(output);
+      }
+    }
+  }
+  numSamples = genVoice(samples, MAX_SAMPLES);
+  expectedSamples = (int)(numSamples / 1.5f);
+  for (quality = 0; quality <= 1; quality++) {
+    for (numChannels = 1; numChannels <= 2; numChannels++) {
+      output = processSamples(samples, numSamples, numChannels, 1.5f, quality,
+                              enableFFTPitchDetector, &numOutputSamples);
+      free(output);
+      if (numOutputSamples <= expectedSamples - SAMPLE_RATE / 100 ||
+          numOutputSamples >= expectedSamples + SAMPLE_RATE / 100) {
+        passed = 0;
+      }
+    }
+  }
+  free(samples);
+  return passed;
+}
@@ -0,0 +1,148 @@
+/* Sonic library
+   Copyright 2025
+   Bill Cox
+   This file is part of the Sonic Library.
+
+   This file is licensed under the Apache 2.0 license.
+*/
+
+/* Tests for the resamplers used for rate and pitch changes. */
+
+/* Unfortunate Google compatibility cruft. */
+#ifdef GOOGLE_BUILD
+#include "third_party/sonic/sonic.h"
+#else
+#include "sonic.h"
+#endif
+
+#include "tests.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+#define SAMPLE_RATE 44100
+#define NUM_SAMPLES (SAMPLE_RATE / 2)
+#define DC_VALUE 10000
+/* An 18375 Hz tone, which aliases down to 7350 Hz when the rate is 2. */
+#define TONE_PERIOD 2.4
+#define TONE_AMPLITUDE 10000
+
+/* Resample the samples by rate with the given resampler, and return the
+   output.  Set *numOutputSamples to the number of samples returned.  The
+   caller must free the result. */
+static short* resample(const short* samples, int numSamples, float rate,
+                       int resampler, int* numOutputSamples) {
+  sonicStream stream = sonicCreateStream(SAMPLE_RATE, 1);
+  int maxSamples = numSamples / rate + SAMPLE_RATE;
+  short* output = (short*)calloc(maxSamples, sizeof(short));
+  int numOutput = 0;
+
+  sonicSetRate(stream, rate);
+  sonicSetResampler(stream, resampler);
+  sonicWriteShortToStream(stream, samples, numSamples);
+  sonicFlushStream(stream);
+  numOutput = sonicReadShortFromStream(stream, output, maxSamples);
+  sonicDestroyStream(stream);
+  *numOutputSamples = numOutput;
+  return output;
+}
+
+/* Return the RMS value of the middle half of the samples. */
+static double middleRMS(const short* samples, int numSamples) {
+  double sum = 0.0;
+  int i;
+
+  for (i = numSamples / 4; i < 3 * numSamples / 4; i++) {
+    sum += (double)samples[i] * samples[i];
+  }
+  return sqrt(sum / (numSamples / 2));
+}
+
+/* Check that every resampler passes a constant signal unchanged, except the
+   sinc filter, whose gain varies slightly with the phase. */
+static int checkConstantSignal(int resampler) {
+  short* samples = (short*)calloc(NUM_SAMPLES, sizeof(short));
+  short* output;
+  int maxError = resampler == SONIC_RESAMPLER_SINC ? 50 : 1;
+  int numOutput, i, error, passed = 1;
+
+  for (i = 0; i < NUM_SAMPLES; i++) {
+    samples[i] = DC_VALUE;
+  }
+  output = resample(samples, NUM_SAMPLES, 0.7f, resampler, &numOutput);
+  if (numOutput < NUM_SAMPLES / 0.7f - 100) {
+    fprintf(stderr, "Resampler %d: only %d output samples\n", resampler,
+            numOutput);
+    passed = 0;
+  }
+  for (i = numOutput / 4; passed && i < 3 * numOutput / 4; i++) {
+    error = abs(output[i] - DC_VALUE);
+    if (error > maxError) {
+      fprintf(stderr, "Resampler %d: sample %d is %d\n", resampler, i,
+              output[i]);
+      passed = 0;
+    }
+  }
+  free(samples);
+  free(output);
+  return passed;
+}
+
+/* Return the RMS of a tone above the new Nyquist frequency after raising the
+   rate, which is what aliases into the output. */
+static double findAliasedRMS(int resampler) {
+  short* samples = (short*)calloc(NUM_SAMPLES, sizeof(short));
+  short* output;
+  double rms;
+  int numOutput, i;
+
+  for (i = 0; i < NUM_SAMPLES; i++) {
+    samples[i] = TONE_AMPLITUDE * sin(2.0 * M_PI * i / TONE_PERIOD);
+  }
+  output = resample(samples, NUM_SAMPLES, 2.0f, resampler, &numOutput);
+  rms = middleRMS(output, numOutput);
+  free(samples);
+  free(output);
+  return rms;
+}
+
+int sonicTestResampler(void) {
+  sonicStream stream = sonicCreateStream(SAMPLE_RATE, 1);
+  int resampler;
+  double linearAliasing, highQualityAliasing;
+
+  if (sonicGetResampler(stream) != SONIC_RESAMPLER_SINC) {
+    fprintf(stderr, "The default resampler should be SONIC_RESAMPLER_SINC\n");
+    return 0;
+  }
+  sonicSetResampler(stream, SONIC_RESAMPLER_CUBIC);
+  if (sonicGetResampler(stream) != SONIC_RESAMPLER_CUBIC) {
+    fprintf(stderr, "sonicSetResampler failed\n");
+    return 0;
+  }
+  sonicSetResampler(stream, 42);
+  if (sonicGetResampler(stream) != SONIC_RESAMPLER_SINC) {
+    fprintf(stderr, "Unknown resamplers should select SONIC_RESAMPLER_SINC\n");
+    return 0;
+  }
+  sonicDestroyStream(stream);
+  for (resampler = SONIC_RESAMPLER_LINEAR;
+       resampler <= SONIC_RESAMPLER_HIGH_QUALITY; resampler++) {
+    if (!checkConstantSignal(resampler)) {
+      return 0;
+    }
+  }
+  linearAliasing = findAliasedRMS(SONIC_RESAMPLER_LINEAR);
+  highQualityAliasing = findAliasedRMS(SONIC_RESAMPLER_HIGH_QUALITY);
+  if (highQualityAliasing * 10.0 > linearAliasing) {
+    fprintf(stderr, "Aliasing: linear %f, high quality %f\n", linearAliasing,
+            highQualityAliasing);
+    return 0;
+  }
+  return 1;
+}
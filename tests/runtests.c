@@ -14,12 +14,36 @@
 #include <stdio.h>
 
 int main(int argc, char** argv) {
+  /* These run first, so their threads are the first to call into the library,
+     as they would be in a fresh process. */
+  assert(sonicTestParallelSpeed());
+  assert(sonicTestScheduler());
   assert(sonicTestInputClamping());
   assert(sonicTestInputsDontCrash());
+  assert(sonicTestExtremeSpeedsAtLowRate());
   assert(sonicTestStreamCreation());
   assert(sonicTestParameters());
   assert(sonicTestFlush());
   assert(sonicTestSimpleProcessing());
+  assert(sonicTestPeekOutput());
+  assert(sonicTestAcquireInput());
+  assert(sonicTestStreamInBuffer());
+  assert(sonicTestStreamInBufferSettings());
+  assert(sonicTestResetStream());
+  assert(sonicTestStreamPool());
+  assert(sonicTestMaxMemory());
+  assert(sonicTestFloatProcessing());
+  assert(sonicTestPlanarIO());
+  assert(sonicTestSampleFormats());
+  assert(sonicTestIncrementalPitchSearch());
+  assert(sonicTestPitchTracking());
+  assert(sonicTestPitchPruning());
+  assert(sonicTestPitchChannel());
+  assert(sonicTestPitchPyramid());
+  assert(sonicTestSilenceFastPath());
+  assert(sonicTestFFTPitchDetector());
+  assert(sonicTestResampler());
+  assert(sonicTestKernels());
   printf("All tests passed.\n");
   return 0;
 }
@@ -8,6 +8,7 @@
 
 #include "sonic.h"
 #include "tests.h"
+#include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -94,3 +95,830 @@ int sonicTestSimpleProcessing(void) {
     sonicDestroyStream(stream);
     return 1;
 }
+
+int sonicTestPeekOutput(void) {
+    sonicStream readStream = sonicCreateStream(SAMPLE_RATE, NUM_CHANNELS);
+    sonicStream peekStream = sonicCreateStream(SAMPLE_RATE, NUM_CHANNELS);
+    short input[1000 * NUM_CHANNELS];
+    short output[100 * NUM_CHANNELS];
+    const short* peeked;
+    int i, numRead, numPeeked, passed = 1;
+
+    for (i = 0; i < 1000 * NUM_CHANNELS; i++) {
+        input[i] = (i * 37) % 2000 - 1000;
+    }
+    sonicSetSpeed(readStream, 1.5f);
+    sonicSetSpeed(peekStream, 1.5f);
+    for (i = 0; i < 20 && passed; i++) {
+        sonicWriteShortToStream(readStream, input, 1000);
+        sonicWriteShortToStream(peekStream, input, 1000);
+        if (i == 19) {
+            sonicFlushStream(readStream);
+            sonicFlushStream(peekStream);
+        }
+        while (passed &&
+               (numRead = sonicReadShortFromStream(readStream, output,
+                                                   100)) > 0) {
+            numPeeked = sonicPeekOutput(peekStream, &peeked);
+            if (numPeeked < numRead ||
+                memcmp(peeked, output,
+                       numRead * NUM_CHANNELS * sizeof(short))) {
+                fprintf(stderr, "sonicPeekOutput does not match the output "
+                        "of sonicReadShortFromStream\n");
+                passed = 0;
+            }
+            sonicConsumeOutput(peekStream, numRead);
+        }
+    }
+    if (passed && sonicPeekOutput(peekStream, &peeked) != 0) {
+        fprintf(stderr, "sonicConsumeOutput left samples behind\n");
+        passed = 0;
+    }
+    sonicConsumeOutput(peekStream, 10);
+    if (sonicSamplesAvailable(peekStream) != 0) {
+        passed = 0;
+    }
+    sonicDestroyStream(readStream);
+    sonicDestroyStream(peekStream);
+    return passed;
+}
+
+int sonicTestAcquireInput(void) {
+    sonicStream writeStream = sonicCreateStream(SAMPLE_RATE, NUM_CHANNELS);
+    sonicStream acquireStream = sonicCreateStream(SAMPLE_RATE, NUM_CHANNELS);
+    short input[1000 * NUM_CHANNELS];
+    short expected[4000 * NUM_CHANNELS];
+    short output[4000 * NUM_CHANNELS];
+    short* buffer;
+    int i, numExpected, numOutput, passed = 1;
+
+    for (i = 0; i < 1000 * NUM_CHANNELS; i++) {
+        input[i] = (i * 53) % 3000 - 1500;
+    }
+    sonicSetSpeed(writeStream, 0.7f);
+    sonicSetSpeed(acquireStream, 0.7f);
+    for (i = 0; i < 20 && passed; i++) {
+        sonicWriteShortToStream(writeStream, input, 1000);
+        if (sonicAcquireInput(acquireStream, 1000, &buffer) < 1000) {
+            fprintf(stderr, "sonicAcquireInput returned too little room\n");
+            passed = 0;
+            break;
+        }
+        memcpy(buffer, input, sizeof(input));
+        sonicCommitInput(acquireStream, 1000);
+        numExpected = sonicReadShortFromStream(writeStream, expected, 4000);
+        numOutput = sonicReadShortFromStream(acquireStream, output, 4000);
+        if (numOutput != numExpected ||
+            memcmp(output, expected,
+                   numOutput * NUM_CHANNELS * sizeof(short))) {
+            fprintf(stderr, "sonicCommitInput does not match the output "
+                    "of sonicWriteShortToStream\n");
+            passed = 0;
+        }
+    }
+    sonicDestroyStream(writeStream);
+    sonicDestroyStream(acquireStream);
+    return passed;
+}
+
+int sonicTestStreamInBuffer(void) {
+    size_t size = sonicStreamMemoryRequired(SAMPLE_RATE, NUM_CHANNELS, 500);
+    unsigned char* memory1 = (unsigned char*)malloc(size + 1);
+    unsigned char* memory2 = (unsigned char*)malloc(size);
+    sonicStream heapStream = sonicCreateStream(SAMPLE_RATE, NUM_CHANNELS);
+    /* Make sure misaligned blocks work. */
+    sonicStream stream1 = sonicCreateStreamInBuffer(memory1 + 1, size,
+                                                    SAMPLE_RATE, NUM_CHANNELS,
+                                                    500);
+    sonicStream stream2 = sonicCreateStreamInBuffer(memory2, size,
+                                                    SAMPLE_RATE, NUM_CHANNELS,
+                                                    500);
+    short input[500 * NUM_CHANNELS];
+    short expected[2000 * NUM_CHANNELS];
+    short output[2000 * NUM_CHANNELS];
+    int i, numExpected, passed = 1;
+
+    if (stream1 == NULL || stream2 == NULL) {
+        fprintf(stderr, "sonicCreateStreamInBuffer failed\n");
+        return 0;
+    }
+    if (sonicCreateStreamInBuffer(memory2, 100, SAMPLE_RATE, NUM_CHANNELS,
+                                  500) != NULL) {
+        fprintf(stderr, "sonicCreateStreamInBuffer accepted a tiny block\n");
+        return 0;
+    }
+    for (i = 0; i < 500 * NUM_CHANNELS; i++) {
+        input[i] = (i * 71) % 4000 - 2000;
+    }
+    sonicSetSpeed(heapStream, 0.6f);
+    sonicSetSpeed(stream1, 0.6f);
+    sonicSetSpeed(stream2, 0.6f);
+    for (i = 0; i < 40 && passed; i++) {
+        sonicWriteShortToStream(heapStream, input, 500);
+        numExpected = sonicReadShortFromStream(heapStream, expected, 2000);
+        if (!sonicWriteShortToStream(stream1, input, 500) ||
+            !sonicWriteShortToStream(stream2, input, 500) ||
+            sonicReadShortFromStream(stream1, output, 2000) != numExpected ||
+            memcmp(output, expected,
+                   numExpected * NUM_CHANNELS * sizeof(short)) ||
+            sonicReadShortFromStream(stream2, output, 2000) != numExpected ||
+            memcmp(output, expected,
+                   numExpected * NUM_CHANNELS * sizeof(short))) {
+            fprintf(stderr, "Streams in buffers do not match the heap\n");
+            passed = 0;
+        }
+    }
+    sonicDestroyStream(heapStream);
+    sonicDestroyStream(stream1);
+    sonicDestroyStream(stream2);
+    free(memory1);
+    free(memory2);
+    return passed;
+}
+
+/* Write the input to a stream in a buffer and to one on the heap, and return
+   1 if they give the same output. */
+static int matchesHeapStream(sonicStream stream, sonicStream heapStream,
+                             const short* input, int numSamples) {
+    int numChannels = sonicGetNumChannels(stream);
+    short expected[2000 * 2];
+    short output[2000 * 2];
+    int i, numExpected;
+
+    for (i = 0; i < 10; i++) {
+        sonicWriteShortToStream(heapStream, input, numSamples);
+        numExpected = sonicReadShortFromStream(heapStream, expected, 2000);
+        if (!sonicWriteShortToStream(stream, input, numSamples) ||
+            sonicReadShortFromStream(stream, output, 2000) != numExpected ||
+            memcmp(output, expected,
+                   numExpected * numChannels * sizeof(short))) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+int sonicTestStreamInBufferSettings(void) {
+    size_t size = sonicStreamMemoryRequired(22050, 2, 500);
+    unsigned char* memory = (unsigned char*)malloc(size);
+    sonicStream stream = sonicCreateStreamInBuffer(memory, size, 22050, 1,
+                                                   500);
+    sonicStream heapStream = sonicCreateStream(22050, 1);
+    short input[500 * 2];
+    int i, passed = 1;
+
+    for (i = 0; i < 500 * 2; i++) {
+        input[i] = (i * 71) % 4000 - 2000;
+    }
+    sonicSetSpeed(stream, 0.6f);
+    sonicSetSpeed(heapStream, 0.6f);
+    /* Changing the sample rate or number of channels reuses the block. */
+    sonicSetSampleRate(stream, 22050);
+    sonicSetSampleRate(heapStream, 22050);
+    if (!matchesHeapStream(stream, heapStream, input, 500)) {
+        fprintf(stderr, "Stream in buffer fails after setting the rate\n");
+        passed = 0;
+    }
+    sonicSetNumChannels(stream, 2);
+    sonicSetNumChannels(heapStream, 2);
+    if (sonicGetNumChannels(stream) != 2 ||
+        !matchesHeapStream(stream, heapStream, input, 500)) {
+        fprintf(stderr, "Stream in buffer fails after adding a channel\n");
+        passed = 0;
+    }
+    sonicSetSampleRate(stream, 16000);
+    sonicSetSampleRate(heapStream, 16000);
+    if (sonicGetSampleRate(stream) != 16000 ||
+        !matchesHeapStream(stream, heapStream, input, 500)) {
+        fprintf(stderr, "Stream in buffer fails at a lower rate\n");
+        passed = 0;
+    }
+    /* A rate the block is too small for leaves the stream as it was. */
+    sonicSetSampleRate(stream, 96000);
+    if (sonicGetSampleRate(stream) != 16000 ||
+        !sonicWriteShortToStream(stream, input, 500)) {
+        fprintf(stderr, "Stream in buffer changed to a rate that won't fit\n");
+        passed = 0;
+    }
+    sonicDestroyStream(stream);
+    sonicDestroyStream(heapStream);
+    free(memory);
+    /* The same goes when only an optional buffer, here the FFT pitch
+       detector's, does not fit. */
+    size = 2 * sonicStreamMemoryRequired(8000, 1, 1000);
+    memory = (unsigned char*)malloc(size);
+    stream = sonicCreateStreamInBuffer(memory, size, 8000, 1, 1000);
+    sonicSetPitchDetector(stream, SONIC_PITCH_DETECTOR_FFT);
+    sonicSetNumChannels(stream, 2);
+    if (sonicGetNumChannels(stream) != 1 ||
+        !sonicWriteShortToStream(stream, input, 500) ||
+        !sonicWriteShortToStream(stream, input, 500)) {
+        fprintf(stderr, "Stream in buffer changed to channels that won't "
+                "fit\n");
+        passed = 0;
+    }
+    sonicDestroyStream(stream);
+    free(memory);
+    return passed;
+}
+
+/* Process the input with a stream at speed 1.5 and pitch 0.8, and return the
+   number of samples of output. */
+static int processWithStream(sonicStream stream, const short* input,
+                             int numSamples, short* output, int maxSamples) {
+    sonicSetSpeed(stream, 1.5f);
+    sonicSetPitch(stream, 0.8f);
+    sonicWriteShortToStream(stream, input, numSamples);
+    sonicFlushStream(stream);
+    return sonicReadShortFromStream(stream, output, maxSamples);
+}
+
+int sonicTestResetStream(void) {
+    sonicStream stream = sonicCreateStream(SAMPLE_RATE, NUM_CHANNELS);
+    sonicStream freshStream = sonicCreateStream(SAMPLE_RATE, NUM_CHANNELS);
+    short input[3000 * NUM_CHANNELS];
+    short expected[6000 * NUM_CHANNELS];
+    short output[6000 * NUM_CHANNELS];
+    int i, numExpected, numOutput, passed = 1;
+
+    for (i = 0; i < 3000 * NUM_CHANNELS; i++) {
+        input[i] = (i * 29) % 5000 - 2500;
+    }
+    /* Leave samples and settings in the stream, then reset it. */
+    sonicSetRate(stream, 2.0f);
+    sonicSetVolume(stream, 0.5f);
+    sonicSetUserData(stream, stream);
+    sonicWriteShortToStream(stream, input, 3000);
+    sonicResetStream(stream);
+    if (sonicSamplesAvailable(stream) != 0 || sonicGetRate(stream) != 1.0f ||
+        sonicGetVolume(stream) != 1.0f ||
+        sonicGetUserData(stream) != stream) {
+        fprintf(stderr, "sonicResetStream did not reset the stream\n");
+        passed = 0;
+    }
+    numExpected = processWithStream(freshStream, input, 3000, expected, 6000);
+    numOutput = processWithStream(stream, input, 3000, output, 6000);
+    if (numOutput != numExpected ||
+        memcmp(output, expected, numOutput * NUM_CHANNELS * sizeof(short))) {
+        fprintf(stderr, "A reset stream does not match a new one\n");
+        passed = 0;
+    }
+    sonicDestroyStream(stream);
+    sonicDestroyStream(freshStream);
+    return passed;
+}
+
+int sonicTestStreamPool(void) {
+    sonicStream stream = sonicAcquirePooledStream(SAMPLE_RATE, NUM_CHANNELS);
+    sonicStream otherStream;
+    short samples[2000];
+    short expected[2000];
+    int i, numExpected, numSamples, passed = 1;
+
+    sonicSetSpeed(stream, 3.0f);
+    sonicReleasePooledStream(stream);
+    otherStream = sonicAcquirePooledStream(SAMPLE_RATE, 1);
+    if (otherStream == stream) {
+        fprintf(stderr, "The stream pool ignored the number of channels\n");
+        passed = 0;
+    }
+    if (sonicAcquirePooledStream(SAMPLE_RATE, NUM_CHANNELS) != stream ||
+        sonicGetSpeed(stream) != 1.0f) {
+        fprintf(stderr, "The stream pool did not reuse the reset stream\n");
+        passed = 0;
+    }
+    sonicReleasePooledStream(stream);
+    sonicReleasePooledStream(otherStream);
+    /* A stream whose buffers grew is destroyed rather than pooled, so the
+       next stream acquired is the one pooled before it. */
+    stream = sonicAcquirePooledStream(SAMPLE_RATE, 1);
+    otherStream = sonicAcquirePooledStream(SAMPLE_RATE, 1);
+    memset(samples, 0, sizeof(samples));
+    for (i = 0; i < 100; i++) {
+        sonicWriteShortToStream(otherStream, samples, 2000);
+    }
+    sonicReleasePooledStream(stream);
+    sonicReleasePooledStream(otherStream);
+    otherStream = sonicAcquirePooledStream(SAMPLE_RATE, 1);
+    if (otherStream != stream) {
+        fprintf(stderr, "The stream pool kept a stream with large buffers\n");
+        passed = 0;
+    }
+    sonicReleasePooledStream(otherStream);
+    /* The batch functions should work the same with pooled streams. */
+    for (i = 0; i < 1000; i++) {
+        samples[i] = (i * 43) % 3000 - 1500;
+    }
+    memcpy(expected, samples, sizeof(samples));
+    numExpected = sonicChangeShortSpeed(expected, 1000, 1.7f, 1.0f, 1.0f,
+                                        1.0f, 0, SAMPLE_RATE, 1);
+    numSamples = sonicChangeShortSpeed(samples, 1000, 1.7f, 1.0f, 1.0f, 1.0f,
+                                       0, SAMPLE_RATE, 1);
+    if (numSamples != numExpected ||
+        memcmp(samples, expected, numSamples * sizeof(short))) {
+        fprintf(stderr, "sonicChangeShortSpeed changed with pooling\n");
+        passed = 0;
+    }
+    sonicDestroyStreamPool();
+    return passed;
+}
+
+int sonicTestMaxMemory(void) {
+    sonicStream stream = sonicCreateStream(SAMPLE_RATE, NUM_CHANNELS);
+    short input[1000 * NUM_CHANNELS];
+    short output[1000 * NUM_CHANNELS];
+    int i, numWritten, totalWritten = 0, passed = 1;
+
+    for (i = 0; i < 1000 * NUM_CHANNELS; i++) {
+        input[i] = (i * 61) % 6000 - 3000;
+    }
+    if (sonicGetMaxMemory(stream) != 0) {
+        fprintf(stderr, "Streams should not have a memory limit by default\n");
+        return 0;
+    }
+    sonicSetMaxMemory(stream, 100000);
+    sonicSetSpeed(stream, 0.5f);
+    /* Without reading, writes should stop once the limit is reached. */
+    for (i = 0; i < 100; i++) {
+        numWritten = sonicTryWriteShortToStream(stream, input, 1000);
+        if (numWritten < 0) {
+            fprintf(stderr, "sonicTryWriteShortToStream failed\n");
+            passed = 0;
+            break;
+        }
+        totalWritten += numWritten;
+    }
+    if (passed && (numWritten != 0 || totalWritten == 0)) {
+        fprintf(stderr, "sonicTryWriteShortToStream ignored the limit\n");
+        passed = 0;
+    }
+    /* Once the output is read, there should be room again. */
+    while (sonicReadShortFromStream(stream, output, 1000) > 0);
+    if (passed && sonicTryWriteShortToStream(stream, input, 1000) <= 0) {
+        fprintf(stderr, "Reading the output did not make room\n");
+        passed = 0;
+    }
+    sonicDestroyStream(stream);
+    return passed;
+}
+
+int sonicTestFloatProcessing(void) {
+    sonicStream stream = sonicCreateStream(SAMPLE_RATE, NUM_CHANNELS);
+    sonicStream floatStream = sonicCreateStream(SAMPLE_RATE, NUM_CHANNELS);
+    float floatInput[1000 * NUM_CHANNELS];
+    float floatOutput[1000 * NUM_CHANNELS];
+    short input[4000 * NUM_CHANNELS];
+    short expected[4000 * NUM_CHANNELS];
+    short output[4000 * NUM_CHANNELS];
+    const float* peeked;
+    const short* peekedShorts;
+    short* shortBuffer;
+    float* buffer;
+    int i, numExpected, numOutput, passed = 1;
+
+    if (sonicGetFloatProcessing(floatStream) ||
+        !sonicSetFloatProcessing(floatStream, 1) ||
+        !sonicGetFloatProcessing(floatStream)) {
+        fprintf(stderr, "sonicSetFloatProcessing did not enable floats\n");
+        return 0;
+    }
+    /* At speed 1, floats should pass through unchanged, even when they are
+       too small or too large for 16 bits. */
+    for (i = 0; i < 1000 * NUM_CHANNELS; i++) {
+        floatInput[i] = (i % 2 ? 1.0e-6f : 1.5f) * ((i % 7) - 3);
+    }
+    sonicWriteFloatToStream(floatStream, floatInput, 1000);
+    sonicFlushStream(floatStream);
+    if (sonicReadFloatFromStream(floatStream, floatOutput, 1000) != 1000 ||
+        memcmp(floatInput, floatOutput, sizeof(floatInput))) {
+        fprintf(stderr, "Float processing changed samples at speed 1\n");
+        passed = 0;
+    }
+    /* The same input in both modes should give nearly the same output. */
+    for (i = 0; i < 4000 * NUM_CHANNELS; i++) {
+        input[i] = (i * 29) % 4000 - 2000;
+    }
+    numExpected = processWithStream(stream, input, 4000, expected, 4000);
+    numOutput = processWithStream(floatStream, input, 4000, output, 4000);
+    if (numOutput != numExpected) {
+        fprintf(stderr, "Float processing changed the output length\n");
+        passed = 0;
+    }
+    for (i = 0; passed && i < numOutput * NUM_CHANNELS; i++) {
+        if (abs(output[i] - expected[i]) > 4) {
+            fprintf(stderr, "Float processing differs from 16-bit output\n");
+            passed = 0;
+        }
+    }
+    /* Output is peeked and input acquired as floats. */
+    if (sonicAcquireInput(floatStream, 1000, &shortBuffer) != 0 ||
+        sonicAcquireFloatInput(floatStream, 1000, &buffer) < 1000) {
+        fprintf(stderr, "sonicAcquireFloatInput failed\n");
+        passed = 0;
+    } else {
+        memcpy(buffer, floatInput, sizeof(floatInput));
+        sonicCommitInput(floatStream, 1000);
+        sonicFlushStream(floatStream);
+        if (sonicPeekOutput(floatStream, &peekedShorts) != 0 ||
+            sonicPeekFloatOutput(floatStream, &peeked) !=
+                sonicSamplesAvailable(floatStream)) {
+            fprintf(stderr, "sonicPeekFloatOutput failed\n");
+            passed = 0;
+        }
+    }
+    /* Switching modes mid-stream keeps the buffered samples. */
+    sonicResetStream(stream);
+    sonicResetStream(floatStream);
+    sonicSetSpeed(stream, 1.5f);
+    sonicSetSpeed(floatStream, 1.5f);
+    for (i = 0; i < 4; i++) {
+        if (i == 1 || i == 3) {
+            sonicSetFloatProcessing(floatStream, i == 1);
+        }
+        sonicWriteShortToStream(stream, input + i * 1000 * NUM_CHANNELS, 1000);
+        sonicWriteShortToStream(floatStream, input + i * 1000 * NUM_CHANNELS,
+                                1000);
+    }
+    sonicFlushStream(stream);
+    sonicFlushStream(floatStream);
+    numExpected = sonicReadShortFromStream(stream, expected, 4000);
+    numOutput = sonicReadShortFromStream(floatStream, output, 4000);
+    if (numOutput != numExpected) {
+        fprintf(stderr, "Switching to floats changed the output length\n");
+        passed = 0;
+    }
+    for (i = 0; passed && i < numOutput * NUM_CHANNELS; i++) {
+        if (abs(output[i] - expected[i]) > 4) {
+            fprintf(stderr, "Switching to floats changed the output\n");
+            passed = 0;
+        }
+    }
+    sonicDestroyStream(stream);
+    sonicDestroyStream(floatStream);
+    return passed;
+}
+
+int sonicTestPlanarIO(void) {
+    sonicStream stream = sonicCreateStream(SAMPLE_RATE, NUM_CHANNELS);
+    sonicStream planarStream = sonicCreateStream(SAMPLE_RATE, NUM_CHANNELS);
+    short input[1000 * NUM_CHANNELS];
+    short expected[2000 * NUM_CHANNELS];
+    short channelInput[NUM_CHANNELS][1000];
+    short channelOutput[NUM_CHANNELS][2000];
+    float floatInput[NUM_CHANNELS][1000];
+    float floatOutput[NUM_CHANNELS][2000];
+    const short* inputs[NUM_CHANNELS];
+    const float* floatInputs[NUM_CHANNELS];
+    short* outputs[NUM_CHANNELS];
+    float* floatOutputs[NUM_CHANNELS];
+    int i, j, pass, numExpected, numOutput, passed = 1;
+
+    for (i = 0; i < 1000; i++) {
+        for (j = 0; j < NUM_CHANNELS; j++) {
+            input[i * NUM_CHANNELS + j] = (i * 41 + j * 700) % 3000 - 1500;
+            channelInput[j][i] = input[i * NUM_CHANNELS + j];
+            floatInput[j][i] = channelInput[j][i] / 32767.0f;
+        }
+    }
+    for (j = 0; j < NUM_CHANNELS; j++) {
+        inputs[j] = channelInput[j];
+        floatInputs[j] = floatInput[j];
+        outputs[j] = channelOutput[j];
+        floatOutputs[j] = floatOutput[j];
+    }
+    /* Planar I/O should match interleaved I/O, in both processing modes. */
+    for (pass = 0; pass < 2 && passed; pass++) {
+        sonicSetFloatProcessing(stream, pass);
+        sonicSetFloatProcessing(planarStream, pass);
+        sonicSetSpeed(stream, 0.8f);
+        sonicSetSpeed(planarStream, 0.8f);
+        for (i = 0; i < 10 && passed; i++) {
+            sonicWriteShortToStream(stream, input, 1000);
+            if (i % 2) {
+                sonicWriteShortPlanarToStream(planarStream, inputs, 1000);
+                numOutput = sonicReadShortPlanarFromStream(planarStream,
+                                                           outputs, 2000);
+            } else {
+                sonicWriteFloatPlanarToStream(planarStream, floatInputs,
+                                              1000);
+                numOutput = sonicReadFloatPlanarFromStream(planarStream,
+                                                           floatOutputs, 2000);
+                for (j = 0; j < numOutput * NUM_CHANNELS; j++) {
+                    channelOutput[j % NUM_CHANNELS][j / NUM_CHANNELS] =
+                        floatOutput[j % NUM_CHANNELS][j / NUM_CHANNELS] *
+                        32767.0f;
+                }
+            }
+            numExpected = sonicReadShortFromStream(stream, expected, 2000);
+            if (numOutput != numExpected) {
+                fprintf(stderr, "Planar I/O changed the output length\n");
+                passed = 0;
+            }
+            for (j = 0; passed && j < numOutput * NUM_CHANNELS; j++) {
+                if (abs(channelOutput[j % NUM_CHANNELS][j / NUM_CHANNELS] -
+                        expected[j]) > 1) {
+                    fprintf(stderr, "Planar I/O does not match interleaved "
+                            "I/O\n");
+                    passed = 0;
+                }
+            }
+        }
+        sonicResetStream(stream);
+        sonicResetStream(planarStream);
+    }
+    sonicDestroyStream(stream);
+    sonicDestroyStream(planarStream);
+    return passed;
+}
+
+int sonicTestSampleFormats(void) {
+    sonicStream stream = sonicCreateStream(SAMPLE_RATE, NUM_CHANNELS);
+    sonicStream intStream = sonicCreateStream(SAMPLE_RATE, NUM_CHANNELS);
+    short input[1000 * NUM_CHANNELS];
+    short expected[2000 * NUM_CHANNELS];
+    int intSamples[2000 * NUM_CHANNELS];
+    unsigned char int24Samples[3 * 2000 * NUM_CHANNELS];
+    unsigned char* sample;
+    float loud[4] = {2.0f, -2.0f, 0.5f, -0.5f};
+    short clipped[4];
+    long value;
+    int i, numExpected, numOutput, passed = 1;
+
+    for (i = 0; i < 1000 * NUM_CHANNELS; i++) {
+        input[i] = (i * 47) % 6000 - 3000;
+    }
+    /* 32-bit and 24-bit samples holding shorts give the same output. */
+    sonicSetSpeed(stream, 1.3f);
+    sonicSetSpeed(intStream, 1.3f);
+    sonicWriteShortToStream(stream, input, 1000);
+    sonicFlushStream(stream);
+    numExpected = sonicReadShortFromStream(stream, expected, 2000);
+    for (i = 0; i < 1000 * NUM_CHANNELS; i++) {
+        intSamples[i] = input[i] * 65536;
+    }
+    sonicWriteIntToStream(intStream, intSamples, 1000);
+    sonicFlushStream(intStream);
+    numOutput = sonicReadIntFromStream(intStream, intSamples, 2000);
+    if (numOutput != numExpected) {
+        fprintf(stderr, "32-bit samples changed the output length\n");
+        passed = 0;
+    }
+    for (i = 0; passed && i < numOutput * NUM_CHANNELS; i++) {
+        if (intSamples[i] != expected[i] * 65536) {
+            fprintf(stderr, "32-bit samples changed the output\n");
+            passed = 0;
+        }
+    }
+    for (i = 0; i < 1000 * NUM_CHANNELS; i++) {
+        sample = int24Samples + 3 * i;
+        value = input[i] * 256L;
+        sample[0] = value & 0xff;
+        sample[1] = (value >> 8) & 0xff;
+        sample[2] = (value >> 16) & 0xff;
+    }
+    sonicWriteInt24ToStream(intStream, int24Samples, 1000);
+    sonicFlushStream(intStream);
+    numOutput = sonicReadInt24FromStream(intStream, int24Samples, 2000);
+    if (numOutput != numExpected) {
+        fprintf(stderr, "24-bit samples changed the output length\n");
+        passed = 0;
+    }
+    for (i = 0; passed && i < numOutput * NUM_CHANNELS; i++) {
+        sample = int24Samples + 3 * i;
+        value = sample[0] | (sample[1] << 8);
+        value += (long)(signed char)sample[2] * 65536;
+        if (value != expected[i] * 256L) {
+            fprintf(stderr, "24-bit samples changed the output\n");
+            passed = 0;
+        }
+    }
+    /* Floats are rounded and clipped when converted to shorts. */
+    sonicResetStream(stream);
+    sonicWriteFloatToStream(stream, loud, 2);
+    sonicFlushStream(stream);
+    if (sonicReadShortFromStream(stream, clipped, 2) != 2 ||
+        clipped[0] != 32767 || clipped[1] != -32768 || clipped[2] != 16384 ||
+        clipped[3] != -16384) {
+        fprintf(stderr, "Float samples were not rounded and clipped\n");
+        passed = 0;
+    }
+    /* Processing floats keeps all 24 bits. */
+    sonicResetStream(intStream);
+    sonicSetFloatProcessing(intStream, 1);
+    for (i = 0; i < 3 * 1000 * NUM_CHANNELS; i++) {
+        int24Samples[i] = (unsigned char)(i * 97 + 13);
+    }
+    memcpy(int24Samples + 3000 * NUM_CHANNELS, int24Samples,
+           3000 * NUM_CHANNELS);
+    sonicWriteInt24ToStream(intStream, int24Samples, 1000);
+    sonicFlushStream(intStream);
+    if (sonicReadInt24FromStream(intStream, int24Samples, 1000) != 1000 ||
+        memcmp(int24Samples, int24Samples + 3000 * NUM_CHANNELS,
+               3000 * NUM_CHANNELS)) {
+        fprintf(stderr, "Processing floats lost 24-bit precision\n");
+        passed = 0;
+    }
+    sonicDestroyStream(stream);
+    sonicDestroyStream(intStream);
+    return passed;
+}
+
+/* Return the RMS level of the samples. */
+static double blockLevel(const short* samples, int numSamples) {
+    double sum = 0.0;
+    int i;
+
+    for (i = 0; i < numSamples; i++) {
+        sum += (double)samples[i] * samples[i];
+    }
+    return sqrt(sum / numSamples);
+}
+
+/* Return 1 if the block at samples is about as loud as the ones around it. */
+static int isSteadyBlock(const short* samples, int blockSize) {
+    double level = blockLevel(samples, blockSize);
+
+    return fabs(blockLevel(samples - blockSize, blockSize) - level) <=
+               0.1 * level + 100.0 &&
+           fabs(blockLevel(samples + blockSize, blockSize) - level) <=
+               0.1 * level + 100.0;
+}
+
+int sonicTestParallelSpeed(void) {
+    int sampleRate = 8000;
+    int numSamples = 35 * sampleRate;
+    int maxSamples = 2 * numSamples;
+    short* input = (short*)malloc(maxSamples * sizeof(short));
+    short* expected = (short*)malloc(maxSamples * sizeof(short));
+    short* output = (short*)malloc(maxSamples * sizeof(short));
+    float* floatOutput = (float*)malloc(maxSamples * sizeof(float));
+    double level;
+    int i, numExpected, numOutput, numParallel, passed = 1;
+
+    /* Half-second bursts of a buzz with a changing period, between pauses. */
+    for (i = 0; i < numSamples; i++) {
+        input[i] = (i / 4000) % 2 ? 0 : (i % (50 + i / 8000)) * 200 - 5000;
+    }
+    /* Run with threads first, so they are the first to call into the
+       library. */
+    memcpy(output, input, numSamples * sizeof(short));
+    numOutput = sonicChangeShortSpeedParallel(output, numSamples, 1.7f, 1.0f,
+                                              1.0f, 1.0f, sampleRate, 1, 3);
+    memcpy(expected, input, numSamples * sizeof(short));
+    numExpected = sonicChangeShortSpeed(expected, numSamples, 1.7f, 1.0f, 1.0f,
+                                        1.0f, 0, sampleRate, 1);
+    /* More threads should give about the same length. */
+    if (abs(numOutput - numExpected) > numExpected / 1000) {
+        fprintf(stderr, "Parallel speed change gave %d samples, not %d\n",
+                numOutput, numExpected);
+        passed = 0;
+    }
+    /* Each seam can shift the output by up to a pitch period, so compare the
+       loudness of short blocks rather than samples, away from the edges of
+       the bursts.  A misplaced segment or a bad cross-fade changes it. */
+    for (i = 100; i + 200 <= numOutput && i + 200 <= numExpected; i += 100) {
+        level = blockLevel(expected + i, 100);
+        if (isSteadyBlock(expected + i, 100) &&
+            fabs(blockLevel(output + i, 100) - level) > 0.25 * (level + 100)) {
+            fprintf(stderr, "Parallel output differs at sample %d\n", i);
+            passed = 0;
+            break;
+        }
+    }
+    for (i = 0; i < numSamples; i++) {
+        floatOutput[i] = input[i] / 32767.0f;
+    }
+    numParallel = sonicChangeFloatSpeedParallel(floatOutput, numSamples, 1.7f,
+                                                1.0f, 1.0f, 1.0f, sampleRate,
+                                                1, 3);
+    if (numParallel != numOutput) {
+        fprintf(stderr, "Parallel float speed change gave %d samples, not "
+                "%d\n", numParallel, numOutput);
+        passed = 0;
+    }
+    /* One thread is the same as the serial function. */
+    memcpy(output, input, numSamples * sizeof(short));
+    numOutput = sonicChangeShortSpeedParallel(output, numSamples, 1.7f, 1.0f,
+                                              1.0f, 1.0f, sampleRate, 1, 1);
+    if (numOutput != numExpected ||
+        memcmp(output, expected, numOutput * sizeof(short))) {
+        fprintf(stderr, "One thread differs from sonicChangeShortSpeed\n");
+        passed = 0;
+    }
+    free(input);
+    free(expected);
+    free(output);
+    free(floatOutput);
+    return passed;
+}
+
+/* Read all the output of a scheduled stream. */
+static int readScheduledOutput(sonicStream stream, short* samples,
+                               int maxSamples) {
+    int numSamples = 0;
+    int count;
+
+    do {
+        count = sonicReadScheduledShortOutput(stream, samples + numSamples,
+                                              maxSamples - numSamples);
+        numSamples += count;
+    } while (count > 0);
+    return numSamples;
+}
+
+int sonicTestScheduler(void) {
+    int sampleRate = 8000;
+    int chunkSize = 800;
+    int numChunks = 20;
+    int numStreams = 4;
+    int maxSamples = 2 * chunkSize * numChunks;
+    short* input = (short*)malloc(chunkSize * numChunks * sizeof(short));
+    short* expected = (short*)malloc(maxSamples * sizeof(short));
+    short* output = (short*)malloc(maxSamples * sizeof(short));
+    sonicScheduler scheduler = sonicCreateScheduler(3);
+    sonicStream streams[4];
+    sonicStream reference;
+    int i, chunk, numExpected, numOutput, passed = 1;
+
+    if (scheduler == NULL) {
+        fprintf(stderr, "Could not create a scheduler\n");
+        return 0;
+    }
+    for (i = 0; i < chunkSize * numChunks; i++) {
+        input[i] = (i % (40 + i / 1600)) * 300 - 6000;
+    }
+    for (i = 0; i < numStreams; i++) {
+        streams[i] = sonicCreateStream(sampleRate, 1);
+        sonicSetSpeed(streams[i], 1.0f + 0.4f * i);
+        if (!sonicAddStreamToScheduler(scheduler, streams[i])) {
+            fprintf(stderr, "Could not add a stream to the scheduler\n");
+            passed = 0;
+        }
+    }
+    if (sonicAddStreamToScheduler(scheduler, streams[0])) {
+        fprintf(stderr, "A stream was added to a scheduler twice\n");
+        passed = 0;
+    }
+    /* Waiting for each chunk to be processed gives the same output as
+       writing the chunks directly. */
+    for (chunk = 0; chunk < numChunks; chunk++) {
+        for (i = 0; i < numStreams; i++) {
+            sonicScheduleShortInput(streams[i], input + chunk * chunkSize,
+                                    chunkSize,
+                                    sonicGetSchedulerTime(scheduler) + 1.0);
+        }
+        for (i = 0; i < numStreams; i++) {
+            sonicWaitForScheduledStream(streams[i]);
+        }
+    }
+    for (i = 0; i < numStreams; i++) {
+        sonicScheduleFlush(streams[i], sonicGetSchedulerTime(scheduler));
+        if (!sonicWaitForScheduledStream(streams[i])) {
+            fprintf(stderr, "Scheduled stream %d failed\n", i);
+            passed = 0;
+        }
+        numOutput = readScheduledOutput(streams[i], output, maxSamples);
+        reference = sonicCreateStream(sampleRate, 1);
+        sonicSetSpeed(reference, 1.0f + 0.4f * i);
+        for (chunk = 0; chunk < numChunks; chunk++) {
+            sonicWriteShortToStream(reference, input + chunk * chunkSize,
+                                    chunkSize);
+        }
+        sonicFlushStream(reference);
+        numExpected = sonicReadShortFromStream(reference, expected,
+                                               maxSamples);
+        sonicDestroyStream(reference);
+        if (numOutput != numExpected ||
+            memcmp(output, expected, numOutput * sizeof(short))) {
+            fprintf(stderr, "Scheduled stream %d differs\n", i);
+            passed = 0;
+        }
+    }
+    /* Input already past its deadline is processed late. */
+    sonicScheduleShortInput(streams[0], input, chunkSize,
+                            sonicGetSchedulerTime(scheduler) - 1.0);
+    sonicWaitForScheduledStream(streams[0]);
+    if (sonicGetStreamLag(streams[0]) < 1.0) {
+        fprintf(stderr, "Stream lag %f is too small\n",
+                sonicGetStreamLag(streams[0]));
+        passed = 0;
+    }
+    sonicRemoveStreamFromScheduler(streams[0]);
+    if (sonicScheduleShortInput(streams[0], input, chunkSize, 0.0)) {
+        fprintf(stderr, "Removed stream accepted scheduled input\n");
+        passed = 0;
+    }
+    /* Streams can be destroyed while in a scheduler, and the rest are removed
+       when it is destroyed. */
+    sonicScheduleShortInput(streams[1], input, chunkSize, 0.0);
+    sonicDestroyStream(streams[1]);
+    sonicScheduleShortInput(streams[2], input, chunkSize, 0.0);
+    sonicDestroyScheduler(scheduler);
+    sonicDestroyStream(streams[0]);
+    sonicDestroyStream(streams[2]);
+    sonicDestroyStream(streams[3]);
+    free(input);
+    free(expected);
+    free(output);
+    return passed;
+}
@@ -13,10 +13,32 @@ extern "C" {
 int sonicTestInputClamping(void);
 int sonicTestInputClamping(void);
 int sonicTestInputsDontCrash(void);
+int sonicTestExtremeSpeedsAtLowRate(void);
 int sonicTestStreamCreation(void);
 int sonicTestParameters(void);
 int sonicTestFlush(void);
 int sonicTestSimpleProcessing(void);
+int sonicTestPeekOutput(void);
+int sonicTestAcquireInput(void);
+int sonicTestStreamInBuffer(void);
+int sonicTestStreamInBufferSettings(void);
+int sonicTestResetStream(void);
+int sonicTestStreamPool(void);
+int sonicTestMaxMemory(void);
+int sonicTestFloatProcessing(void);
+int sonicTestPlanarIO(void);
+int sonicTestSampleFormats(void);
+int sonicTestParallelSpeed(void);
+int sonicTestScheduler(void);
+int sonicTestIncrementalPitchSearch(void);
+int sonicTestPitchTracking(void);
+int sonicTestPitchPruning(void);
+int sonicTestPitchChannel(void);
+int sonicTestPitchPyramid(void);
+int sonicTestSilenceFastPath(void);
+int sonicTestFFTPitchDetector(void);
+int sonicTestResampler(void);
+int sonicTestKernels(void);
 
 #ifdef __cplusplus
 }